@@ -1,13 +1,28 @@
 #include "OpenSmartBattery.hpp"
+#include "adc.hpp"
+#include "block.hpp"
+#include "broadcast.hpp"
+#include "charge.hpp"
 #include "authentication.hpp"
+#include "commands.hpp"
 #include "config.hpp"
+#include "coulomb.hpp"
+#include "kalman.hpp"
+#include "ocv.hpp"
+#include "protection.hpp"
+#include "registers.hpp"
+#include "replies.hpp"
+#include "reply.hpp"
+#include "scheduler.hpp"
+#include "smbus.hpp"
+#include "telemetry.hpp"
+#include "thermistor.hpp"
 #include "utils.hpp"
+#include "writes.hpp"
 
 #include <string.h>
 #include <stdint.h>
 
-#include <Wire.h>
-
 // Comments ending with * are either paraphrases or excerpts from this excellent RichTek article on Li-ion fuel gauging:
 // https://www.richtek.com/Design%20Support/Technical%20Document/AN024
 // (archived) https://web.archive.org/web/20221007161707/https://www.richtek.com/Design%20Support/Technical%20Document/AN024 
@@ -16,642 +31,821 @@ namespace OpenSmartBattery {
     // Note on replies in SMBus: Bit order is MSB -> LSB, but byte order is LSB -> MSB
 
     volatile uint8_t COMMAND = 0;    // Stores current command
-    uint8_t REPLY_BUFFER[20];        // Stores reply to current command; this is really 32 bytes by spec
-    uint8_t COMMAND_DATA_BUFFER[20]; // Stores the data portion of the current command; this is really 32 bytes by spec
+
+    using AuthenticationScheme = BatteryConfig::AuthenticationScheme;
+
+    // The challenge written to 0x2f, worked into its response by the main loop (see stepAuthentication). The
+    // block arena is reused by every transaction, so it is kept here.
+    const uint8_t AUTHENTICATION_SIZE = Authentication::CHALLENGE_SIZE > AuthenticationScheme::RESPONSE_SIZE
+                                      ? Authentication::CHALLENGE_SIZE : AuthenticationScheme::RESPONSE_SIZE;
+    uint8_t AUTHENTICATION[AUTHENTICATION_SIZE];
+    volatile uint8_t AUTHENTICATION_STEP = AuthenticationScheme::STEPS;  // Next step, or STEPS when there is none
+    uint8_t AUTHENTICATION_LENGTH = 0;  // Of the response; none before the first challenge
 
     Utils::PowerState POWER_STATE       = Utils::PowerState::idling;
     Utils::BatteryMode BATTERY_MODE     = Utils::BatteryMode();
     Utils::BatteryStatus BATTERY_STATUS = Utils::BatteryStatus();
 
-    unsigned long ALARM_MODE_SET_AT = millis();
+    // What the host reads back before it has written anything: SBS defaults of 10% and 10 minutes
+    constexpr Registers::RegisterFile initialRegisters() {
+        Registers::RegisterFile registers;
+        registers.preset(Registers::RemainingCapacityAlarm, Utils::BATTERY_CAPACITY_DESIGN / 10);
+        registers.preset(Registers::RemainingTimeAlarm, 10);
+        return registers;
+    }
+
+    Telemetry TELEMETRY;
+    Registers::RegisterFile REGISTERS = initialRegisters();  // Hot word registers, served straight from RAM
+
+    // Calibration is in ADC codes of the current channel, which oversampling would scale
+    constexpr Coulomb::Calibration CURRENT_CALIBRATION PROGMEM = {
+        HardwareConfig::CURRENT_ZERO_CODE << Analog::oversampleBits(Analog::Current),
+        HardwareConfig::CURRENT_MICROAMPS_PER_LSB >> Analog::oversampleBits(Analog::Current),
+        HardwareConfig::CURRENT_DEADBAND_MILLIAMPS * 1000,
+        Analog::samplesPerHour(Analog::Current)
+    };
+
+    Coulomb::Counter COULOMB_COUNTER(CURRENT_CALIBRATION, Utils::BATTERY_CAPACITY * 1000UL);
+    uint16_t CURRENT_OVERRUNS = 0;  // Analog::overruns() already integrated
+    OCV::RestDetector REST;
+    Kalman::Filter ESTIMATOR;
+    bool ESTIMATING = false;           // ESTIMATOR has been reset to the first OCV reading
+    uint32_t ESTIMATED_REMAINING = Utils::BATTERY_CAPACITY * 1000UL;  // Counter's remaining after the last estimate, uAh
+    uint8_t MAX_ERROR = 100;           // Nothing is known until the first estimate
+    bool MEASURED = false;             // The last checks ran on full ADC rings: the published cells are real
+
+    uint16_t TEMPERATURE = 2982;       // 0.1K, measured every 5ms
+    bool CHARGE_TEMPERATURE_OK = true; // Inside the charging window, with hysteresis
+    uint16_t OVER_CURRENT_AT = 0;      // Last tick without an over-current fault latched
+
+
+    // Requests ChargingCurrent and ChargingVoltage; its rates are relative to the worn capacity
+    Charge::Controller CHARGER(Utils::BATTERY_CAPACITY);
+    static_assert((uint32_t)Utils::BATTERY_CAPACITY * BatteryConfig::CHARGE_RATE / 100 < BatteryConfig::OVER_CURRENT_CHARGE,
+                  "CHARGE_RATE would trip the charge over-current protection");
+
+    // Scheduler tick, not millis(): Timer0 stops during ADC noise reduction sleep, Timer1 is compensated for it
+    uint16_t ALARM_MODE_SET_AT = 0;
 
     // ====
 
     namespace RequestHandlers {
         /**
          * Each handler name is prefixed by the byte associated with the command
-         * When called, each handler writes to the REPLY_BUFFER (passed in as *buff) from LSB->MSB
-         * The handler then returns the number of bytes written to the buffer
+         * When called, each handler streams its reply into the ReplyWriter from LSB->MSB
+         * The writer takes care of the length byte of block commands and of the PEC
+         *
+         * Handlers run in the SMBus interrupt. Measured values come from TELEMETRY, whose words are stored whole,
+         * never from state the main loop may be halfway through updating.
         **/
 
-        inline uint8_t x00_ManufacturerAccess(uint8_t *buff) {
-            buff[0] = 0x00;
-            buff[1] = 0x00;
-
-            return 2;
+        inline void x00_ManufacturerAccess(ReplyWriter &reply) {
+            reply.writeWord(0x0000);
         }
 
-        inline uint8_t x01_BatteryCapacityAlarm(uint8_t *buff) {
-            // TODO
+        // 0x01-0x04 are in the register file
 
-            buff[0] = 0x94;
-            buff[1] = 0x02;
+        inline void x05_AtRateTimeToFull(ReplyWriter &reply) {
+            // TODO
 
-            return 2;
+            reply.writeWord(0x0000);
         }
 
-        inline uint8_t x02_RemainingTimeAlarm(uint8_t *buff) {
+        inline void x06_AtRateTimeToEmpty(ReplyWriter &reply) {
             // TODO
 
-            buff[0] = 0x0A;
-            buff[1] = 0x00;
+            reply.writeWord(0xffff);
 
-            return 2;
+            // reply.writeWord(0x00f0);  // f0 = 240 = 4h
         }
 
-        inline uint8_t x03_BatteryMode(uint8_t *buff) {
-            uint8_t lower, higher;
-
-            BATTERY_MODE.asSplitBytes(&higher, &lower);
-            buff[0] = lower;
-            buff[1] = higher;
+        inline void x07_AtRateOK(ReplyWriter &reply) {
+            // TODO
 
-            return 2;
+            reply.writeWord(0x0001);
         }
 
-        inline uint8_t x04_AtRate(uint8_t *buff) {
-            // TODO
-            buff[0] = 0x00;
-            buff[1] = 0x00;
+        inline void x08_Temperature(ReplyWriter &reply) {
+            reply.writeWord(TELEMETRY.temperature);
+        }
 
-            return 2;
+        inline void x0b_AverageCurrent(ReplyWriter &reply) {
+            reply.writeWord(TELEMETRY.averageCurrent);
         }
 
-        inline uint8_t x05_AtRateTimeToFull(uint8_t *buff) {
-            // TODO
+        inline void x0c_MaxError(ReplyWriter &reply) {
+            reply.writeWord(TELEMETRY.maxError);
+        }
 
-            buff[0] = 0x00;
-            buff[1] = 0x00;
+        inline void x0e_AbsoluteStateOfCharge(ReplyWriter &reply) {
+            reply.writeWord(TELEMETRY.absoluteStateOfCharge);
+        }
 
-            return 2;
+        inline void x10_FullChargeCapacity(ReplyWriter &reply) {
+            reply.writeWord(TELEMETRY.fullChargeCapacity);
         }
 
-        inline uint8_t x06_AtRateTimeToEmpty(uint8_t *buff) {
+        inline void x11_RunTimeToEmpty(ReplyWriter &reply) {
             // TODO
 
-            buff[0] = 0xff;
-            buff[1] = 0xff;
-
-            return 2;
-        
-            /*buff[0] = 0xf0;  // f0 = 240 = 4h
-            buff[1] = 0x00;
-
-            return 2;*/
+            // 0x00f0 = 240 minutes = 4 hours
+            reply.writeWord(0x00f0);
         }
 
-        inline uint8_t x07_AtRateOK(uint8_t *buff) {
+        inline void x12_AverageRuneTimeToEmpty(ReplyWriter &reply) {
             // TODO
 
-            buff[0] = 0x01;
-            buff[1] = 0x00;
-
-            return 2;
+            // 0x00f0 = 240 minutes = 4 hours
+            reply.writeWord(0x00f0);
         }
 
-        inline uint8_t x08_Temperature(uint8_t *buff) {
+        inline void x13_AverageTimeToFull(ReplyWriter &reply) {
             // TODO
-            // HardwareConfig::Pins::PACK_TEMP_SENSE
-
-            buff[0] = 137;
-            buff[1] = 11;
 
-            return 2;
+            // 0x00b4 = 180 minutes = 3 hours
+            reply.writeWord(0x00b4);
         }
 
-        inline uint8_t x09_Voltage(uint8_t *buff) {
-            // TODO
-
-            uint8_t lower, higher;
+        inline void x14_ChargingCurrentRequested(ReplyWriter &reply) {
+            reply.writeWord(TELEMETRY.chargingCurrent);
+        }
 
-            Utils::splitNum(Utils::V_HIGH, &higher, &lower);
-            buff[0] = lower;
-            buff[1] = higher;
+        inline void x15_ChargingVoltageRequested(ReplyWriter &reply) {
+            reply.writeWord(TELEMETRY.chargingVoltage);
+        }
 
-            return 2;
+        inline void x16_BatteryStatus(ReplyWriter &reply) {
+            // The flags as last published, but the error code as it is now: the interrupts set it, and the host
+            // reads it straight after the command it is about
+            reply.writeWord((TELEMETRY.batteryStatus & 0xfff0) | BATTERY_STATUS.errorCode);
         }
 
-        inline uint8_t x0a_PresentCurrentChargeOrDraw(uint8_t *buff) {
+        inline void x17_CycleCount(ReplyWriter &reply) {
             // TODO
-            // HardwareConfig::Pins::CURRENT_SENSE
 
-            uint8_t lower, higher;
+            reply.writeWord(0x0005);
+        }
 
-            if (POWER_STATE == Utils::PowerState::charging) {
-                Utils::splitNum(BatteryConfig::CELL_CAPACITY, &higher, &lower);
+        // 0x1d-0x1f
 
-            } else if (POWER_STATE == Utils::PowerState::discharging) {
-                Utils::splitNum((int16_t)-BatteryConfig::CELL_CAPACITY, &higher, &lower);
+        // 0x24-0x2e
 
-            } else {
-                lower = 0, higher = 0;
+        inline void x2f_Authenticate(ReplyWriter &reply) {
+            if (AUTHENTICATION_STEP < AuthenticationScheme::STEPS) {
+                reply.refuse(Utils::AlarmErrorCode::Busy);
+                return;
             }
 
-            buff[0] = lower;
-            buff[1] = higher;
-
-            return 2;
+            reply.writeBlock(AUTHENTICATION, AUTHENTICATION_LENGTH);
         }
 
-        inline uint8_t x0b_AverageCurrent(uint8_t *buff) {
-            // TODO
-            return x0a_PresentCurrentChargeOrDraw(buff);
-        }
+        // 0x31-0x34
 
-        inline uint8_t x0c_MaxError(uint8_t *buff) {
-            // TODO
+        // 0x36
 
-            buff[0] = 0x00;
-            buff[1] = 0x00;
+        // 0x38-0x3a
 
-            return 2;
+        // 0x3c-0x3e are one handler per cell
+        template<uint8_t cell>
+        inline void x3c_x3f_CellVoltage(ReplyWriter &reply) {
+            reply.writeWord(TELEMETRY.cellVoltage[cell]);
         }
 
-        inline uint8_t x0d_RelativeStateOfCharge(uint8_t *buff) {
-            // TODO
-
-            // 0x0064 = 100%
-            buff[0] = 100;
-            buff[1] = 0x00;
-
-            return 2;
+        // Only in the table with AUTH_KEY_READBACK, and then 16 bytes of secret are there to read, in flash
+        inline void x63_x66_AuthKey(ReplyWriter &reply) {
+            uint8_t offset = COMMAND - 0x63;
+            reply.writeFlash(AuthenticationScheme::SECRET + offset * 4, 4);
         }
+    }
 
-        inline uint8_t x0e_AbsoluteStateOfCharge(uint8_t *buff) {
-            // TODO
-
-            // 0x0064 = 100%
-            buff[0] = 100;
-            buff[1] = 0x00;
+    namespace StaticReplies {
+        // Replies that never change, generated from config.hpp at build time with their PEC
 
-            return 2;
-        }
+        constexpr auto x18_DesignCapacity    PROGMEM = wordReply(0x18, Utils::BATTERY_CAPACITY_DESIGN);
+        constexpr auto x19_DesignVoltage     PROGMEM = wordReply(0x19, BatteryConfig::BATTERY_VOLTAGE);
+        constexpr auto x1a_SpecificationInfo PROGMEM = wordReply(0x1a, BatteryConfig::SPECIFICATION_INFO);
+        constexpr auto x1b_ManufactureDate   PROGMEM = wordReply(0x1b, Utils::MANUFACTURE_DATE);
+        constexpr auto x1c_SerialNumber      PROGMEM = wordReply(0x1c, BatteryConfig::SERIAL_CODE);
 
-        inline uint8_t x0f_RemainingCapacity(uint8_t *buff) {
-            // TODO
+        constexpr auto x20_ManufacturerName  PROGMEM = blockReply(0x20, BatteryConfig::BATTERY_VENDOR);
+        constexpr auto x21_DeviceName        PROGMEM = blockReply(0x21, BatteryConfig::BATTERY_MODEL);
+        constexpr auto x22_DeviceChemistry   PROGMEM = blockReply(0x22, BatteryConfig::BATTERY_CHEMISTRY);
+        constexpr auto x23_ManufacturerData  PROGMEM = blockReply(0x23, BatteryConfig::MANUFACTURER_DATA);
 
-            uint8_t lower, higher;
+        // ?
+        constexpr uint8_t X30_DATA[] = { 112, 156, 191, 25, 132, 74, 151, 0, 11, 0 };
+        constexpr auto x30 PROGMEM = blockReply(0x30, X30_DATA);
 
-            Utils::splitNum(Utils::BATTERY_CAPACITY, &higher, &lower);
-            buff[0] = lower;
-            buff[1] = higher;
+        // ?
+        constexpr auto x35 PROGMEM = wordReply(0x35, 64);
 
-            return 2;
-        }
+        // ?
+        constexpr uint8_t X37_DATA[] = { 4, 0, 61, 94, 97, 1, 64, 1 };
+        constexpr auto x37 PROGMEM = blockReply(0x37, X37_DATA);
 
-        inline uint8_t x10_FullChargeCapacity(uint8_t *buff) {
-            uint8_t lower, higher;
+        // ?
+        constexpr auto x3b PROGMEM = wordReply(0x3b, 0x0B87);
 
-            Utils::splitNum(Utils::BATTERY_CAPACITY, &higher, &lower);
-            buff[0] = lower;
-            buff[1] = higher;
+        // There is no fourth cell
+        constexpr auto x3f_CellVoltage4 PROGMEM = wordReply(0x3f, 0);
+    }
 
-            return 2;
-        }
+    namespace Commands {
+        // Map command codes to event handlers, which stream their reply into the writer, or to precomputed replies.
+        // Commands that are not used or have not been implemented are UNSUPPORTED, or RESERVED where SBS reserves
+        // them; neither gets a reply, and the error code in BatteryStatus tells the host which it was.
+        // See https://www.nxp.com/docs/en/application-note/AN4471.pdf for more information about what each command does
+        // 0x63-0x66 only exist with AUTH_KEY_READBACK, and a scheme with a secret to read back; otherwise the
+        // handler is never referenced and costs no flash. Each is four raw bytes, without a length byte, as they
+        // have always been sent.
+        constexpr Descriptor AUTH_KEY = BatteryConfig::AUTH_KEY_READBACK && AuthenticationScheme::SECRET_SIZE >= 16
+                                      ? wordCommand(RequestHandlers::x63_x66_AuthKey, READ_ONLY) : UNSUPPORTED;
+        static_assert(!(AUTH_KEY.flags & BLOCK), "0x63-0x66 are read without a length byte");
+
+        constexpr Descriptor DESCRIPTORS[LAST_COMMAND + 1] PROGMEM = {
+            /* 0x00 */ wordCommand(RequestHandlers::x00_ManufacturerAccess, READ_WRITE),
+            /* 0x01 */ cachedWordCommand(REGISTERS.entry(Registers::RemainingCapacityAlarm), READ_WRITE),
+            /* 0x02 */ cachedWordCommand(REGISTERS.entry(Registers::RemainingTimeAlarm), READ_WRITE),
+            /* 0x03 */ cachedWordCommand(REGISTERS.entry(Registers::BatteryMode), READ_WRITE),
+            /* 0x04 */ cachedWordCommand(REGISTERS.entry(Registers::AtRate), READ_WRITE),
+            /* 0x05 */ wordCommand(RequestHandlers::x05_AtRateTimeToFull, READ_ONLY),
+            /* 0x06 */ wordCommand(RequestHandlers::x06_AtRateTimeToEmpty, READ_ONLY),
+            /* 0x07 */ wordCommand(RequestHandlers::x07_AtRateOK, READ_ONLY),
+            /* 0x08 */ wordCommand(RequestHandlers::x08_Temperature, READ_ONLY),
+            /* 0x09 */ cachedWordCommand(REGISTERS.entry(Registers::Voltage), READ_ONLY),
+            /* 0x0a */ cachedWordCommand(REGISTERS.entry(Registers::Current), READ_ONLY),
+            /* 0x0b */ wordCommand(RequestHandlers::x0b_AverageCurrent, READ_ONLY),
+            /* 0x0c */ wordCommand(RequestHandlers::x0c_MaxError, READ_ONLY),
+            /* 0x0d */ cachedWordCommand(REGISTERS.entry(Registers::RelativeStateOfCharge), READ_ONLY),
+            /* 0x0e */ wordCommand(RequestHandlers::x0e_AbsoluteStateOfCharge, READ_ONLY),
+            /* 0x0f */ cachedWordCommand(REGISTERS.entry(Registers::RemainingCapacity), READ_ONLY),
+            /* 0x10 */ wordCommand(RequestHandlers::x10_FullChargeCapacity, READ_ONLY),
+            /* 0x11 */ wordCommand(RequestHandlers::x11_RunTimeToEmpty, READ_ONLY),
+            /* 0x12 */ wordCommand(RequestHandlers::x12_AverageRuneTimeToEmpty, READ_ONLY),
+            /* 0x13 */ wordCommand(RequestHandlers::x13_AverageTimeToFull, READ_ONLY),
+            /* 0x14 */ wordCommand(RequestHandlers::x14_ChargingCurrentRequested, READ_ONLY),
+            /* 0x15 */ wordCommand(RequestHandlers::x15_ChargingVoltageRequested, READ_ONLY),
+            /* 0x16 */ wordCommand(RequestHandlers::x16_BatteryStatus, READ_ONLY),
+            /* 0x17 */ wordCommand(RequestHandlers::x17_CycleCount, READ_ONLY),
+            /* 0x18 */ wordCommand(StaticReplies::x18_DesignCapacity.bytes, READ_ONLY),
+            /* 0x19 */ wordCommand(StaticReplies::x19_DesignVoltage.bytes, READ_ONLY),
+            /* 0x1a */ wordCommand(StaticReplies::x1a_SpecificationInfo.bytes, READ_ONLY),
+            /* 0x1b */ wordCommand(StaticReplies::x1b_ManufactureDate.bytes, READ_ONLY),
+            /* 0x1c */ wordCommand(StaticReplies::x1c_SerialNumber.bytes, READ_ONLY),
+            /* 0x1d */ RESERVED,
+            /* 0x1e */ RESERVED,
+            /* 0x1f */ RESERVED,
+            /* 0x20 */ blockCommand(StaticReplies::x20_ManufacturerName.bytes, READ_ONLY),
+            /* 0x21 */ blockCommand(StaticReplies::x21_DeviceName.bytes, READ_ONLY),
+            /* 0x22 */ blockCommand(StaticReplies::x22_DeviceChemistry.bytes, READ_ONLY),
+            /* 0x23 */ blockCommand(StaticReplies::x23_ManufacturerData.bytes, READ_ONLY),
+            /* 0x24 */ RESERVED,
+            /* 0x25 */ RESERVED,
+            /* 0x26 */ RESERVED,
+            /* 0x27 */ RESERVED,
+            /* 0x28 */ RESERVED,
+            /* 0x29 */ RESERVED,
+            /* 0x2a */ RESERVED,
+            /* 0x2b */ RESERVED,
+            /* 0x2c */ RESERVED,
+            /* 0x2d */ RESERVED,
+            /* 0x2e */ RESERVED,
+            /* 0x2f */ blockCommand(RequestHandlers::x2f_Authenticate, READ_WRITE),
+            /* 0x30 */ blockCommand(StaticReplies::x30.bytes, READ_ONLY),
+            /* 0x31 */ RESERVED,
+            /* 0x32 */ RESERVED,
+            /* 0x33 */ RESERVED,
+            /* 0x34 */ RESERVED,
+            /* 0x35 */ wordCommand(StaticReplies::x35.bytes, READ_ONLY),
+            /* 0x36 */ RESERVED,
+            /* 0x37 */ blockCommand(StaticReplies::x37.bytes, READ_ONLY),
+            /* 0x38 */ RESERVED,
+            /* 0x39 */ RESERVED,
+            /* 0x3a */ RESERVED,
+            /* 0x3b */ wordCommand(StaticReplies::x3b.bytes, READ_ONLY),
+            /* 0x3c */ blockCommand(RequestHandlers::x3c_x3f_CellVoltage<0>, READ_ONLY),  // Has always been sent with a length byte, unlike 0x3d-0x3f
+            /* 0x3d */ wordCommand(RequestHandlers::x3c_x3f_CellVoltage<1>, READ_ONLY),
+            /* 0x3e */ wordCommand(RequestHandlers::x3c_x3f_CellVoltage<2>, READ_ONLY),
+            /* 0x3f */ wordCommand(StaticReplies::x3f_CellVoltage4.bytes, READ_ONLY),
+            /* 0x40 */ UNSUPPORTED,
+            /* 0x41 */ UNSUPPORTED,
+            /* 0x42 */ UNSUPPORTED,
+            /* 0x43 */ UNSUPPORTED,
+            /* 0x44 */ UNSUPPORTED,
+            /* 0x45 */ UNSUPPORTED,
+            /* 0x46 */ UNSUPPORTED,
+            /* 0x47 */ UNSUPPORTED,
+            /* 0x48 */ UNSUPPORTED,
+            /* 0x49 */ UNSUPPORTED,
+            /* 0x4a */ UNSUPPORTED,
+            /* 0x4b */ UNSUPPORTED,
+            /* 0x4c */ UNSUPPORTED,
+            /* 0x4d */ UNSUPPORTED,
+            /* 0x4e */ UNSUPPORTED,
+            /* 0x4f */ UNSUPPORTED,
+            /* 0x50 */ UNSUPPORTED,
+            /* 0x51 */ UNSUPPORTED,
+            /* 0x52 */ UNSUPPORTED,
+            /* 0x53 */ UNSUPPORTED,
+            /* 0x54 */ UNSUPPORTED,
+            /* 0x55 */ UNSUPPORTED,
+            /* 0x56 */ UNSUPPORTED,
+            /* 0x57 */ UNSUPPORTED,
+            /* 0x58 */ UNSUPPORTED,
+            /* 0x59 */ UNSUPPORTED,
+            /* 0x5a */ UNSUPPORTED,
+            /* 0x5b */ UNSUPPORTED,
+            /* 0x5c */ UNSUPPORTED,
+            /* 0x5d */ UNSUPPORTED,
+            /* 0x5e */ UNSUPPORTED,
+            /* 0x5f */ UNSUPPORTED,
+            /* 0x60 */ UNSUPPORTED,
+            /* 0x61 */ UNSUPPORTED,
+            /* 0x62 */ UNSUPPORTED,
+            /* 0x63 */ AUTH_KEY,
+            /* 0x64 */ AUTH_KEY,
+            /* 0x65 */ AUTH_KEY,
+            /* 0x66 */ AUTH_KEY
+        };
+    }
 
-        inline uint8_t x11_RunTimeToEmpty(uint8_t *buff) {
-            // TODO
+    namespace RequestHandlers {
+        // Look the current command up and write its reply, either from flash or through its handler.
+        // Returns why without writing anything if the command is unsupported, or its handler refused.
+        inline Utils::AlarmErrorCode handleCommand(ReplyWriter &reply) {
+            uint8_t command = COMMAND;
+            uint8_t flags = Commands::flags(command);
+
+            if (flags & Commands::CACHED) {
+                reply.writeCached(Commands::precomputed(command));
+                return Utils::AlarmErrorCode::Ok;
+            }
 
-            // 0x00f0 = 240 minutes = 4 hours
-            buff[0] = 0xf0;
-            buff[1] = 0x00;
+            if (flags & Commands::STATIC) {
+                reply.writeStatic(Commands::precomputed(command));
+                return Utils::AlarmErrorCode::Ok;
+            }
 
-            return 2;
-        }
+            Commands::Handler handler = Commands::handler(command);
 
-        inline uint8_t x12_AverageRuneTimeToEmpty(uint8_t *buff) {
-            // TODO
+            if (handler == nullptr) {
+                return Commands::unsupported(flags);
+            }
 
-            // 0x00f0 = 240 minutes = 4 hours
-            buff[0] = 0xf0;
-            buff[1] = 0x00;
+            reply.begin(command, flags & Commands::BLOCK);
+            handler(reply);
+            reply.end();
 
-            return 2;
+            return reply.refused();
         }
+    }
 
-        inline uint8_t x13_AverageTimeToFull(uint8_t *buff) {
-            // TODO
+    // Lowest and highest of the series cells in a snapshot
+    inline void cellRange(const Telemetry &telemetry, uint16_t &lowest, uint16_t &highest) {
+        lowest = telemetry.cellVoltage[0];
+        highest = telemetry.cellVoltage[0];
 
-            // 0x00b4 = 180 minutes = 3 hours
-            buff[0] = 0xb4;
-            buff[1] = 0x00;
-
-            return 2;
+        for (uint8_t cell = 1; cell < BatteryConfig::CELLS_IN_SERIES; ++cell) {
+            lowest = telemetry.cellVoltage[cell] < lowest ? telemetry.cellVoltage[cell] : lowest;
+            highest = telemetry.cellVoltage[cell] > highest ? telemetry.cellVoltage[cell] : highest;
         }
+    }
 
-        inline uint8_t x14_ChargingCurrentRequested(uint8_t *buff) {
-            // TODO :: implement CC/CV charging
+    // Every tick: integrate the current samples converted since the last run. The ring holds a few ms worth;
+    // samples lost when the main loop falls further behind are integrated at the last current.
+    void integrateCurrent() {
+        uint16_t code;
 
-            if (BATTERY_STATUS.canCharge() && POWER_STATE == Utils::PowerState::charging) {
-                uint8_t lower, higher;
+        while (Analog::take(Analog::Current, code)) {
+            COULOMB_COUNTER.integrate(code);
+        }
 
-                Utils::splitNum(BatteryConfig::CELL_CAPACITY, &higher, &lower);
-                buff[0] = lower;
-                buff[1] = higher;
+        // Only the current channel is taken sample by sample, so every overrun is one of its samples
+        uint16_t overruns = Analog::overruns();
 
-            } else {
-                buff[0] = 0;
-                buff[1] = 0;
-            }
+        if (overruns != CURRENT_OVERRUNS) {
+            COULOMB_COUNTER.integrateMissed(overruns - CURRENT_OVERRUNS);
+            CURRENT_OVERRUNS = overruns;
+        }
+    }
 
-            return 2;
+    // Once a second: keep the coulomb count from drifting, and work out how far off it may be (MaxError).
+    // The simple estimator lets the OCV override the count once the cells have rested; the Kalman estimator
+    // corrects it from every voltage measurement. Either way the weakest cell is what the pack has left.
+    void correctStateOfCharge() {
+        // The cells read 0mV until the ADC rings are full. Keep the power-on rest for the first real reading.
+        if (!MEASURED) {
+            return;
         }
 
-        inline uint8_t x15_ChargingVoltageRequested(uint8_t *buff) {
-            // TODO :: implement CC/CV charging
+        bool rested = REST.update(COULOMB_COUNTER.averageCurrent());
 
-            if (BATTERY_STATUS.canCharge() && POWER_STATE == Utils::PowerState::charging) {
-                uint8_t lower, higher;
+        const Telemetry &telemetry = TELEMETRY;
+        uint16_t lowest, highest;
+        cellRange(telemetry, lowest, highest);
 
-                Utils::splitNum(BatteryConfig::CHARGE_VOLTAGE, &higher, &lower);
-                buff[0] = lower;
-                buff[1] = higher;
+        uint32_t full = COULOMB_COUNTER.fullCapacity();
 
-            } else {
-                buff[0] = 0;
-                buff[1] = 0;
+        if (HardwareConfig::KALMAN_SOC_ESTIMATOR) {
+            // Start from the OCV of the first real reading, not from 50% and a variance that covers everything
+            if (!ESTIMATING) {
+                ESTIMATOR.reset(OCV::stateOfCharge(lowest, telemetry.temperature, REST.direction()));
+                ESTIMATED_REMAINING = COULOMB_COUNTER.remaining();
+                ESTIMATING = true;
             }
-            
-            return 2;
-        }
 
-        inline uint8_t x16_BatteryStatus(uint8_t *buff) {
-            uint8_t lower, higher;
+            int32_t charge = COULOMB_COUNTER.remaining() - ESTIMATED_REMAINING;
 
-            BATTERY_STATUS.asSplitBytes(&higher, &lower);
-            buff[0] = lower;
-            buff[1] = higher;
+            ESTIMATOR.update(charge, full, COULOMB_COUNTER.current(), lowest, telemetry.temperature, REST.direction());
+            COULOMB_COUNTER.setRemaining(full / 10000 * ESTIMATOR.stateOfCharge());
 
-            return 2;
+            ESTIMATED_REMAINING = COULOMB_COUNTER.remaining();
+            MAX_ERROR = ESTIMATOR.maxError();
+            return;
         }
 
-        inline uint8_t x17_CycleCount(uint8_t *buff) {
-            // TODO
-
-            buff[0] = 0x05;
-            buff[1] = 0x00;
-
-            return 2;
+        if (rested) {
+            uint16_t soc = OCV::stateOfCharge(lowest, telemetry.temperature, REST.direction());
+            COULOMB_COUNTER.setRemaining(full / 10000 * soc);
+            MAX_ERROR = OCV::MAX_ERROR;
         }
 
-        inline uint8_t x18_DesignCapacity(uint8_t *buff) {
-            uint8_t lower, higher;
-
-            Utils::splitNum(Utils::BATTERY_CAPACITY_DESIGN, &higher, &lower);
-            buff[0] = lower;
-            buff[1] = higher;
-
-            return 2;
+        // The count is as good as the last OCV reading, less the gain error on what has been counted since
+        if (MAX_ERROR < 100) {
+            uint32_t counted = COULOMB_COUNTER.throughput() / (full / 100) * HardwareConfig::CURRENT_GAIN_ERROR / 100;
+            MAX_ERROR = counted < 100 - OCV::MAX_ERROR ? OCV::MAX_ERROR + counted : 100;
         }
+    }
 
-        inline uint8_t x19_DesignVoltage(uint8_t *buff) {
-            uint8_t lower, higher;
+    // Run checks to make sure all values are nominal
+    void checkValuesAndSetStates() {
+        COULOMB_COUNTER.endWindow();
 
-            Utils::splitNum(BatteryConfig::BATTERY_VOLTAGE, &higher, &lower);
-            buff[0] = lower;
-            buff[1] = higher;
+        int16_t current = COULOMB_COUNTER.current();
 
-            return 2;
-        }
+        if (current > 0) {
+            POWER_STATE = Utils::PowerState::charging;
 
-        inline uint8_t x1a_SpecificationInfo(uint8_t *buff) {
-            buff[0] = 0b00110001;
-            buff[1] = 0b00000000;
+        } else if (current < 0) {
+            POWER_STATE = Utils::PowerState::discharging;
 
-            return 2;
+        } else {
+            POWER_STATE = Utils::PowerState::idling;
         }
 
-        inline uint8_t x1b_ManufactureDate(uint8_t *buff) {
-            // 0x4b6b = 2017.11.11  | 0x4cb2 = 2018.05.18
-            buff[0] = 0x6b;
-            buff[1] = 0x4b;
+        // A ring not yet filled averages in zeros, and a thermistor code of 0 reads as 125C. The transistors stay
+        // open from Protection::begin() meanwhile, and the ADC interrupt already checks every conversion.
+        MEASURED = Analog::primed();
 
-            return 2;
+        if (!MEASURED) {
+            return;
         }
 
-        inline uint8_t x1c_SerialNumber(uint8_t *buff) {
-            uint8_t lower, higher;
+        TEMPERATURE = Thermistor::temperature(Analog::average(Analog::Temperature));
 
-            Utils::splitNum((uint16_t)BatteryConfig::SERIAL_CODE, &higher, &lower);
-            buff[0] = lower;
-            buff[1] = higher;
+        // Temperature is no longer acceptable. Each limit has hysteresis so the alarms don't chatter.
+        bool overTemperature = BATTERY_STATUS.overTempAlarm;
 
-            return 2;
-        }
+        if (TEMPERATURE >= BatteryConfig::OVER_TEMPERATURE) {
+            overTemperature = true;
 
-        // 0x1d-0x1f
-
-        inline uint8_t x20_ManufacturerName(uint8_t *buff) {
-            size_t vendor_string_length = strlen(BatteryConfig::BATTERY_VENDOR);
-            for (unsigned int x = 0; x < vendor_string_length; ++x) {
-                buff[x] = BatteryConfig::BATTERY_VENDOR[x];
-            }
+        } else if (TEMPERATURE < BatteryConfig::OVER_TEMPERATURE - BatteryConfig::TEMPERATURE_HYSTERESIS) {
+            overTemperature = false;
+        }
 
-            /*
-            // First 4 bytes may be cut off
-            int end = vendor_string_length;
-            buff[end + 0] = 0;
-            buff[end + 1] = 49;
-            buff[end + 2] = 49;
-            */
+        if (TEMPERATURE < BatteryConfig::CHARGE_TEMPERATURE_MIN || TEMPERATURE > BatteryConfig::CHARGE_TEMPERATURE_MAX) {
+            CHARGE_TEMPERATURE_OK = false;
 
-            return vendor_string_length; // + 3;
+        } else if (TEMPERATURE >= BatteryConfig::CHARGE_TEMPERATURE_MIN + BatteryConfig::TEMPERATURE_HYSTERESIS &&
+                   TEMPERATURE <= BatteryConfig::CHARGE_TEMPERATURE_MAX - BatteryConfig::TEMPERATURE_HYSTERESIS) {
+            CHARGE_TEMPERATURE_OK = true;
         }
 
-        inline uint8_t x21_DeviceName(uint8_t *buff) {
-            for (unsigned int x = 0; x < strlen(BatteryConfig::BATTERY_MODEL); ++x) {
-                buff[x] = BatteryConfig::BATTERY_MODEL[x];
-            }
+        // Hard limits: the ADC interrupt has already opened the transistors. Voltage faults are released once
+        // every cell is back in its normal range, over-current faults after a while, to retry the load.
+        uint8_t faults = Protection::faults();
+        uint8_t released = 0;
 
-            return strlen(BatteryConfig::BATTERY_MODEL);
-        }
+        uint16_t lowest, highest;
+        cellRange(TELEMETRY, lowest, highest);
 
-        inline uint8_t x22_DeviceChemistry(uint8_t *buff) {
-            buff[0] = 76;  // L
-            buff[1] = 73;  // I
-            buff[2] = 79;  // O
-            buff[3] = 78;  // N
+        if ((faults & Protection::OverVoltage) && highest <= BatteryConfig::MAX_CELL_VOLTAGE) {
+            released |= Protection::OverVoltage;
+        }
 
-            return 4;
+        if ((faults & Protection::UnderVoltage) && lowest >= BatteryConfig::MIN_CELL_VOLTAGE) {
+            released |= Protection::UnderVoltage;
         }
 
-        inline uint8_t x23_ManufacturerData(uint8_t *buff) {
-            // TODO : Provide a way to customize this? Probably not necessary.
+        const uint8_t overCurrent = Protection::OverCurrentCharge | Protection::OverCurrentDischarge;
+        static_assert(BatteryConfig::OVER_CURRENT_RETRY < 65, "OVER_CURRENT_RETRY is counted in 16-bit ticks");
 
-            buff[0] = 0x00;
-            buff[1] = 0x00;
-            buff[2] = 0x00;
-            buff[3] = 0x00;
-            buff[4] = 0x00;
-            buff[5] = 0x6e;
-            buff[6] = 0x00;
-            buff[7] = 0xaa;
-            buff[8] = 0x00;
-            buff[9] = 0x02;
-            buff[10] = 0x10;
-            buff[11] = 0x00;
-            buff[12] = 0x00;
-            buff[13] = 0x00;
+        if (!(faults & overCurrent)) {
+            OVER_CURRENT_AT = Scheduler::now();
 
-            return 14;
+        } else if ((uint16_t)(Scheduler::now() - OVER_CURRENT_AT) >= BatteryConfig::OVER_CURRENT_RETRY * Scheduler::TICK_HZ) {
+            released |= overCurrent;
         }
 
-        // 0x24-0x2e
-
-        inline uint8_t x2f_Authenticate(uint8_t *output_buffer, uint8_t *input_buffer) {
-            return Authentication::authenticate(output_buffer, input_buffer);
+        if (released) {
+            Protection::release(released);
+            faults &= ~released;
         }
 
-        // ?
-        inline uint8_t x30(uint8_t *buff) {
-            buff[0] = 112;
-            buff[1] = 156;
-            buff[2] = 191;
-            buff[3] = 25;
-            buff[4] = 132;
-            buff[5] = 74;
-            buff[6] = 151;
-            buff[7] = 0;
-            buff[8] = 11;
-            buff[9] = 0;
+        BATTERY_STATUS.overTempAlarm = overTemperature;
+        BATTERY_STATUS.overchargedAlarm = (faults & Protection::OverVoltage) ||
+                                          (CHARGER.state() == Charge::Full && POWER_STATE == Utils::PowerState::charging);
+        BATTERY_STATUS.terminateChargeAlarm = overTemperature || !CHARGE_TEMPERATURE_OK || (faults & Protection::OPENS_CHARGE);
+        BATTERY_STATUS.terminateDischargeAlarm = overTemperature || (faults & Protection::OPENS_OUTPUT);
 
-            return 10;
-        }
+        // TODO
 
-        // 0x31-0x34
+        // Battery is charged: the charge controller terminated.
+        // The battery is considered fully charged when the difference between battery voltage and
+        // charging voltage is within 100mV and charging current is less than C/10 *
+        BATTERY_STATUS.fullyCharged = CHARGER.state() == Charge::Full;
 
-        // ?
-        inline uint8_t x35(uint8_t *buff) {
-            buff[0] = 64;
-            buff[1] = 0x00;
+        if (BATTERY_STATUS.fullyCharged) {
+            BATTERY_STATUS.terminateChargeAlarm = true;
+        }
 
-            return 2;
+        // Battery is discharged
+        if (false) {
+            // SOC estimation by static voltage measurement should be done with separated charge and discharge look-up table *
+            // Usually, the full charged capacity reduce 10%~20% after 500 cycles *
+            BATTERY_STATUS.fullyDischarged = true;
+            BATTERY_STATUS.terminateDischargeAlarm = true;
         }
 
-        // 0x36
+        // Battery is discharging (can be self-discharge, not always system): anything but being charged
+        BATTERY_STATUS.discharging = POWER_STATE != Utils::PowerState::charging;
 
-        // ?
-        inline uint8_t x37(uint8_t *buff) {
-            buff[0] = 4;
-            buff[1] = 0;
-            buff[2] = 61;
-            buff[3] = 94;
-            buff[4] = 97;
-            buff[5] = 1;
-            buff[6] = 64;
-            buff[7] = 1;
+        // Below the host's RemainingCapacityAlarm; 0 turns it off
+        uint16_t capacityAlarm = REGISTERS.get(Registers::RemainingCapacityAlarm);
+        BATTERY_STATUS.remainingCapacityAlarm = COULOMB_COUNTER.remainingCapacity() < capacityAlarm;
 
-            return 8;
-        }
+        // Latched faults keep their transistor open regardless
+        Protection::drive(BATTERY_STATUS.canCharge(), BATTERY_STATUS.canDischarge());
+    }
 
-        // 0x38-0x3a
+    // Every tick: apply what the host wrote since the last run, in order (see Writes)
+    void applyWrites() {
+        Writes::Write write;
 
-        // ?
-        inline uint8_t x3b(uint8_t *buff) {
-            buff[0] = 135;
-            buff[1] = 11;
+        while (Writes::take(write)) {
+            switch (write.command) {
+                case 0x01:
+                    REGISTERS.set(Registers::RemainingCapacityAlarm, write.value);
+                    break;
 
-            return 2;
-        }
+                case 0x02:
+                    REGISTERS.set(Registers::RemainingTimeAlarm, write.value);
+                    break;
+
+                case 0x03:
+                    BATTERY_MODE.fromWord(write.value);
 
-        inline uint8_t x3c_x3f_CellVoltage(uint8_t *buff, uint8_t cell) {
-            // TODO :: Do actual measurements
+                    // The host has to keep setting it to keep broadcasts off; each write starts the timeout over
+                    if (BATTERY_MODE.alarmMode) {
+                        ALARM_MODE_SET_AT = Scheduler::now();
+                    }
 
-            switch (cell) {
-                case 0:
-                    // HardwareConfig::Pins::CELL_0_VOLTAGE;
+                    REGISTERS.set(Registers::BatteryMode, BATTERY_MODE.asWord());
                     break;
 
-                case 1:
-                    // HardwareConfig::Pins::CELL_1_VOLTAGE;
+                case 0x04:
+                    REGISTERS.set(Registers::AtRate, write.value);
                     break;
 
-                case 2:
-                    // HardwareConfig::Pins::CELL_2_VOLTAGE;
+                default:
+                    // 0x00 ManufacturerAccess: nothing to do
                     break;
+            }
+        }
+    }
+
+    // Every tick: one step of working out the response to a challenge written to 0x2f. Until the last one, reads
+    // of 0x2f get Busy; nothing of it runs with the bus held.
+    void stepAuthentication() {
+        uint8_t step = AUTHENTICATION_STEP;
 
-                default: break;
-            };
+        if (step >= AuthenticationScheme::STEPS) {
+            return;
+        }
 
-            // TODO :: voltage per cell for each 0x3c-0x3f
-            buff[0] = 0x68;
-            buff[1] = 0x10;
+        AuthenticationScheme::step(step, AUTHENTICATION);
 
-            return 2;
+        if (step + 1 == AuthenticationScheme::STEPS) {
+            AUTHENTICATION_LENGTH = AuthenticationScheme::RESPONSE_SIZE;
         }
 
-        inline uint8_t x63_x66_AuthKey(uint8_t *buff) {
-            short offset = COMMAND - 0x63;
-            buff[0] = Authentication::AUTH_KEY[offset * 4];
-            buff[1] = Authentication::AUTH_KEY[offset * 4 + 1];
-            buff[2] = Authentication::AUTH_KEY[offset * 4 + 2];
-            buff[3] = Authentication::AUTH_KEY[offset * 4 + 3];
+        AUTHENTICATION_STEP = step + 1;
+    }
 
-            return 4;
+    // ALARM_MODE must be reset every <=45s
+    void checkAlarmModeTimeout() {
+        if (BATTERY_MODE.alarmMode && (uint16_t)(Scheduler::now() - ALARM_MODE_SET_AT) > 30 * Scheduler::TICK_HZ) {
+            BATTERY_MODE.alarmMode = false;
         }
+    }
 
-        // Map command codes to event handlers. Event handlers write to the global buffer and return amount of bytes written.
-        // Commands that are not used or have not been implemented will return 255.
-        // See https://www.nxp.com/docs/en/application-note/AN4471.pdf for more information about what each command does
-        inline uint8_t handleCommand(uint8_t *buffer) {
-            uint8_t cell = 0;
-
-            switch (COMMAND) {
-                case 0x00: return x00_ManufacturerAccess(buffer);
-                case 0x01: return x01_BatteryCapacityAlarm(buffer);
-                case 0x02: return x02_RemainingTimeAlarm(buffer);
-                case 0x03: return x03_BatteryMode(buffer);
-                case 0x04: return x04_AtRate(buffer);
-                case 0x05: return x05_AtRateTimeToFull(buffer);
-                case 0x06: return x06_AtRateTimeToEmpty(buffer);
-                case 0x07: return x07_AtRateOK(buffer);
-                case 0x08: return x08_Temperature(buffer);
-                case 0x09: return x09_Voltage(buffer);
-                case 0x0a: return x0a_PresentCurrentChargeOrDraw(buffer);
-                case 0x0b: return x0b_AverageCurrent(buffer);
-                case 0x0c: return x0c_MaxError(buffer);
-                case 0x0d: return x0d_RelativeStateOfCharge(buffer);
-                case 0x0e: return x0e_AbsoluteStateOfCharge(buffer);
-                case 0x0f: return x0f_RemainingCapacity(buffer);
-                case 0x10: return x10_FullChargeCapacity(buffer);
-                case 0x11: return x11_RunTimeToEmpty(buffer);
-                case 0x12: return x12_AverageRuneTimeToEmpty(buffer);
-                case 0x13: return x13_AverageTimeToFull(buffer);
-                case 0x14: return x14_ChargingCurrentRequested(buffer);
-                case 0x15: return x15_ChargingVoltageRequested(buffer);
-                case 0x16: return x16_BatteryStatus(buffer);
-                case 0x17: return x17_CycleCount(buffer);
-                case 0x18: return x18_DesignCapacity(buffer);
-                case 0x19: return x19_DesignVoltage(buffer);
-                case 0x1a: return x1a_SpecificationInfo(buffer);
-                case 0x1b: return x1b_ManufactureDate(buffer);
-                case 0x1c: return x1c_SerialNumber(buffer);
-                case 0x20: return x20_ManufacturerName(buffer);
-                case 0x21: return x21_DeviceName(buffer);
-                case 0x22: return x22_DeviceChemistry(buffer);
-                case 0x23: return x23_ManufacturerData(buffer);
-                case 0x2f: return x2f_Authenticate(buffer, COMMAND_DATA_BUFFER);
-                case 0x30: return x30(buffer);
-                case 0x35: return x35(buffer);
-                case 0x37: return x37(buffer);
-                case 0x3b: return x3b(buffer);
-
-                case 0x3c: cell = 0;
-                case 0x3d: cell = 1;
-                case 0x3e: cell = 2;
-                case 0x3f: cell = 3;
-                    return x3c_x3f_CellVoltage(buffer, cell);
-
-                case 0x63:
-                case 0x64:
-                case 0x65:
-                case 0x66: return x63_x66_AuthKey(buffer);
-
-                default: return 255;
-            };
+    // Once a second: work out the current and voltage to request from the charger (see Charge::Controller).
+    // It runs through every alarm, being what decides the pack is full; the others make it request nothing.
+    void calculateChargeParameters() {
+        const Telemetry &telemetry = TELEMETRY;
+        Charge::Measurement measurement;
+
+        cellRange(telemetry, measurement.lowestCell, measurement.highestCell);
+
+        // The sum of the cells rather than the pack tap, so that the per-cell clamp compares like with like
+        measurement.packVoltage = 0;
+        for (uint8_t cell = 0; cell < BatteryConfig::CELLS_IN_SERIES; ++cell) {
+            measurement.packVoltage += telemetry.cellVoltage[cell];
         }
+
+        measurement.current = COULOMB_COUNTER.current();
+        measurement.temperature = TEMPERATURE;
+
+        bool allowed = !BATTERY_STATUS.overTempAlarm && CHARGE_TEMPERATURE_OK &&
+                       !(Protection::faults() & Protection::OPENS_CHARGE);
+
+        CHARGER.update(measurement, allowed);
     }
 
-    // Run checks to make sure all values are nominal
-    void checkValuesAndSetStates() {
-        // TODO
+    // Report ChargingCurrent and ChargingVoltage to the charger, unless the host has taken over polling them
+    void broadcastChargingParameters() {
+        const Telemetry &telemetry = TELEMETRY;
+        Broadcast::chargingParameters(BATTERY_MODE, telemetry.chargingCurrent, telemetry.chargingVoltage);
+    }
 
-        // Temperature is no longer acceptable
-        if (false) {
-            BATTERY_STATUS.overTempAlarm = true;
-            BATTERY_STATUS.terminateChargeAlarm = true;
-            BATTERY_STATUS.terminateDischargeAlarm = true;
+    // Tell the host and the charger about alarms, unless the host has silenced them; rate limited by Broadcast
+    void broadcastAlarmWarning() {
+        Broadcast::alarmWarning(BATTERY_MODE, TELEMETRY.batteryStatus);
+    }
+
+    // Hand the values computed by the main loop over to the request handlers.
+    // Runs with interrupts enabled; a request arriving meanwhile is answered with the word as it was or as it is.
+    void publishTelemetry() {
+        store(TELEMETRY.temperature, TEMPERATURE);
+
+        store(TELEMETRY.averageCurrent, COULOMB_COUNTER.averageCurrent());
+        store(TELEMETRY.fullChargeCapacity, COULOMB_COUNTER.fullCapacity() / 1000);
+
+        // Relative to the full charge capacity, absolute to the design capacity
+        TELEMETRY.absoluteStateOfCharge = COULOMB_COUNTER.remaining() / (Utils::BATTERY_CAPACITY_DESIGN * 10UL);
+        TELEMETRY.maxError = MAX_ERROR;
+
+        // Requested whether or not the charger is supplying anything yet, but never against an alarm
+        bool charge = BATTERY_STATUS.canCharge();
+        store(TELEMETRY.chargingCurrent, charge ? CHARGER.current() : 0);
+        store(TELEMETRY.chargingVoltage, charge ? CHARGER.voltage() : 0);
+
+        // Tap n sees cells 0 through n stacked, so each cell is the difference to the tap below
+        const uint16_t taps[3] = {
+            Analog::millivolts(Analog::Cell0, HardwareConfig::Dividers::CELL_0_VOLTAGE),
+            Analog::millivolts(Analog::Cell1, HardwareConfig::Dividers::CELL_1_VOLTAGE),
+            Analog::millivolts(Analog::Cell2, HardwareConfig::Dividers::CELL_2_VOLTAGE)
+        };
+
+        uint16_t below = 0;
+        for (uint8_t cell = 0; cell < 3; ++cell) {
+            store(TELEMETRY.cellVoltage[cell], taps[cell] > below ? taps[cell] - below : 0);
+            below = taps[cell];
+        }
+
+        store(TELEMETRY.batteryStatus, BATTERY_STATUS.asWord());
+
+        // What only the host reads goes straight to the register file, which caches each reply with its PEC.
+        // Entries only get a new PEC when their value actually changed.
+        REGISTERS.set(Registers::BatteryMode, BATTERY_MODE.asWord());
+        REGISTERS.set(Registers::Voltage, Analog::millivolts(Analog::Pack, HardwareConfig::Dividers::PACK_VOLTAGE));
+        REGISTERS.set(Registers::Current, COULOMB_COUNTER.current());
+        REGISTERS.set(Registers::RelativeStateOfCharge,
+                      COULOMB_COUNTER.remaining() / (COULOMB_COUNTER.fullCapacity() / 100));
+        REGISTERS.set(Registers::RemainingCapacity, COULOMB_COUNTER.remainingCapacity());
+    }
+
+    // Check a write and pass it on: word writes to the main loop through Writes, the 0x2f challenge to its
+    // buffer. Word writes all take the same path, so the interrupt takes the same time for each.
+    inline Utils::AlarmErrorCode writeCommand(const uint8_t *bytes, uint8_t count) {
+        uint8_t command = bytes[0];
+        uint8_t flags = Commands::flags(command);
+
+        if (!Commands::isSupported(flags)) {
+            return Commands::unsupported(flags);
         }
 
-        // Battery is charged
-        if (false) {
-            // The battery is considered fully charged when the difference between battery voltage and
-            // charging voltage is within 100mV and charging current is less than C/10 *
-            BATTERY_STATUS.fullyCharged = true;
-            BATTERY_STATUS.terminateChargeAlarm = true;
-            BATTERY_STATUS.overchargedAlarm = true;
+        if (!(flags & Commands::WRITE)) {
+            return Utils::AlarmErrorCode::AccessDenied;
         }
 
-        // Battery is discharged
-        if (false) {
-            // SOC estimation by static voltage measurement should be done with separated charge and discharge look-up table *
-            // Usually, the full charged capacity reduce 10%~20% after 500 cycles *
-            BATTERY_STATUS.fullyDischarged = true;
-            BATTERY_STATUS.terminateDischargeAlarm = true;
+        Utils::AlarmErrorCode error = Block::checkWrite(bytes, count, flags & Commands::BLOCK);
+
+        if (error != Utils::AlarmErrorCode::Ok) {
+            return error;
         }
 
-        // Battery is discharging (can be self-discharge, not always system)
-        if (false && BATTERY_STATUS.canDischarge()) {
-            BATTERY_STATUS.discharging = true;
+        if (command == 0x2f) {
+            if (Block::length(bytes) != Authentication::CHALLENGE_SIZE) {
+                return Utils::AlarmErrorCode::BadSize;
+            }
+
+            // The main loop is working in the buffer; the host has to wait for the response to the last one
+            if (AUTHENTICATION_STEP < AuthenticationScheme::STEPS) {
+                return Utils::AlarmErrorCode::Busy;
+            }
+
+            memcpy(AUTHENTICATION, Block::data(bytes), Authentication::CHALLENGE_SIZE);
+            AUTHENTICATION_STEP = 0;
+            return Utils::AlarmErrorCode::Ok;
         }
 
-        // ALARM_MODE must be reset every <=45s
-        if (BATTERY_MODE.alarmMode && millis() - ALARM_MODE_SET_AT > (30 * 1000)) {
-            BATTERY_MODE.alarmMode = false;
+        // Full up means the main loop is behind; the host may try again
+        if (!Writes::push(command, bytes[1] | (bytes[2] << 8))) {
+            return Utils::AlarmErrorCode::Busy;
         }
-    }
 
-    // Calculate the voltage and current that should be requested by comparing the battery's current capacity
-    // and voltage to lookup tables.
-    void calculateChargeParameters() {
-        // TODO
+        return Utils::AlarmErrorCode::Ok;
     }
 
-    // Read command sent from laptop
-    void receiveEvent(int howMany)
+    // Read command sent from laptop, with the bytes that followed it (in the block arena; see Block::checkWrite)
+    void receiveEvent(const uint8_t *bytes, uint8_t count)
     {
+        if (count == 0) {
+            return;
+        }
+
         // Set command
-        COMMAND = (uint8_t)Wire.read();
+        COMMAND = bytes[0];
 
-        for (int x = 0; x < howMany-1; x++) {
-            COMMAND_DATA_BUFFER[x] = (uint8_t)Wire.read();
+        // Just the command: a read follows
+        if (count == 1) {
+            return;
         }
 
+        BATTERY_STATUS.errorCode = writeCommand(bytes, count);
+
         #ifdef DEBUG
-            Utils::logCommand((char* const)F("Received command: "), COMMAND);
+            Utils::logCommand(F("Received command: "), COMMAND);
         #endif
     }
 
     // Write information and send it to laptop
     void requestEvent () {
-        // Call the handler responsible for the current command, which writes the relevant data
-        // Then get the response length, 255 if no match is found
-        uint8_t replyLength = RequestHandlers::handleCommand(REPLY_BUFFER);
+        // The PEC is accumulated while the handler writes, so the reply is only walked once
+        ReplyWriter reply;
 
-        // No matching callback was found, return without further processing
-        if (replyLength == 255) {
-            #ifdef DEBUG
-                Utils::logCommand((char* const)F("WARN: Unimplemented command: "), COMMAND);
-            #endif
+        // Send the reply for the current command, PEC included
+        // No matching handler was found, or it had nothing to send yet: nothing is sent
+        Utils::AlarmErrorCode error = RequestHandlers::handleCommand(reply);
 
-            return;
-        }
+        if (error != Utils::AlarmErrorCode::Ok) {
+            BATTERY_STATUS.errorCode = error;
 
-        // Some commands require their length to be added. See needsLength function for a list of these commands
-        // This length command is sent first, before all the data
-        if (Utils::needsLength((uint8_t)COMMAND)) {
-            Wire.write(replyLength);
-        }
+            #ifdef DEBUG
+                Utils::logCommand(F("WARN: Unanswered command: "), COMMAND);
+            #endif
 
-        // Write all bytes from the buffer
-        for (uint8_t y = 0; y < replyLength; ++y) {
-            Wire.write(REPLY_BUFFER[y]);
+        // Reading BatteryStatus leaves the code alone, so that it still tells how the command before it went
+        } else if (COMMAND != 0x16) {
+            BATTERY_STATUS.errorCode = Utils::AlarmErrorCode::Ok;
         }
+    }
 
-        // SMBus messages end with a CRC-8 byte
-        Wire.write(Utils::calculateCRC(REPLY_BUFFER, replyLength, COMMAND));
-
-        #ifdef DEBUG
-            uint8_t curByte;
-            for (int y = replyLength - 1; y >= 0; --y) {
-                curByte = REPLY_BUFFER[y];
+    // Every 5ms, run internal calculations to determine the current conditions of the battery.
+    // Interrupts stay enabled throughout: requests are answered from the last published snapshot
+    // until publishTelemetry() swaps in the new one.
+    void measure() {
+        checkValuesAndSetStates();
+        publishTelemetry();
+    }
 
-                if (curByte < 16) Serial.print('0');
-                Serial.print(curByte, HEX);
+    // Every second: the state of charge, then the charge request worked out from it. One task rather than three
+    // released on the same tick, to keep one TaskState.
+    void everySecond() {
+        correctStateOfCharge();
+        calculateChargeParameters();
+        checkAlarmModeTimeout();
+    }
 
-                Serial.print(' ');
-            }
-            Serial.print("\n");
-        #endif
+    // Every tick: a byte of the broadcast on the bus, then the writes the host finished (SMBus::poll hands over
+    // those that ended with a STOP) applied. One task, for one TaskState, with the deadline of the strictest.
+    void pollBus() {
+        Broadcast::poll();
+        SMBus::poll();
+        applyWrites();
     }
+
+    // Periods and deadlines are in scheduler ticks (ms)
+    const Scheduler::Task TASKS[] PROGMEM = {
+        { integrateCurrent,              1,     2    },  // Before the ADC ring overflows
+        { measure,                       5,     5    },
+        { everySecond,                   1000,  100  },
+        { broadcastChargingParameters,   10000, 1000 },  // Every 5-60s by spec
+        { broadcastAlarmWarning,         100,   100  },
+        { pollBus,                       1,     1    },  // A broadcast byte takes ~0.12ms on the USI
+        { stepAuthentication,            1,     10   },  // One SHA-1 compression, a few ms
+    };
+
+    Scheduler::TaskState TASK_STATES[TASK_COUNT];
 }
@@ -1,6 +1,9 @@
 #ifndef SMART_BATTERY_FIRMWARE_H
 #define SMART_BATTERY_FIRMWARE_H
 
+#include "registers.hpp"
+#include "scheduler.hpp"
+#include "telemetry.hpp"
 #include "utils.hpp"
 #include <stdint.h>
 
@@ -8,17 +11,37 @@ namespace OpenSmartBattery {
     extern Utils::PowerState POWER_STATE;
     extern Utils::BatteryMode BATTERY_MODE;
     extern Utils::BatteryStatus BATTERY_STATUS;
+    extern Telemetry TELEMETRY;
+    extern Registers::RegisterFile REGISTERS;
+
+    class ReplyWriter;
 
     // ====
 
     namespace RequestHandlers {
-        inline uint8_t handleCommand(uint8_t*);
+        inline Utils::AlarmErrorCode handleCommand(ReplyWriter&);
     }
 
+    void integrateCurrent();
+    void correctStateOfCharge();
     void checkValuesAndSetStates();
+    void applyWrites();
+    void stepAuthentication();
+    void checkAlarmModeTimeout();
     void calculateChargeParameters();
-    void receiveEvent(int);
+    void broadcastChargingParameters();
+    void broadcastAlarmWarning();
+    void publishTelemetry();
+    void measure();
+    void everySecond();
+    void pollBus();
+    void receiveEvent(const uint8_t *bytes, uint8_t count);
     void requestEvent();
+
+    // Everything the main loop runs, for Scheduler::schedule() and Scheduler::runPending()
+    const uint8_t TASK_COUNT = 7;
+    extern const Scheduler::Task TASKS[TASK_COUNT] PROGMEM;
+    extern Scheduler::TaskState TASK_STATES[TASK_COUNT];
 }
 
 #endif
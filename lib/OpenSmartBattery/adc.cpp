@@ -0,0 +1,270 @@
+#include "adc.hpp"
+#include "config.hpp"
+#include "platform.hpp"
+#include "protection.hpp"
+#include "smbus.hpp"
+#include <stdint.h>
+
+#ifdef ARDUINO
+    #include <avr/interrupt.h>
+    #include <avr/sleep.h>
+#endif
+
+namespace OpenSmartBattery {
+    namespace Analog {
+
+        // ADMUX channel of each Channel
+        const uint8_t CHANNEL_MUX[COUNT] PROGMEM = {
+            inputPin(Current),
+            inputPin(Cell0),
+            inputPin(Cell1),
+            inputPin(Cell2),
+            inputPin(Pack),
+            inputPin(Temperature)
+        };
+
+        // Pins with a digital peripheral on them, whose input buffer has to stay on
+        constexpr bool digitalToo(uint8_t pin) {
+            #ifndef SMBUS_WIRE
+            if (pin == SMBus::CLOCK_PIN || pin == SMBus::DATA_PIN) {
+                return true;
+            }
+            #endif
+
+            return pin == HardwareConfig::Pins::SERIAL_IN || pin == HardwareConfig::Pins::SERIAL_OUT ||
+                   pin == HardwareConfig::Pins::OUTPUT_TRANSISTOR || pin == HardwareConfig::Pins::CHARGE_TRANSISTOR;
+        }
+
+        constexpr bool anyChannelDigitalToo() {
+            for (uint8_t channel = 0; channel < COUNT; ++channel) {
+                if (digitalToo(inputPin((Channel)channel))) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Such a pin is no use as an analog input either: the ADC would read the bus or the transistor gate
+        static_assert(!anyChannelDigitalToo(), "HardwareConfig::Pins puts an analog input on a digital pin");
+
+        const uint8_t OVERSAMPLE_BITS[COUNT] PROGMEM = {
+            oversampleBits(Current),
+            oversampleBits(Cell0),
+            oversampleBits(Cell1),
+            oversampleBits(Cell2),
+            oversampleBits(Pack),
+            oversampleBits(Temperature)
+        };
+
+        // Reference is VCC on the ATtiny84 (REFS1:0 = 00) and AVCC on the ATmega (REFS1:0 = 01)
+        #if defined(ARDUINO) && !defined(__AVR_ATtiny84__)
+        const uint8_t REFERENCE = _BV(REFS0);
+        #else
+        const uint8_t REFERENCE = 0;
+        #endif
+
+        const uint8_t RING_MASK = RING_SIZE - 1;
+
+        volatile Ring RINGS[COUNT];
+
+        // Sum and count of the conversions towards each channel's next decimated sample
+        uint16_t ACCUMULATORS[COUNT];
+        uint8_t ACCUMULATED[COUNT];
+
+        // In free-running mode the next conversion has already started (with the old ADMUX) by the time the
+        // interrupt runs, so a new ADMUX only applies to the conversion after that one. In noise reduction mode
+        // the next conversion only starts once the main loop sleeps again, so it applies right away.
+        uint8_t CONVERTED  = 0;  // Channel whose result is in ADC
+        uint8_t CONVERTING = 0;  // Channel of the conversion in progress, or next to start
+
+        volatile uint16_t CONVERSIONS = 0;
+        volatile uint8_t FILLED = 0;  // Channels whose ring has held RING_SIZE samples since begin()
+        uint16_t OVERRUNS = 0;
+
+        inline uint8_t channelMux(uint8_t channel) {
+            return REFERENCE | pgm_read_byte(&CHANNEL_MUX[channel]);
+        }
+
+        void begin()
+        {
+            CONVERTED = 0;
+            CONVERTING = 0;
+            FILLED = 0;
+
+            // Conversions only start below, so nothing races these
+            for (uint8_t channel = 0; channel < COUNT; ++channel) {
+                ACCUMULATORS[channel] = 0;
+                ACCUMULATED[channel] = 0;
+                RINGS[channel].head = 0;
+                RINGS[channel].tail = 0;
+
+                for (uint8_t x = 0; x < RING_SIZE; ++x) {
+                    RINGS[channel].samples[x] = 0;
+                }
+            }
+
+            // The analog pins don't need their digital input buffers, unless they are digital pins too
+            for (uint8_t channel = 0; channel < COUNT; ++channel) {
+                uint8_t pin = pgm_read_byte(&CHANNEL_MUX[channel]);
+
+                if (!digitalToo(pin)) {
+                    DIDR0 |= _BV(pin);
+                }
+            }
+
+            ADMUX  = channelMux(0);
+            ADCSRB = 0;  // Free running when auto triggered, right adjusted results
+
+            if (HardwareConfig::ADC_NOISE_REDUCTION) {
+                // Single conversions, each started by entering sleep in convertQuietly()
+                ADCSRA = _BV(ADEN) | _BV(ADIE) | HardwareConfig::ADC_PRESCALER_BITS;
+            } else {
+                ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | HardwareConfig::ADC_PRESCALER_BITS;
+            }
+        }
+
+        void onConversionComplete()
+        {
+            uint8_t channel = CONVERTED;
+            uint16_t code = ADC;
+
+            // Protection first, it has a reaction time to keep
+            Protection::check(channel, code);
+
+            uint8_t bits = pgm_read_byte(&OVERSAMPLE_BITS[channel]);
+            uint16_t sum = ACCUMULATORS[channel] + code;
+            uint8_t count = ACCUMULATED[channel] + 1;
+
+            CONVERSIONS = CONVERSIONS + 1;
+
+            if (count >> (2 * bits)) {
+                // 4^n conversions: decimate, rounding to nearest
+                volatile Ring &ring = RINGS[channel];
+                uint8_t head = ring.head;
+
+                ring.samples[head & RING_MASK] = (sum + ((1 << bits) >> 1)) >> bits;
+                ring.head = head + 1;
+
+                if (head == RING_SIZE - 1) {
+                    FILLED = FILLED | _BV(channel);
+                }
+
+                sum = 0;
+                count = 0;
+            }
+
+            ACCUMULATORS[channel] = sum;
+            ACCUMULATED[channel] = count;
+
+            uint8_t next = (CONVERTING + 1 == COUNT) ? 0 : CONVERTING + 1;
+            CONVERTED = HardwareConfig::ADC_NOISE_REDUCTION ? next : CONVERTING;
+            CONVERTING = next;
+            ADMUX = channelMux(next);
+        }
+
+        void convertQuietly(uint8_t conversions)
+        {
+            #ifdef ARDUINO
+            set_sleep_mode(SLEEP_MODE_ADC);
+
+            while (conversions--) {
+                uint8_t before = (uint8_t)CONVERSIONS;
+
+                // Entering sleep starts the conversion. If something else wakes us first, sleep again: a
+                // conversion already in progress just carries on. The check and the sleep are atomic, as in
+                // Scheduler::sleepUntilTick().
+                for (;;) {
+                    cli();
+                    if ((uint8_t)CONVERSIONS != before) {
+                        break;
+                    }
+
+                    sleep_enable();
+                    sei();
+                    sleep_cpu();
+                    sleep_disable();
+                }
+                sei();
+            }
+            #else
+            (void)conversions;  // The host has no sleep modes; its tests complete conversions themselves
+            #endif
+        }
+
+        bool primed()
+        {
+            return FILLED == (1 << COUNT) - 1;
+        }
+
+        // Both readers below are lock-free: if a conversion lands in the ring while they are reading it,
+        // head moves and they read again. Conversions are ~800 cycles apart, so retries are rare.
+
+        uint16_t average(Channel channel)
+        {
+            volatile Ring &ring = RINGS[channel];
+            uint8_t head;
+            uint16_t sum;
+
+            do {
+                head = ring.head;
+                sum = 0;
+
+                for (uint8_t x = 0; x < RING_SIZE; ++x) {
+                    sum += ring.samples[x];
+                }
+            } while (head != ring.head);
+
+            return sum / RING_SIZE;
+        }
+
+        bool take(Channel channel, uint16_t &sample)
+        {
+            volatile Ring &ring = RINGS[channel];
+            uint8_t head, tail;
+
+            do {
+                head = ring.head;
+                tail = ring.tail;
+
+                if (head == tail) {
+                    return false;
+                }
+
+                // The producer lapped us: skip to the oldest sample still in the ring
+                if ((uint8_t)(head - tail) > RING_SIZE) {
+                    OVERRUNS += (uint8_t)(head - tail) - RING_SIZE;
+                    tail = head - RING_SIZE;
+                    ring.tail = tail;
+                }
+
+                sample = ring.samples[tail & RING_MASK];
+            } while (head != ring.head);
+
+            ring.tail = tail + 1;
+            return true;
+        }
+
+        uint16_t overruns()
+        {
+            return OVERRUNS;
+        }
+
+        uint16_t conversions()
+        {
+            uint16_t conversions;
+
+            ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+                conversions = CONVERSIONS;
+            }
+
+            return conversions;
+        }
+    }
+}
+
+#ifdef ARDUINO
+    ISR(ADC_vect)
+    {
+        OpenSmartBattery::Analog::onConversionComplete();
+    }
+#endif
@@ -0,0 +1,121 @@
+#ifndef SMART_BATTERY_FIRMWARE_ADC_H
+#define SMART_BATTERY_FIRMWARE_ADC_H
+
+#include "config.hpp"
+#include "platform.hpp"
+#include "scheduler.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Analog {
+        /**
+         * Interrupt-driven acquisition of every analog input. The conversion complete interrupt scans the
+         * channels round-robin, oversamples each as configured in HardwareConfig::OversampleBits, and drops the
+         * decimated result into that channel's ring buffer. Conversions either free-run, or are started by the
+         * main loop going to ADC noise reduction sleep (HardwareConfig::ADC_NOISE_REDUCTION, see convertQuietly).
+         * Nothing here ever busy-waits for a conversion.
+         *
+         * Consumers either read the average of the latest samples (average) or take every sample in order
+         * (take), e.g. to integrate current.
+        **/
+
+        enum Channel: uint8_t {
+            Current     = 0,
+            Cell0       = 1,
+            Cell1       = 2,
+            Cell2       = 3,
+            Pack        = 4,
+            Temperature = 5,
+            COUNT
+        };
+
+        const uint8_t RING_SIZE = HardwareConfig::ADC_RING_SIZE;
+        static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "ADC_RING_SIZE must be a power of two");
+
+        // ADC input (ADMUX channel) a channel is wired to
+        constexpr uint8_t inputPin(Channel channel) {
+            return channel == Current ? HardwareConfig::Pins::CURRENT_SENSE
+                 : channel == Cell0   ? HardwareConfig::Pins::CELL_0_VOLTAGE
+                 : channel == Cell1   ? HardwareConfig::Pins::CELL_1_VOLTAGE
+                 : channel == Cell2   ? HardwareConfig::Pins::CELL_2_VOLTAGE
+                 : channel == Pack    ? HardwareConfig::Pins::PACK_VOLTAGE
+                 :                      HardwareConfig::Pins::PACK_TEMP_SENSE;
+        }
+
+        // Extra bits of resolution the samples of a channel carry: they are (10 + n)-bit values
+        constexpr uint8_t oversampleBits(Channel channel) {
+            return channel == Current ? HardwareConfig::OversampleBits::CURRENT_SENSE
+                 : channel == Cell0   ? HardwareConfig::OversampleBits::CELL_0_VOLTAGE
+                 : channel == Cell1   ? HardwareConfig::OversampleBits::CELL_1_VOLTAGE
+                 : channel == Cell2   ? HardwareConfig::OversampleBits::CELL_2_VOLTAGE
+                 : channel == Pack    ? HardwareConfig::OversampleBits::PACK_VOLTAGE
+                 :                      HardwareConfig::OversampleBits::PACK_TEMP_SENSE;
+        }
+
+        // Largest sample value of a channel
+        constexpr uint16_t fullScale(Channel channel) {
+            return 1023 << oversampleBits(channel);
+        }
+
+        // Samples a channel delivers per hour, for integrating over time. Noise reduction mode converts one scan
+        // per scheduler tick; free-running conversions take 13 ADC clocks each.
+        constexpr uint32_t samplesPerHour(Channel channel) {
+            return (HardwareConfig::ADC_NOISE_REDUCTION
+                        ? 3600ULL * Scheduler::TICK_HZ
+                        : 3600ULL * F_CPU / (13 << HardwareConfig::ADC_PRESCALER_BITS) / COUNT)
+                   >> (2 * oversampleBits(channel));
+        }
+
+        // The accumulators are 16 bits wide: 4^3 * 1023 is the most they can hold
+        static_assert(oversampleBits(Current) <= 3 && oversampleBits(Cell0) <= 3 && oversampleBits(Cell1) <= 3 &&
+                      oversampleBits(Cell2) <= 3 && oversampleBits(Pack) <= 3 && oversampleBits(Temperature) <= 3,
+                      "At most 3 bits of oversampling per channel");
+        static_assert(RING_SIZE <= 8, "average() sums a ring of 13-bit samples in 16 bits");
+
+        // In noise reduction mode, conversions per scheduler tick (one full scan), and the CPU cycles the main
+        // loop spends asleep for them. Timer1 is stopped meanwhile, so the scheduler shortens its tick to match.
+        const uint8_t CONVERSIONS_PER_TICK = COUNT;
+        const uint16_t QUIET_CYCLES_PER_TICK = HardwareConfig::ADC_NOISE_REDUCTION
+            ? CONVERSIONS_PER_TICK * 13 * (1 << HardwareConfig::ADC_PRESCALER_BITS)
+            : 0;
+
+        struct Ring {
+            uint16_t samples[RING_SIZE];
+            uint8_t head;       // Written by the ISR: total samples stored, wraps
+            uint8_t tail;       // Written by take(): total samples taken, wraps
+        };
+
+        // Configure the ADC and start free-running conversions
+        void begin();
+
+        // Body of the conversion complete interrupt; also what tests call in place of the hardware
+        void onConversionComplete();
+
+        // Noise reduction mode: sleep through the given number of conversions. Other interrupts (TWI, the tick)
+        // still run, the CPU just goes back to sleep until the conversion is done.
+        void convertQuietly(uint8_t conversions);
+
+        // Whether every ring has been filled since begin(). Until then average() still counts empty slots as 0.
+        bool primed();
+
+        // Mean of the latest RING_SIZE samples, in ADC codes scaled by the oversampling (see fullScale)
+        uint16_t average(Channel channel);
+
+        // Voltage before a divider of the given ratio, in mV, from the average of the latest samples
+        inline uint16_t millivolts(Channel channel, uint8_t divider) {
+            return (uint32_t)average(channel) * HardwareConfig::ADC_REFERENCE_MILLIVOLTS * divider
+                   >> (10 + oversampleBits(channel));
+        }
+
+        // Take the oldest sample not yet taken. Returns false if there is none. If the consumer falls more than
+        // RING_SIZE samples behind, the oldest ones are lost and counted in overruns().
+        bool take(Channel channel, uint16_t &sample);
+
+        uint16_t overruns();
+
+        // Total conversions stored since begin(), wraps
+        uint16_t conversions();
+    }
+}
+
+#endif
@@ -1,37 +1,83 @@
-#include "sha1.h"
+#ifndef SMART_BATTERY_FIRMWARE_AUTHENTICATION_H
+#define SMART_BATTERY_FIRMWARE_AUTHENTICATION_H
+
+#include "platform.hpp"
+#include "sha1.hpp"
 #include <stdint.h>
-#include <string.h>
 
 namespace OpenSmartBattery {
     namespace Authentication {
+        /**
+         * The ways a pack answers the challenge the host writes to 0x2f. Pick yours in config.hpp; only that one
+         * is compiled in, so the others cost no flash. Remember that the byte order is big endian (LSB->MSB), but
+         * bit order is little endian (MSB->LSB)!
+         *
+         * A scheme is a struct with:
+         *   RESPONSE_SIZE   Bytes the host reads back from 0x2f
+         *   STEPS, step()   The response is worked out in the main loop, STEPS calls of step() one tick apart,
+         *                   each given the step number and the buffer: the challenge before the first step, the
+         *                   response after the last. Keep each step short, ideally one SHA-1 compression (a few
+         *                   ms on the AVR); the ADC and the bus keep running meanwhile, and the host is told Busy
+         *                   until the last one.
+         *   SECRET          What 0x63-0x66 read back in DEBUG builds, SECRET_SIZE bytes in flash
+        **/
+
+        // Bytes the host writes to 0x2f; writes of any other length are refused with BadSize
+        const uint8_t CHALLENGE_SIZE = 20;
+
+        // Older packs: the same unlock code, whatever the challenge
+        template<const auto &CODE>
+        struct UnlockCode {
+            static const uint8_t RESPONSE_SIZE = sizeof(CODE);
+            static_assert(RESPONSE_SIZE <= 32, "The unlock code has to fit in an SMBus block");
 
-        /*
-        const uint8_t AUTH_KEY[] PROGMEM = {
-            0x33, 0x32, 0x31, 0x30,
-            0x2f, 0x2e, 0x2d, 0x2c,
-            0x2b, 0x2a, 0x29, 0x28,
-            0x27, 0x26, 0x25, 0x24 //,
-            // 0x23, 0x22, 0x21, 0x20
+            static const uint8_t STEPS = 1;
+
+            static constexpr const uint8_t *SECRET = CODE;
+            static const uint8_t SECRET_SIZE = sizeof(CODE);
+
+            static void step(uint8_t, uint8_t *buffer) {
+                for (uint8_t x = 0; x < RESPONSE_SIZE; ++x) {
+                    buffer[x] = pgm_read_byte(&CODE[x]);
+                }
+            }
         };
-        */
 
-        const uint8_t AUTH_KEY[] PROGMEM = {
-            0x10, 0x32, 0x54, 0x76,
-            0x98, 0xba, 0xdc, 0xfe,
-            0xef, 0xcd, 0xab, 0x89,
-            0x67, 0x45, 0x23, 0x01
+        // Most newer packs: HMAC-SHA1 of the challenge. The key blocks only depend on the key, so they are hashed
+        // at build time; the inner and the outer hash are one compression each from there.
+        template<const auto &KEY>
+        struct HmacSha1 {
+            static_assert(sizeof(KEY) == 16 || sizeof(KEY) == 20, "HMAC-SHA1 keys are 16 or 20 bytes");
+
+            static const uint8_t RESPONSE_SIZE = SHA1::DIGEST_SIZE;
+            static const uint8_t STEPS = 2;
+
+            static constexpr const uint8_t *SECRET = KEY;
+            static const uint8_t SECRET_SIZE = sizeof(KEY);
+
+            static constexpr SHA1::State INNER_MIDSTATE PROGMEM = SHA1::keyMidstate(KEY, sizeof(KEY), SHA1::IPAD);
+            static constexpr SHA1::State OUTER_MIDSTATE PROGMEM = SHA1::keyMidstate(KEY, sizeof(KEY), SHA1::OPAD);
+
+            static_assert(CHALLENGE_SIZE == SHA1::DIGEST_SIZE, "The challenge is hashed in place, like the inner hash");
+
+            // The challenge, then the inner hash, each replaced by its hash
+            static void step(uint8_t step, uint8_t *buffer) {
+                SHA1::finishInPlace(step == 0 ? &INNER_MIDSTATE : &OUTER_MIDSTATE, buffer);
+            }
         };
 
-        // Define your battery's authentication method here
-        // Remember that the byte order is big endian (LSB->MSB), but bit order is little endian (MSB->LSB)!
-        inline uint8_t authenticate(uint8_t *output_buffer, uint8_t *challenge_buffer) {
-            Sha1.initHmac(AUTH_KEY, 16);       // Key length is 16 bytes
-            Sha1.write(challenge_buffer, 20);  // Challenge is 20 bytes
+        // Development only: the challenge comes back as it is, so the 0x2f path can be exercised without a key.
+        // No host that checks anything will accept it.
+        struct Passthrough {
+            static const uint8_t RESPONSE_SIZE = CHALLENGE_SIZE;
+            static const uint8_t STEPS = 1;
 
-            // Copy 20-byte SHA hash to the output buffer
-            memcpy(output_buffer, Sha1.resultHmac(), sizeof(uint8_t) * 20);
+            static constexpr const uint8_t *SECRET = nullptr;
+            static const uint8_t SECRET_SIZE = 0;
 
-            return 20;
-        }
+            static void step(uint8_t, uint8_t *) {}
+        };
     }
 }
+
+#endif
@@ -0,0 +1,55 @@
+#include "block.hpp"
+#include "pec.hpp"
+#include "utils.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Block {
+
+        uint8_t ARENA[ARENA_SIZE];
+
+        // The last byte of the write is its PEC
+        static Utils::AlarmErrorCode checkPEC(const uint8_t *bytes, uint8_t count)
+        {
+            uint8_t crc = PEC::update(0, PEC::ADDRESS_WRITE);
+
+            for (uint8_t x = 0; x < count - 1; ++x) {
+                crc = PEC::update(crc, bytes[x]);
+            }
+
+            return crc == bytes[count - 1] ? Utils::AlarmErrorCode::Ok : Utils::AlarmErrorCode::UnknownError;
+        }
+
+        Utils::AlarmErrorCode checkWrite(const uint8_t *bytes, uint8_t count, bool block)
+        {
+            if (count > ARENA_SIZE) {
+                return Utils::AlarmErrorCode::OverflowUnderflow;
+            }
+
+            if (!block) {
+                if (count == 3) {
+                    return Utils::AlarmErrorCode::Ok;
+                }
+
+                return count == 4 ? checkPEC(bytes, count) : Utils::AlarmErrorCode::BadSize;
+            }
+
+            if (count < 2) {
+                return Utils::AlarmErrorCode::BadSize;
+            }
+
+            uint8_t declared = length(bytes);
+
+            if (declared > MAX_LENGTH) {
+                return Utils::AlarmErrorCode::OverflowUnderflow;
+            }
+
+            // Without and with the PEC
+            if (count == declared + 2) {
+                return Utils::AlarmErrorCode::Ok;
+            }
+
+            return count == declared + 3 ? checkPEC(bytes, count) : Utils::AlarmErrorCode::BadSize;
+        }
+    }
+}
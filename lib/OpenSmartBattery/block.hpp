@@ -0,0 +1,47 @@
+#ifndef SMART_BATTERY_FIRMWARE_BLOCK_H
+#define SMART_BATTERY_FIRMWARE_BLOCK_H
+
+#include "utils.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Block {
+        /**
+         * SBS block transfers carry at most 32 bytes, preceded by their length and followed by the PEC.
+         *
+         * One static arena holds whatever transaction is on the bus: the SMBus driver collects a write into it, the
+         * firmware checks it in place, and the reply to a read is written into it over the command that asked for
+         * it. Data that has to outlive its transaction (the challenge written to 0x2f, for a later read) is copied
+         * out by the firmware.
+        **/
+
+        const uint8_t MAX_LENGTH = 32;
+
+        // Command, block length, 32 bytes of block and PEC: the longest write. The longest reply is one less.
+        const uint8_t ARENA_SIZE = MAX_LENGTH + 3;
+
+        extern uint8_t ARENA[ARENA_SIZE];
+
+        /**
+         * Check the size of a write (command byte included) against its command, before anything uses it:
+         *  - a word is the command and two bytes, optionally followed by the PEC
+         *  - a block is the command, a length of at most MAX_LENGTH and that many bytes, optionally followed by
+         *    the PEC
+         * A write longer than the arena (which the driver cuts short) or a block length beyond MAX_LENGTH is an
+         * OverflowUnderflow; any other mismatch is a BadSize. A PEC that doesn't match the rest of the write (and
+         * the address byte before it) means it got corrupted on the way: UnknownError, as SBS has no better code.
+        **/
+        Utils::AlarmErrorCode checkWrite(const uint8_t *bytes, uint8_t count, bool block);
+
+        // Block data of a write that passed checkWrite()
+        inline const uint8_t *data(const uint8_t *bytes) {
+            return bytes + 2;
+        }
+
+        inline uint8_t length(const uint8_t *bytes) {
+            return bytes[1];
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,223 @@
+#include "broadcast.hpp"
+#include "pec.hpp"
+#include "platform.hpp"
+#include "scheduler.hpp"
+#include "utils.hpp"
+#include <stdint.h>
+
+#include "smbus.hpp"
+
+#ifdef SMBUS_WIRE
+    #if defined(TWCR)
+        #include <utility/twi.h>
+    #else
+        #include <Wire.h>
+    #endif
+#endif
+
+namespace OpenSmartBattery {
+    namespace Broadcast {
+
+        // Ring of messages; the one at HEAD is on the bus while IN_FLIGHT. Only the main loop touches these.
+        Message QUEUE[QUEUE_SIZE];
+        uint8_t HEAD = 0;
+        uint8_t COUNT = 0;
+        bool IN_FLIGHT = false;
+        bool BACKING_OFF = false;
+        uint16_t RETRY_AT = 0;
+        uint16_t DROPPED = 0;
+
+        uint8_t FRAME[FRAME_SIZE];
+
+        // Alarms in the last AlarmWarning, and when it went out
+        uint16_t ALARMS_SENT = 0;
+        uint16_t ALARM_SENT_AT = 0;
+        bool ALARM_EVER_SENT = false;
+
+        inline Message &at(uint8_t index) {
+            return QUEUE[(HEAD + index) % QUEUE_SIZE];
+        }
+
+        bool queue(uint8_t address, uint8_t command, uint16_t value)
+        {
+            // The message on the bus already has its frame built, so it can't take the new value
+            for (uint8_t index = IN_FLIGHT ? 1 : 0; index < COUNT; ++index) {
+                Message &message = at(index);
+
+                if (message.address == address && message.command == command) {
+                    message.value = value;
+                    return true;
+                }
+            }
+
+            if (COUNT == QUEUE_SIZE) {
+                return false;
+            }
+
+            Message &message = at(COUNT);
+            message.address = address;
+            message.command = command;
+            message.value = value;
+            message.attempts = 0;
+            ++COUNT;
+
+            return true;
+        }
+
+        void poll()
+        {
+            if (IN_FLIGHT) {
+                Outcome outcome = Link::poll();
+
+                if (outcome == Pending) {
+                    return;
+                }
+
+                IN_FLIGHT = false;
+                Message &message = at(0);
+
+                // Whoever won goes first; it may well be the host with a request for us
+                if (outcome == Lost && ++message.attempts < MAX_ATTEMPTS) {
+                    uint8_t backoff = message.attempts < MAX_BACKOFF ? message.attempts : MAX_BACKOFF;
+                    RETRY_AT = Scheduler::now() + (1 << backoff);
+                    BACKING_OFF = true;
+                    return;
+                }
+
+                if (outcome != Sent) {
+                    ++DROPPED;
+                }
+
+                HEAD = (HEAD + 1) % QUEUE_SIZE;
+                --COUNT;
+            }
+
+            // Only compared while backing off: the tick counter wraps every 65s
+            if (BACKING_OFF) {
+                if ((int16_t)(Scheduler::now() - RETRY_AT) < 0) {
+                    return;
+                }
+                BACKING_OFF = false;
+            }
+
+            if (COUNT == 0 || !Link::idle()) {
+                return;
+            }
+
+            const Message &message = at(0);
+            uint8_t crc = 0;
+
+            FRAME[0] = message.address << 1;
+            FRAME[1] = message.command;
+            FRAME[2] = message.value & 0xff;
+            FRAME[3] = message.value >> 8;
+
+            for (uint8_t x = 0; x < FRAME_SIZE - 1; ++x) {
+                crc = PEC::update(crc, FRAME[x]);
+            }
+            FRAME[4] = crc;
+
+            Link::start(FRAME, FRAME_SIZE);
+            IN_FLIGHT = true;
+        }
+
+        uint8_t pending()
+        {
+            return COUNT;
+        }
+
+        uint16_t dropped()
+        {
+            return DROPPED;
+        }
+
+        void clear()
+        {
+            HEAD = 0;
+            COUNT = 0;
+            IN_FLIGHT = false;
+            BACKING_OFF = false;
+            ALARMS_SENT = 0;
+            ALARM_EVER_SENT = false;
+        }
+
+        void chargingParameters(const Utils::BatteryMode &mode, uint16_t current, uint16_t voltage)
+        {
+            if (mode.chargerMode) {
+                return;
+            }
+
+            queue(CHARGER, 0x14, current);  // ChargingCurrent
+            queue(CHARGER, 0x15, voltage);  // ChargingVoltage
+        }
+
+        void alarmWarning(const Utils::BatteryMode &mode, uint16_t status)
+        {
+            uint16_t alarms = status & ALARM_BITS;
+
+            if (mode.alarmMode || !alarms) {
+                ALARMS_SENT = 0;
+                return;
+            }
+
+            uint16_t now = Scheduler::now();
+            uint16_t since = now - ALARM_SENT_AT;
+            bool raised = alarms & ~ALARMS_SENT;
+
+            if (ALARM_EVER_SENT && !(raised && since >= ALARM_HOLDOFF) && since < ALARM_REPEAT) {
+                return;
+            }
+
+            queue(HOST, 0x16, status);     // AlarmWarning
+            queue(CHARGER, 0x16, status);
+
+            ALARMS_SENT = alarms;
+            ALARM_SENT_AT = now;
+            ALARM_EVER_SENT = true;
+        }
+
+        // The USI backend lives with the USI slave, in smbus.cpp (SMBus::Master)
+        #ifdef SMBUS_WIRE
+        namespace Link {
+            /**
+             * Wire backend. The hardware TWI goes through the core's twi_writeTo() rather than Wire's master
+             * calls: those share their transmit state with the slave reply path, so a request from the host
+             * arriving mid-broadcast (after we lost arbitration to it) would be written into the broadcast.
+             * twi_writeTo() keeps the two apart, and serves the host as slave if it lost to it.
+             *
+             * Either way the transmission itself blocks, ~0.5ms for a frame at 100kHz, unlike the USI backend,
+             * which sends a byte per poll; the queue above it doesn't.
+            **/
+            const uint8_t *PENDING_FRAME;
+            uint8_t PENDING_LENGTH;
+
+            bool idle()
+            {
+                return true;  // The TWI hardware waits for the bus to be free before it sends a START
+            }
+
+            void start(const uint8_t *frame, uint8_t length)
+            {
+                PENDING_FRAME = frame;
+                PENDING_LENGTH = length;
+            }
+
+            Outcome poll()
+            {
+                uint8_t result;
+
+                #if defined(TWCR)
+                    result = twi_writeTo(PENDING_FRAME[0] >> 1, (uint8_t *)PENDING_FRAME + 1, PENDING_LENGTH - 1, true, true);
+                #else
+                    Wire.beginTransmission(PENDING_FRAME[0] >> 1);
+                    Wire.write(PENDING_FRAME + 1, PENDING_LENGTH - 1);
+                    result = Wire.endTransmission();
+                #endif
+
+                // 2: address refused, 3: data refused, anything else is a bus error or lost arbitration
+                return result == 0 ? Sent : (result == 2 || result == 3) ? Nack : Lost;
+            }
+        }
+        #endif
+    }
+}
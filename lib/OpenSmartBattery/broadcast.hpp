@@ -0,0 +1,90 @@
+#ifndef SMART_BATTERY_FIRMWARE_BROADCAST_H
+#define SMART_BATTERY_FIRMWARE_BROADCAST_H
+
+#include "scheduler.hpp"
+#include "utils.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Broadcast {
+        /**
+         * Messages the battery sends as bus master: ChargingCurrent and ChargingVoltage to the smart charger, and
+         * AlarmWarning to the host and the charger. Each is a Write Word with PEC.
+         *
+         * Messages wait in a small queue and go out one at a time from poll(), which never waits for the bus:
+         * while another transaction is in progress, or after losing arbitration, it tries again on a later
+         * tick. A lost arbitration backs off for exponentially longer, so the winner (possibly the host
+         * addressing this battery, which the TWI/USI hardware then serves as slave) has the bus to itself.
+         *
+         * Queueing a message for a device and command that is already waiting updates its value instead:
+         * the charger only ever needs the latest request.
+        **/
+
+        const uint8_t HOST    = 0x08;  // SMBus host
+        const uint8_t CHARGER = 0x09;  // Smart charger
+
+        const uint8_t QUEUE_SIZE  = 4;
+        const uint8_t FRAME_SIZE  = 5;   // Address, command, value LSB, value MSB, PEC
+        const uint8_t MAX_ATTEMPTS = 8;  // Arbitration losses before a message is given up on
+        const uint8_t MAX_BACKOFF  = 5;  // Backoff after the nth loss is 2^n ticks, at most 2^MAX_BACKOFF
+
+        // AlarmWarning goes out as soon as a new alarm is raised, but no more often than ALARM_HOLDOFF, and
+        // is repeated every ALARM_REPEAT while any alarm is still raised (SBS: every 10 seconds)
+        const uint16_t ALARM_HOLDOFF = 1 * Scheduler::TICK_HZ;
+        const uint16_t ALARM_REPEAT  = 10 * Scheduler::TICK_HZ;
+
+        // Bits of BatteryStatus that are alarms
+        const uint16_t ALARM_BITS = 0xdb00;
+
+        enum Outcome: uint8_t {
+            Pending = 0,  // Still on the bus
+            Sent    = 1,
+            Lost    = 2,  // Another master won arbitration
+            Nack    = 3   // Nobody at that address, or it refused the data
+        };
+
+        struct Message {
+            uint8_t address;
+            uint8_t command;
+            uint16_t value;
+            uint8_t attempts;
+        };
+
+        /**
+         * The bus as the transmitter sees it, one implementation per backend (broadcast.cpp for Wire, SMBus::Master
+         * for the USI, the bus simulator for the tests)
+        **/
+        namespace Link {
+            // No transaction in progress that a START would disturb
+            bool idle();
+
+            // Start sending a frame as master; the frame stays valid until poll() stops returning Pending
+            void start(const uint8_t *frame, uint8_t length);
+
+            // Move the frame along; every tick while it returns Pending. The USI sends a byte per call, Wire the
+            // whole frame at once.
+            Outcome poll();
+        }
+
+        // Queue a Write Word; returns false if the queue is full
+        bool queue(uint8_t address, uint8_t command, uint16_t value);
+
+        // Move the current message along, or start the next one if the bus is free. Every tick.
+        void poll();
+
+        uint8_t pending();   // Messages queued, including the one on the bus
+        uint16_t dropped();  // Messages given up on: refused, or lost arbitration MAX_ATTEMPTS times
+
+        // Forget every queued message
+        void clear();
+
+        // Queue ChargingCurrent and ChargingVoltage for the charger, unless the host polls them itself (chargerMode)
+        void chargingParameters(const Utils::BatteryMode &mode, uint16_t current, uint16_t voltage);
+
+        // Queue AlarmWarning for the host and the charger when due (see ALARM_HOLDOFF), unless the host has
+        // silenced it (alarmMode)
+        void alarmWarning(const Utils::BatteryMode &mode, uint16_t status);
+    }
+}
+
+#endif
@@ -0,0 +1,110 @@
+#include "charge.hpp"
+#include "config.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Charge {
+
+        // Lithium plating when cool, faster ageing at high voltage when warm (JEITA). Charging outside
+        // CHARGE_TEMPERATURE_MIN to _MAX is not allowed at all, so the last band goes up to wherever that is.
+        const Band TEMPERATURE_BANDS[BANDS] PROGMEM = {
+            { BatteryConfig::CHARGE_TEMPERATURE_COOL, BatteryConfig::CHARGE_RATE_COOL, BatteryConfig::MAX_CELL_VOLTAGE },
+            { BatteryConfig::CHARGE_TEMPERATURE_WARM, BatteryConfig::CHARGE_RATE,      BatteryConfig::MAX_CELL_VOLTAGE },
+            { 0xffff,                                 BatteryConfig::CHARGE_RATE_WARM,
+              BatteryConfig::MAX_CELL_VOLTAGE - BatteryConfig::WARM_VOLTAGE_DROP }
+        };
+
+        uint16_t Controller::rate(uint8_t percent) const
+        {
+            return (uint32_t)capacity * percent / 100;
+        }
+
+        void Controller::update(const Measurement &measurement, bool allowed)
+        {
+            if (!allowed) {
+                phase = Precharge;
+                qualified = 0;
+                requestedCurrent = 0;
+                requestedVoltage = 0;
+                return;
+            }
+
+            uint8_t band = 0;
+            while (band < BANDS - 1 && measurement.temperature >= pgm_read_word(&TEMPERATURE_BANDS[band].below)) {
+                ++band;
+            }
+
+            uint8_t bandRate = pgm_read_byte(&TEMPERATURE_BANDS[band].rate);
+            uint16_t cellLimit = pgm_read_word(&TEMPERATURE_BANDS[band].cellLimit);
+            uint16_t target = cellLimit * BatteryConfig::CELLS_IN_SERIES;
+
+            // Per-cell clamp: take off however far the highest cell is ahead of its share of the pack, so that the
+            // pack reaching the requested voltage puts it right at its limit. Balanced cells get the full target.
+            uint16_t ahead = measurement.highestCell * BatteryConfig::CELLS_IN_SERIES;
+            ahead = ahead > measurement.packVoltage ? ahead - measurement.packVoltage : 0;
+
+            uint16_t voltage = ahead < target ? target - ahead : 0;
+
+            if (phase == Precharge && measurement.lowestCell >= BatteryConfig::PRECHARGE_VOLTAGE) {
+                phase = ConstantCurrent;
+            }
+
+            if (phase == ConstantCurrent && measurement.packVoltage + BatteryConfig::TERMINATION_VOLTAGE / 2 >= voltage) {
+                phase = ConstantVoltage;
+            }
+
+            if (phase == Full &&
+                measurement.packVoltage + BatteryConfig::RECHARGE_VOLTAGE * BatteryConfig::CELLS_IN_SERIES < target) {
+                phase = TopOff;
+                qualified = 0;
+            }
+
+            // Done when the charger can't push more than C/10 in at close to the voltage it was asked for. Not
+            // discharging counts too: a charger holding a full pack's voltage barely has to supply any current.
+            if (phase == ConstantVoltage || phase == TopOff) {
+                bool tapered = measurement.current >= 0 &&
+                               measurement.current <= (int16_t)rate(BatteryConfig::TERMINATION_RATE) &&
+                               measurement.packVoltage + BatteryConfig::TERMINATION_VOLTAGE >= voltage;
+
+                qualified = tapered ? qualified + 1 : 0;
+
+                if (qualified >= BatteryConfig::TERMINATION_TIME) {
+                    phase = Full;
+                }
+            }
+
+            switch (phase) {
+                case Precharge:
+                    requestedCurrent = rate(BatteryConfig::PRECHARGE_RATE);
+                    requestedVoltage = voltage;
+                    break;
+
+                case Full:
+                    requestedCurrent = 0;
+                    requestedVoltage = 0;
+                    break;
+
+                default:
+                    requestedCurrent = rate(bandRate);
+                    requestedVoltage = voltage;
+                    break;
+            }
+        }
+
+        Phase Controller::state() const
+        {
+            return phase;
+        }
+
+        uint16_t Controller::current() const
+        {
+            return requestedCurrent;
+        }
+
+        uint16_t Controller::voltage() const
+        {
+            return requestedVoltage;
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef SMART_BATTERY_FIRMWARE_CHARGE_H
+#define SMART_BATTERY_FIRMWARE_CHARGE_H
+
+#include "config.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Charge {
+        /**
+         * Charge controller: works out the ChargingCurrent and ChargingVoltage to request from the smart charger,
+         * once a second, from what the pack measures. The charger regulates; the pack tells it what to regulate to.
+         *
+         *  Precharge        a cell is deeply discharged: PRECHARGE_RATE until every cell is above PRECHARGE_VOLTAGE
+         *  ConstantCurrent  the rate of the temperature band, until the pack reaches the requested voltage
+         *  ConstantVoltage  the charger holds the voltage and the current tapers off, until it is down to
+         *                   TERMINATION_RATE within TERMINATION_VOLTAGE of the requested voltage
+         *  Full             nothing is requested, until the pack sags RECHARGE_VOLTAGE per cell
+         *  TopOff           constant voltage again, with the same termination
+         *
+         * The requested voltage is the cells' limit times their number, less however far the highest cell is ahead
+         * of its share of the pack: with the cells out of balance, the pack stops short of its nominal charge
+         * voltage rather than overcharging one of them. Current and cell limit are derated by temperature.
+        **/
+
+        enum Phase: uint8_t {
+            Precharge       = 0,
+            ConstantCurrent = 1,
+            ConstantVoltage = 2,
+            Full            = 3,
+            TopOff          = 4
+        };
+
+        // What the pack measured over the last second
+        struct Measurement {
+            uint16_t packVoltage;  // mV
+            uint16_t lowestCell;   // mV
+            uint16_t highestCell;  // mV
+            int16_t  current;      // mA, positive while charging
+            uint16_t temperature;  // 0.1K
+        };
+
+        // Constant current rate and cell voltage limit of a temperature band, up to (not including) `below`
+        struct Band {
+            uint16_t below;        // 0.1K
+            uint8_t  rate;         // %C
+            uint16_t cellLimit;    // mV
+        };
+
+        const uint8_t BANDS = 3;
+
+        static_assert(BatteryConfig::CHARGE_RATE_COOL < BatteryConfig::CHARGE_RATE &&
+                      BatteryConfig::CHARGE_RATE_WARM < BatteryConfig::CHARGE_RATE,
+                      "CHARGE_RATE is the highest of the bands");
+
+        class Controller {
+            public:
+                // capacity: mAh of the pack, which the rates are relative to
+                constexpr Controller(uint16_t capacity)
+                    : capacity(capacity), phase(Precharge), qualified(0), requestedCurrent(0), requestedVoltage(0) { }
+
+                // Once a second. Charging not allowed (temperature, a fault, ...) requests nothing, and starts over
+                // from the right phase once it is allowed again.
+                void update(const Measurement &measurement, bool allowed);
+
+                Phase state() const;
+                uint16_t current() const;  // mA to request
+                uint16_t voltage() const;  // mV to request
+
+            private:
+                uint16_t capacity;
+                Phase phase;
+                uint8_t qualified;         // Seconds the termination condition has held
+                uint16_t requestedCurrent;
+                uint16_t requestedVoltage;
+
+                uint16_t rate(uint8_t percent) const;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef SMART_BATTERY_FIRMWARE_COMMANDS_H
+#define SMART_BATTERY_FIRMWARE_COMMANDS_H
+
+#include "platform.hpp"
+#include "utils.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    class ReplyWriter;
+
+    namespace Commands {
+        /**
+         * Every SBS command this firmware knows about is described by a single entry in DESCRIPTORS,
+         * which is indexed directly by the command byte. Dispatch, the length byte decision and the
+         * access checks are all one indexed load from flash.
+        **/
+
+        typedef void (*Handler)(ReplyWriter &reply);
+
+        union Target {
+            Handler handler;       // Writes the reply at request time
+            const uint8_t *reply;  // Precomputed reply in flash (STATIC commands, see replies.hpp),
+                                   // or register file entry in RAM (CACHED commands, see registers.hpp)
+
+            constexpr Target(Handler handler) : handler(handler) {}
+            constexpr Target(const uint8_t *reply) : reply(reply) {}
+        };
+
+        // Bits of Descriptor::flags
+        const uint8_t BLOCK  = 1 << 0;  // Reply is a block (prefixed by its length), otherwise a word
+        const uint8_t STATIC = 1 << 1;  // Reply is fixed at build time and precomputed in flash
+        const uint8_t READ   = 1 << 2;  // Host may read the command
+        const uint8_t WRITE  = 1 << 3;  // Host may write the command
+        const uint8_t CACHED = 1 << 4;  // Reply is kept ready in the register file, PEC included
+        const uint8_t RESERVED_BY_SPEC = 1 << 5;  // Unsupported, and reserved by SBS rather than left to us
+
+        const uint8_t READ_ONLY  = READ;
+        const uint8_t READ_WRITE = READ | WRITE;
+
+        struct Descriptor {
+            Target target;  // nullptr handler for unsupported commands
+            uint8_t flags;
+        };
+
+        const uint8_t LAST_COMMAND = 0x66;
+
+        // Defined next to the handlers in OpenSmartBattery.cpp
+        extern const Descriptor DESCRIPTORS[LAST_COMMAND + 1] PROGMEM;
+
+        constexpr Descriptor wordCommand(Handler handler, uint8_t access) {
+            return Descriptor { handler, access };
+        }
+
+        constexpr Descriptor blockCommand(Handler handler, uint8_t access) {
+            return Descriptor { handler, (uint8_t)(BLOCK | access) };
+        }
+
+        constexpr Descriptor wordCommand(const uint8_t *reply, uint8_t access) {
+            return Descriptor { reply, (uint8_t)(STATIC | access) };
+        }
+
+        constexpr Descriptor blockCommand(const uint8_t *reply, uint8_t access) {
+            return Descriptor { reply, (uint8_t)(BLOCK | STATIC | access) };
+        }
+
+        constexpr Descriptor cachedWordCommand(const uint8_t *entry, uint8_t access) {
+            return Descriptor { entry, (uint8_t)(CACHED | access) };
+        }
+
+        constexpr Descriptor UNSUPPORTED = { (Handler)nullptr, 0 };
+        constexpr Descriptor RESERVED = { (Handler)nullptr, RESERVED_BY_SPEC };
+
+        // Only meaningful for commands without the STATIC flag
+        inline Handler handler(uint8_t command) {
+            if (command > LAST_COMMAND) {
+                return nullptr;
+            }
+
+            return (Handler)pgm_read_ptr(&DESCRIPTORS[command].target.handler);
+        }
+
+        // Only meaningful for commands with the STATIC or CACHED flag
+        inline const uint8_t *precomputed(uint8_t command) {
+            return (const uint8_t *)pgm_read_ptr(&DESCRIPTORS[command].target.reply);
+        }
+
+        inline uint8_t flags(uint8_t command) {
+            if (command > LAST_COMMAND) {
+                return 0;
+            }
+
+            return pgm_read_byte(&DESCRIPTORS[command].flags);
+        }
+
+        inline bool isBlock(uint8_t command) {
+            return flags(command) & BLOCK;
+        }
+
+        inline bool isSupported(uint8_t flags) {
+            return flags & (READ | WRITE);
+        }
+
+        // What the host is told for using a command that isn't supported anyway
+        inline Utils::AlarmErrorCode unsupported(uint8_t flags) {
+            return flags & RESERVED_BY_SPEC ? Utils::AlarmErrorCode::ReservedCommand
+                                            : Utils::AlarmErrorCode::UnsupportedCommand;
+        }
+    }
+}
+
+#endif
@@ -1,16 +1,52 @@
 #ifndef SMART_BATTERY_FIRMWARE_CONFIG_H
 #define SMART_BATTERY_FIRMWARE_CONFIG_H
 
+#include "authentication.hpp"
+#include "platform.hpp"
 #include <stdint.h>
-#include <Arduino.h>
 
 namespace OpenSmartBattery {
     namespace BatteryConfig {
 
-        const char* const BATTERY_MODEL  = "AS10D51";  // First 4 chars are cut off?
-        const char* const BATTERY_VENDOR = "Panasonic";
+        // Identification strings and data are baked into precomputed replies at build time
+        constexpr char BATTERY_MODEL[]     = "AS10D51";  // First 4 chars are cut off?
+        constexpr char BATTERY_VENDOR[]    = "Panasonic";
+        constexpr char BATTERY_CHEMISTRY[] = "LION";
         const uint8_t SERIAL_CODE = 64;
 
+        // 0x4b6b = 2017.11.11  | 0x4cb2 = 2018.05.18
+        const uint16_t MANUFACTURE_YEAR  = 2017;
+        const uint8_t  MANUFACTURE_MONTH = 11;
+        const uint8_t  MANUFACTURE_DAY   = 11;
+
+        // Opaque to the host; reported as-is by 0x23 ManufacturerData()
+        constexpr uint8_t MANUFACTURER_DATA[] = {
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x6e, 0x00,
+            0xaa, 0x00, 0x02, 0x10, 0x00, 0x00, 0x00
+        };
+
+        // How the pack answers the challenge the host writes to 0x2f (see authentication.hpp):
+        //   Authentication::UnlockCode<CODE>  CODE whatever the challenge, as older packs do
+        //   Authentication::HmacSha1<KEY>     HMAC-SHA1 of the challenge under a 16 or 20 byte KEY, as newer packs do
+        //   Authentication::Passthrough       The challenge itself; development only
+        constexpr uint8_t AUTH_KEY[] PROGMEM = {
+            0x10, 0x32, 0x54, 0x76,
+            0x98, 0xba, 0xdc, 0xfe,
+            0xef, 0xcd, 0xab, 0x89,
+            0x67, 0x45, 0x23, 0x01
+        };
+        using AuthenticationScheme = Authentication::HmacSha1<AUTH_KEY>;
+
+        // 0x63-0x66 read the scheme's secret back, 4 bytes each, for checking a build against a pack. Production
+        // builds must not give the key away: there, the commands don't exist.
+        #ifdef DEBUG
+        const bool AUTH_KEY_READBACK = true;
+        #else
+        const bool AUTH_KEY_READBACK = false;
+        #endif
+
+        const uint16_t SPECIFICATION_INFO = 0b0000000000110001;  // SBS v1.1 with PEC support, no voltage/current scaling
+
         const uint16_t CHARGE_VOLTAGE  = 12600;  // mV: Voltage at which the pack should be charged
         const uint16_t BATTERY_VOLTAGE = 10800;  // mV: Nominal voltage of battery pack
 
@@ -20,6 +56,15 @@ namespace OpenSmartBattery {
         // Lower MIN_CELL_VOLTAGE at your own risk according to your cells' datasheet
         const uint16_t MIN_CELL_VOLTAGE = 3500;  // in mV
 
+        // Hard limits, checked on every conversion in the ADC interrupt (see protection.hpp). Crossing one opens
+        // the transistors right away and latches a fault until the main loop sees the condition has cleared:
+        // voltages once back inside MAX_CELL_VOLTAGE / MIN_CELL_VOLTAGE, over-current after OVER_CURRENT_RETRY.
+        const uint16_t CELL_OVER_VOLTAGE      = 4300;   // mV
+        const uint16_t CELL_UNDER_VOLTAGE     = 2800;   // mV
+        const uint16_t OVER_CURRENT_CHARGE    = 4500;   // mA
+        const uint16_t OVER_CURRENT_DISCHARGE = 10000;  // mA
+        const uint8_t  OVER_CURRENT_RETRY     = 30;     // s
+
         // Arrangement of cells in pack
         const uint8_t CELLS_IN_SERIES   = 3;  // Number of cells in series within the pack. Defines the voltage. For example, 3 * 3700 = 11.1v
         const uint8_t CELLS_IN_PARALLEL = 3;  // Number of cells in parallel within the pack. Defines the capacity. For example, 3 * 1480mA = 4440mA
@@ -27,25 +72,143 @@ namespace OpenSmartBattery {
         const uint16_t CELL_CAPACITY = 3200 - 50;  // mAh: Cell capacity - tolerance
         const uint8_t  CELL_WEAR     = 98;         // Percentage of cell life left (whole number)
 
+        // Open circuit voltage only tells the state of charge once the cells have relaxed: the average current
+        // has to stay below OCV_REST_CURRENT for OCV_REST_TIME before it may override the coulomb count
+        const uint16_t OCV_REST_CURRENT = 50;    // mA
+        const uint16_t OCV_REST_TIME    = 1800;  // s
+
+        // Temperature limits, in 0.1K. Above OVER_TEMPERATURE everything stops; charging is only allowed between
+        // CHARGE_TEMPERATURE_MIN and _MAX, at reduced current while cool and reduced voltage while warm (JEITA).
+        // Alarms clear TEMPERATURE_HYSTERESIS back inside the limit so they don't chatter.
+        const uint16_t OVER_TEMPERATURE        = 3332;  // 60C
+        const uint16_t CHARGE_TEMPERATURE_MIN  = 2732;  // 0C
+        const uint16_t CHARGE_TEMPERATURE_COOL = 2832;  // 10C: half current below
+        const uint16_t CHARGE_TEMPERATURE_WARM = 3182;  // 45C: 100mV per cell less above
+        const uint16_t CHARGE_TEMPERATURE_MAX  = 3282;  // 55C
+        const uint16_t TEMPERATURE_HYSTERESIS  = 30;    // 3K
+
+        // Charging, at rates in % of the pack's capacity per hour (C). Below PRECHARGE_VOLTAGE a cell only takes
+        // PRECHARGE_RATE; then constant current at the rate of the temperature band until the requested voltage
+        // is reached, and constant voltage until the current has fallen to TERMINATION_RATE within
+        // TERMINATION_VOLTAGE of it for TERMINATION_TIME. A full pack is topped off once it has sagged
+        // RECHARGE_VOLTAGE per cell. The charge rates have to stay below OVER_CURRENT_CHARGE.
+        const uint16_t PRECHARGE_VOLTAGE   = 3000;  // mV per cell
+        const uint8_t  PRECHARGE_RATE      = 10;    // %C
+        const uint8_t  CHARGE_RATE_COOL    = 20;    // %C, from CHARGE_TEMPERATURE_MIN to _COOL
+        const uint8_t  CHARGE_RATE         = 45;    // %C, from CHARGE_TEMPERATURE_COOL to _WARM
+        const uint8_t  CHARGE_RATE_WARM    = 30;    // %C, from CHARGE_TEMPERATURE_WARM to _MAX
+        const uint16_t WARM_VOLTAGE_DROP   = 100;   // mV per cell less than MAX_CELL_VOLTAGE above _WARM
+        const uint8_t  TERMINATION_RATE    = 10;    // %C
+        const uint16_t TERMINATION_VOLTAGE = 100;   // mV
+        const uint8_t  TERMINATION_TIME    = 10;    // s
+        const uint16_t RECHARGE_VOLTAGE    = 100;   // mV per cell
+
+        // Equivalent circuit of one series cell group (its parallel cells together) for the Kalman estimator:
+        // series resistance R0, plus one RC pair for the slower polarization
+        const uint16_t CELL_R0_MILLIOHMS = 15;
+        const uint16_t CELL_R1_MILLIOHMS = 10;
+        const uint16_t CELL_RC_SECONDS   = 30;
+
         const bool HAS_INTERNAL_CHARGE_CONTROLLER = true;   // Pack has a charger that controls voltage and current (normally true)
         const bool HAS_MULTI_BATTERY_SUPPORT      = false;  // Pack has internal switch for multiple batteries (normally false)
         const bool REQUEST_CONDITIONING_CYCLE     = false;  // Cells are new and need to be conditioned (normally false)
     }
 
     namespace HardwareConfig {
+        // SMBus PEC lookup: the full CRC table costs 256 bytes of flash, the nibble table 16 bytes at roughly
+        // three times the cycles per byte. Flash is the tighter resource on the ATtiny84.
+        #ifdef __AVR_ATtiny84__
+        const bool PEC_NIBBLE_TABLE = true;
+        #else
+        const bool PEC_NIBBLE_TABLE = false;
+        #endif
+
+        // State of charge estimator: false counts coulombs and corrects from the OCV after a rest; true runs a
+        // Kalman filter on an equivalent circuit model every second, which also keeps MaxError honest under load.
+        // The filter costs an estimated 1.5KB of flash (64-bit integer math from libgcc included) and 16 bytes of RAM.
+        const bool KALMAN_SOC_ESTIMATOR = false;
+
+        // ADC clock is F_CPU / 64 = 125kHz at 8MHz, inside the 50-200kHz needed for full 10-bit resolution.
+        // A conversion takes 13 ADC clocks, so free-running, the six channels are each sampled ~1600 times a second.
+        const uint8_t ADC_PRESCALER_BITS = 0b110;  // ADPS2:0, /64
+        const uint8_t ADC_RING_SIZE      = 4;      // Latest samples kept per channel; must be a power of two
+
+        // Convert in ADC noise reduction sleep instead of free-running. The CPU and I/O clocks stop during each
+        // conversion, which keeps digital noise off the measurement; the main loop then does a full scan of the
+        // channels every scheduler tick (1kHz per channel) instead of the ADC running on its own.
+        // Conversions, and with them the protection, then wait for the main loop to get round to sleeping, so
+        // its reaction time grows by the longest main loop pass (see MAIN_LOOP_PASS_MICROSECONDS): several ms
+        // instead of ~1.4ms free-running. Leave it off unless the hardware protects the pack on its own.
+        const bool ADC_NOISE_REDUCTION = false;
+
+        // Longest the main loop can run between two sleeps: every task that can fall due on the same tick, back
+        // to back. Only counts in noise reduction mode. Estimated for the ATtiny84 at 8MHz: a SHA-1 compression
+        // for 0x2f (~4ms), a Kalman update (~1.3ms), a broadcast byte (~0.12ms, see Broadcast::Link) and the
+        // rest of the tasks (~0.6ms).
+        const uint16_t MAIN_LOOP_PASS_MICROSECONDS = 6000;
+
+        // Oversampling and decimation: 4^n conversions are summed and shifted right by n for n extra bits of
+        // resolution, at 1/4^n the sample rate. It only works on a signal with at least ~1 LSB of noise, which
+        // the divided cell taps have. n can be at most 3 (13 bits).
+        namespace OversampleBits {
+            const uint8_t CURRENT_SENSE      = 0;  // The coulomb counter wants every sample
+            const uint8_t CELL_0_VOLTAGE     = 3;  // 13 bits, ~0.6mV per LSB for the flat part of the OCV curve
+            const uint8_t CELL_1_VOLTAGE     = 3;
+            const uint8_t CELL_2_VOLTAGE     = 3;
+            const uint8_t PACK_VOLTAGE       = 2;
+            const uint8_t PACK_TEMP_SENSE    = 1;
+        }
+
+        // Consecutive out-of-limit conversions of a channel before the protection trips. One rides through a
+        // single noisy conversion; each one more adds a scan to the reaction time (see Protection::LATENCY_CYCLES).
+        const uint8_t PROTECTION_CONVERSIONS = 2;
+
+        // Current sense: 10mOhm shunt into a x20 bidirectional amplifier biased at half the 5V reference, so
+        // 4.88mV per LSB is 24.4mA, for +-12.5A full scale
+        const uint16_t CURRENT_ZERO_CODE          = 512;    // ADC code at zero current
+        const uint16_t CURRENT_MICROAMPS_PER_LSB  = 24414;
+        const uint16_t CURRENT_DEADBAND_MILLIAMPS = 25;     // Smaller currents are amplifier offset and noise, not charge
+        const uint8_t  CURRENT_GAIN_ERROR         = 1;      // %: shunt and amplifier gain tolerance
+
+        // NTC thermistor from PACK_TEMP_SENSE to ground, series resistor to the reference
+        const uint16_t THERMISTOR_BETA   = 3435;   // K, B25/85
+        const uint16_t THERMISTOR_R25    = 10000;  // Ohm at 25C
+        const uint16_t THERMISTOR_SERIES = 10000;  // Ohm
+
+        // Voltage taps are divided down into the ADC range; tap n sees cells 0 through n stacked
+        const uint16_t ADC_REFERENCE_MILLIVOLTS = 5000;
+        namespace Dividers {
+            const uint8_t CELL_0_VOLTAGE     = 1;
+            const uint8_t CELL_1_VOLTAGE     = 2;
+            const uint8_t CELL_2_VOLTAGE     = 3;
+            const uint8_t PACK_VOLTAGE       = 3;
+        }
+
+        // The analog pins double as ADC channel numbers: on the ATtiny84, PAn is ADCn. The digital pins are Arduino
+        // pin numbers, which the ATtiny core counts counterclockwise: PA0-PA7 are 0-7, then PB2, PB1, PB0 are 8, 9,
+        // 10 and PB3 (RESET) is 11. PA4 and PA6 are SCL and SDA, fixed by the USI, so nothing else can go there;
+        // PA5 is the USI's DO, which two-wire mode leaves free.
         namespace Pins {
-            const uint8_t SERIAL_IN          = PB0;  // External -> device
-            const uint8_t SERIAL_OUT         = PB1;  // Device   -> external
+            // The DEBUG serial only transmits. SoftwareSerial wants a receive pin all the same, so it gets PB3, which
+            // stays RESET: it is only a GPIO with the RSTDISBL fuse programmed, and that locks out ISP programming.
+            const uint8_t SERIAL_IN          = 11;   // PB3 (RESET), never read
+            const uint8_t SERIAL_OUT         = 10;   // PB0, Device   -> external
 
-            const uint8_t OUTPUT_TRANSISTOR  = PA6;
-            const uint8_t CHARGE_TRANSISTOR  = PA7;
+            const uint8_t OUTPUT_TRANSISTOR  = 8;    // PB2
+            const uint8_t CHARGE_TRANSISTOR  = 9;    // PB1
 
             const uint8_t CURRENT_SENSE      = PA0;
             const uint8_t CELL_0_VOLTAGE     = PA1;
             const uint8_t CELL_1_VOLTAGE     = PA2;
             const uint8_t CELL_2_VOLTAGE     = PA3;
-            const uint8_t PACK_VOLTAGE       = PA4;
+            const uint8_t PACK_VOLTAGE       = PA7;
             const uint8_t PACK_TEMP_SENSE    = PA5;
+
+            // All of the above, for checking them against the pins the firmware takes for itself
+            constexpr uint8_t ALL[] = {
+                SERIAL_IN, SERIAL_OUT, OUTPUT_TRANSISTOR, CHARGE_TRANSISTOR,
+                CURRENT_SENSE, CELL_0_VOLTAGE, CELL_1_VOLTAGE, CELL_2_VOLTAGE, PACK_VOLTAGE, PACK_TEMP_SENSE
+            };
         }
     }
 }
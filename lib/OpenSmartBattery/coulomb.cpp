@@ -0,0 +1,146 @@
+#include "coulomb.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Coulomb {
+
+        void Counter::integrate(uint16_t code)
+        {
+            uint16_t zeroCode = pgm_read_word(&calibration->zeroCode);
+            uint16_t microAmpsPerLsb = pgm_read_word(&calibration->microAmpsPerLsb);
+
+            int32_t microAmps = (int32_t)(int16_t)(code - zeroCode) * microAmpsPerLsb;
+            microAmps -= offsetMicroAmps;
+
+            int32_t deadband = pgm_read_word(&calibration->deadbandMicroAmps);
+            if (microAmps < deadband && microAmps > -deadband) {
+                microAmps = 0;
+            }
+
+            accumulate(microAmps);
+        }
+
+        void Counter::integrateMissed(uint16_t samples)
+        {
+            while (samples--) {
+                accumulate(lastMicroAmps);
+            }
+        }
+
+        void Counter::accumulate(int32_t microAmps)
+        {
+            const int32_t unit = pgm_read_dword(&calibration->samplesPerHour);
+            int32_t carried = 0;
+
+            lastMicroAmps = microAmps;
+            residue += microAmps;
+
+            // A sample is at most a few uAh, so this is a couple of subtractions rather than a division
+            while (residue >= unit) {
+                residue -= unit;
+                ++carried;
+            }
+
+            while (residue <= -unit) {
+                residue += unit;
+                --carried;
+            }
+
+            if (carried != 0) {
+                adjust(carried);
+                throughputMicroAmpHours += carried < 0 ? -carried : carried;
+            }
+
+            if (windowSamples < MAX_WINDOW_SAMPLES) {
+                windowSum += microAmps >> 4;
+                ++windowSamples;
+            }
+        }
+
+        void Counter::endWindow()
+        {
+            if (windowSamples == 0) {
+                return;
+            }
+
+            // Mean in 16uA, then to mA rounded half away from zero
+            int32_t mean = (windowSum / windowSamples) * 16;
+            currentMilliAmps = (mean + (mean < 0 ? -500 : 500)) / 1000;
+
+            average += ((int32_t)currentMilliAmps * 65536 - average) >> AVERAGE_SHIFT;
+
+            windowSum = 0;
+            windowSamples = 0;
+        }
+
+        int16_t Counter::current() const
+        {
+            return currentMilliAmps;
+        }
+
+        int16_t Counter::averageCurrent() const
+        {
+            return (average + 0x8000) >> 16;
+        }
+
+        uint16_t Counter::remainingCapacity() const
+        {
+            return remainingMicroAmpHours / 1000;
+        }
+
+        uint32_t Counter::remaining() const
+        {
+            return remainingMicroAmpHours;
+        }
+
+        uint32_t Counter::fullCapacity() const
+        {
+            return fullMicroAmpHours;
+        }
+
+        uint32_t Counter::throughput() const
+        {
+            return throughputMicroAmpHours;
+        }
+
+        void Counter::setOffset(int32_t microAmps)
+        {
+            offsetMicroAmps = microAmps;
+        }
+
+        int32_t Counter::offset() const
+        {
+            return offsetMicroAmps;
+        }
+
+        // Charge never goes below empty or above full: past either end it is heat, not capacity
+        void Counter::adjust(int32_t microAmpHours)
+        {
+            if (microAmpHours < 0 && (uint32_t)-microAmpHours > remainingMicroAmpHours) {
+                remainingMicroAmpHours = 0;
+
+            } else if (microAmpHours > 0 && (uint32_t)microAmpHours > fullMicroAmpHours - remainingMicroAmpHours) {
+                remainingMicroAmpHours = fullMicroAmpHours;
+
+            } else {
+                remainingMicroAmpHours += microAmpHours;
+            }
+        }
+
+        void Counter::setRemaining(uint32_t microAmpHours)
+        {
+            throughputMicroAmpHours = 0;
+            remainingMicroAmpHours = microAmpHours < fullMicroAmpHours ? microAmpHours : fullMicroAmpHours;
+        }
+
+        void Counter::setFullCapacity(uint32_t microAmpHours)
+        {
+            fullMicroAmpHours = microAmpHours;
+
+            if (remainingMicroAmpHours > fullMicroAmpHours) {
+                remainingMicroAmpHours = fullMicroAmpHours;
+            }
+        }
+    }
+}
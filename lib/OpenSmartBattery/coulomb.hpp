@@ -0,0 +1,93 @@
+#ifndef SMART_BATTERY_FIRMWARE_COULOMB_H
+#define SMART_BATTERY_FIRMWARE_COULOMB_H
+
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Coulomb {
+        /**
+         * Coulomb counter: integrates every current sense sample into the remaining capacity, in 32-bit fixed
+         * point. Each sample is calibrated to uA and added to a residue in uA-samples; whole uAh carry over into
+         * the remaining capacity, so no charge is lost to rounding however small the current.
+         *
+         * Samples are taken at a fixed rate. Between two endWindow() calls they are also averaged for Current(),
+         * and the window means are filtered for AverageCurrent().
+        **/
+
+        // AverageCurrent() filter time constant, in windows: 2^13 windows of 5ms is ~41s
+        const uint8_t AVERAGE_SHIFT = 13;
+
+        // A window stops growing here so its sum can't overflow; the charge is still counted
+        const uint16_t MAX_WINDOW_SAMPLES = 2048;
+
+        struct Calibration {
+            uint16_t zeroCode;          // ADC code at zero current
+            uint16_t microAmpsPerLsb;   // Positive while charging
+            uint16_t deadbandMicroAmps; // Samples smaller than this, after the offset, count as no current
+            uint32_t samplesPerHour;    // Sample rate, which makes a uAh this many uA-samples
+        };
+
+        class Counter {
+            public:
+                // The calibration is read where it is, from flash on the AVR (PROGMEM), so it must outlive the counter
+                constexpr Counter(const Calibration &calibration, uint32_t fullCapacity)
+                    : calibration(&calibration),
+                      offsetMicroAmps(0),
+                      lastMicroAmps(0),
+                      residue(0),
+                      remainingMicroAmpHours(fullCapacity),
+                      fullMicroAmpHours(fullCapacity),
+                      throughputMicroAmpHours(0),
+                      windowSum(0),
+                      windowSamples(0),
+                      currentMilliAmps(0),
+                      average(0) { }
+
+                Counter(const Calibration &&, uint32_t) = delete;
+
+                // Integrate one ADC sample of the current sense channel
+                void integrate(uint16_t code);
+
+                // Integrate samples that were lost (e.g. to ADC ring overruns) at the last known current
+                void integrateMissed(uint16_t samples);
+
+                // Close the measurement window: updates current() and averageCurrent()
+                void endWindow();
+
+                int16_t current() const;             // mA over the last window, negative while discharging
+                int16_t averageCurrent() const;      // mA, filtered over about a minute
+                uint16_t remainingCapacity() const;  // mAh
+
+                uint32_t remaining() const;          // uAh
+                uint32_t fullCapacity() const;       // uAh
+                uint32_t throughput() const;         // uAh integrated either way since the last setRemaining()
+
+                // Drift correction. The offset is the current measured when none flows (e.g. with both transistors
+                // off) and is subtracted from every sample; the remaining capacity can be moved or set outright when
+                // something more trustworthy than integration says so (a rested OCV reading, a full charge).
+                void setOffset(int32_t microAmps);
+                int32_t offset() const;
+                void adjust(int32_t microAmpHours);
+                void setRemaining(uint32_t microAmpHours);
+                void setFullCapacity(uint32_t microAmpHours);
+
+            private:
+                const Calibration *calibration;   // In flash
+                int32_t offsetMicroAmps;
+                int32_t lastMicroAmps;
+                int32_t residue;                  // uA-samples not yet carried into a whole uAh
+                uint32_t remainingMicroAmpHours;
+                uint32_t fullMicroAmpHours;
+                uint32_t throughputMicroAmpHours;
+                int32_t windowSum;                // In 16uA, to leave room for MAX_WINDOW_SAMPLES at full scale
+                uint16_t windowSamples;
+                int16_t currentMilliAmps;
+                int32_t average;                  // mA, Q16.16
+
+                void accumulate(int32_t microAmps);
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,88 @@
+#include "kalman.hpp"
+#include "config.hpp"
+#include "ocv.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Kalman {
+
+        int32_t clamp(int64_t value, int32_t low, int32_t high)
+        {
+            return value < low ? low : value > high ? high : (int32_t)value;
+        }
+
+        uint16_t squareRoot(uint32_t value)
+        {
+            uint32_t root = 0;
+            uint32_t bit = 1UL << 30;
+
+            while (bit > value) {
+                bit >>= 2;
+            }
+
+            while (bit != 0) {
+                if (value >= root + bit) {
+                    value -= root + bit;
+                    root = (root >> 1) + bit;
+                } else {
+                    root >>= 1;
+                }
+
+                bit >>= 2;
+            }
+
+            return root;
+        }
+
+        void Filter::reset(uint16_t stateOfCharge)
+        {
+            soc = ((int64_t)stateOfCharge * ONE) / 10000;
+            variance = INITIAL_VARIANCE;
+            polarization = 0;
+        }
+
+        void Filter::update(int32_t charge, uint32_t capacity, int16_t milliAmps, uint16_t millivolts,
+                            uint16_t temperature, OCV::Direction direction)
+        {
+            // Predict: the coulomb count moves the SOC, and the RC pair relaxes towards R1 * the mean current.
+            // A second's charge in uAh is the mean current in mA / 3.6.
+            int32_t meanMilliAmps = charge * 36 / 10;
+
+            soc = clamp(soc + ((int64_t)charge * ONE) / capacity, 0, ONE);
+            variance = clamp((int64_t)variance + PROCESS_NOISE, 0, ONE);
+
+            int32_t target = (int32_t)meanMilliAmps * BatteryConfig::CELL_R1_MILLIOHMS;  // mA * mOhm = uV
+            polarization = ((int64_t)polarization * RC_DECAY + (int64_t)target * (32768 - RC_DECAY)) >> 15;
+
+            // Correct: compare the measured voltage to the model's, through the slope of the OCV curve
+            int32_t slope;
+            uint16_t open = OCV::voltage(stateOfCharge(), temperature, direction, slope);
+
+            int32_t expected = (int32_t)open * 1000 + (int32_t)milliAmps * BatteryConfig::CELL_R0_MILLIOHMS + polarization;
+            int32_t innovation = clamp(((int32_t)millivolts * 1000 - expected) / 1000, -MAX_INNOVATION, MAX_INNOVATION);
+
+            // slope^2 * variance + noise, in mV^2
+            int64_t residual = (((int64_t)slope * slope * variance) >> 31) + MEASUREMENT_NOISE;
+
+            // Gain times innovation is the SOC correction; gain times slope the fraction of variance removed
+            int64_t spread = (int64_t)variance * slope;
+            soc = clamp(soc + spread * innovation / residual, 0, ONE);
+
+            int32_t explained = clamp(spread * slope / residual, 0, ONE);
+            variance -= ((int64_t)explained * variance) >> 31;
+        }
+
+        uint16_t Filter::stateOfCharge() const
+        {
+            return ((int64_t)soc * 10000 + (ONE >> 1)) / ONE;
+        }
+
+        uint8_t Filter::maxError() const
+        {
+            // The variance only covers what the model knows it doesn't know; the curve it measures against
+            // is no better than OCV::MAX_ERROR. sqrt of a Q31 fraction comes out scaled by 2^15.5 = 46341.
+            uint32_t error = ((uint32_t)squareRoot(variance) * 200 + 46340) / 46341 + OCV::MAX_ERROR;
+            return error > 100 ? 100 : error;
+        }
+    }
+}
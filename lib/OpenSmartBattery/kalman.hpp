@@ -0,0 +1,82 @@
+#ifndef SMART_BATTERY_FIRMWARE_KALMAN_H
+#define SMART_BATTERY_FIRMWARE_KALMAN_H
+
+#include "config.hpp"
+#include "ocv.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Kalman {
+        /**
+         * State of charge estimator: an extended Kalman filter over an equivalent circuit model of a cell, the
+         * rested OCV curve in series with R0 and one RC pair. The coulomb count drives the prediction, and
+         * every measured cell voltage corrects it by how far it is from what the model expected.
+         *
+         * SOC and its variance are Q31 fractions, the RC pair's voltage is in uV and its decay factor is Q15;
+         * there is no floating point at run time. The filter is scalar: the RC voltage is propagated open loop,
+         * which leaves it 12 bytes of state.
+         *
+         * Budget on the ATtiny84, per update (once a second), estimated by counting rather than measured:
+         * two OCV lookups, and a handful of 32x32->64 multiplies and 64/32 divisions from libgcc. That is
+         * ~10k cycles, ~1.3ms at 8MHz.
+        **/
+
+        const int32_t ONE = 0x7fffffff;  // 100% SOC, or a variance of 1, in Q31
+
+        // SOC variance added per update, ~4% per hour: coulomb counting drift, and enough doubt in the prediction
+        // that the voltage keeps a hand on the estimate
+        const int32_t PROCESS_NOISE = 2000;
+
+        // Variance of the cell voltage the model can't explain (hysteresis, temperature, RC error), in mV^2
+        const int32_t MEASUREMENT_NOISE = 20 * 20;
+
+        // Variance after reset(): 10% standard deviation
+        const int32_t INITIAL_VARIANCE = ONE / 100;
+
+        // Innovations beyond this are a glitch or a model failure, not information
+        const int16_t MAX_INNOVATION = 200;  // mV
+
+        // Fraction of the RC voltage left after a second, Q15
+        constexpr int16_t decay(uint16_t seconds) {
+            // exp(-1/tau) by its series, to eight terms
+            double x = -1.0 / seconds, term = 1, sum = 1;
+
+            for (uint8_t n = 1; n < 8; ++n) {
+                term *= x / n;
+                sum += term;
+            }
+
+            return (int16_t)(sum * 32768 + 0.5);
+        }
+
+        const int16_t RC_DECAY = decay(BatteryConfig::CELL_RC_SECONDS);
+
+        class Filter {
+            public:
+                constexpr Filter() : soc(ONE / 2), variance(ONE / 4), polarization(0) { }
+
+                // Start again from a known SOC (0.01%), e.g. the OCV at power on
+                void reset(uint16_t stateOfCharge);
+
+                // One second's worth of inputs:
+                //  charge       uAh that went in (negative: out) of the pack since the last update
+                //  capacity     uAh the pack holds when full
+                //  milliAmps    current when the voltage was measured, positive while charging
+                //  millivolts   voltage of the cell group
+                //  temperature  0.1K
+                //  direction    picks the OCV curve
+                void update(int32_t charge, uint32_t capacity, int16_t milliAmps, uint16_t millivolts,
+                            uint16_t temperature, OCV::Direction direction);
+
+                uint16_t stateOfCharge() const;  // 0.01%
+                uint8_t maxError() const;        // %: two standard deviations, plus what the OCV curve may be off by
+
+            private:
+                int32_t soc;           // Q31
+                int32_t variance;      // Q31
+                int32_t polarization;  // uV across the RC pair
+        };
+    }
+}
+
+#endif
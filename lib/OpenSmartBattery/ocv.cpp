@@ -0,0 +1,188 @@
+#include "ocv.hpp"
+#include "config.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace OCV {
+
+        const Table TABLE PROGMEM = makeTable(chemistry());
+
+        // Binary search for the segment of the curve holding the voltage, then interpolate along it
+        uint16_t lookup(const uint16_t *curve, uint16_t millivolts)
+        {
+            if (millivolts <= pgm_read_word(&curve[0])) {
+                return 0;
+            }
+
+            if (millivolts >= pgm_read_word(&curve[POINTS - 1])) {
+                return 10000;
+            }
+
+            uint8_t low = 0;
+            uint8_t high = POINTS - 1;
+
+            while (high - low > 1) {
+                uint8_t middle = (low + high) >> 1;
+
+                if (pgm_read_word(&curve[middle]) <= millivolts) {
+                    low = middle;
+                } else {
+                    high = middle;
+                }
+            }
+
+            uint16_t lowVoltage = pgm_read_word(&curve[low]);
+            uint16_t lowSoc = pgm_read_word(&SOC[low]);
+            uint16_t span = pgm_read_word(&SOC[high]) - lowSoc;
+
+            return lowSoc + (uint32_t)span * (millivolts - lowVoltage) / (pgm_read_word(&curve[high]) - lowVoltage);
+        }
+
+        uint16_t lookup(uint8_t column, uint16_t millivolts, Direction direction)
+        {
+            if (direction == Unknown) {
+                return ((uint32_t)lookup(TABLE.millivolts[column][Discharge], millivolts) +
+                        lookup(TABLE.millivolts[column][Charge], millivolts)) / 2;
+            }
+
+            return lookup(TABLE.millivolts[column][direction], millivolts);
+        }
+
+        uint16_t stateOfCharge(uint16_t millivolts, uint16_t temperature, Direction direction)
+        {
+            uint16_t coldest = pgm_read_word(&TEMPERATURE[0]);
+            uint16_t hottest = pgm_read_word(&TEMPERATURE[TEMPERATURES - 1]);
+
+            // Outside the table the nearest column will do
+            if (temperature <= coldest) {
+                return lookup(0, millivolts, direction);
+            }
+
+            if (temperature >= hottest) {
+                return lookup(TEMPERATURES - 1, millivolts, direction);
+            }
+
+            uint8_t column = 0;
+            while (pgm_read_word(&TEMPERATURE[column + 1]) <= temperature) {
+                ++column;
+            }
+
+            uint16_t low = pgm_read_word(&TEMPERATURE[column]);
+            uint16_t high = pgm_read_word(&TEMPERATURE[column + 1]);
+            int32_t colder = lookup(column, millivolts, direction);
+            int32_t warmer = lookup(column + 1, millivolts, direction);
+
+            return colder + (warmer - colder) * (temperature - low) / (high - low);
+        }
+
+        // SOC is on the same grid for every curve, so this search is shared
+        uint8_t segment(uint16_t soc)
+        {
+            uint8_t low = 0;
+            uint8_t high = POINTS - 1;
+
+            while (high - low > 1) {
+                uint8_t middle = (low + high) >> 1;
+
+                if (pgm_read_word(&SOC[middle]) <= soc) {
+                    low = middle;
+                } else {
+                    high = middle;
+                }
+            }
+
+            return low;
+        }
+
+        uint16_t voltage(uint8_t column, uint8_t point, uint16_t soc, Direction direction, int32_t &slope)
+        {
+            if (direction == Unknown) {
+                int32_t charged;
+                uint16_t low = voltage(column, point, soc, Discharge, slope);
+                uint16_t high = voltage(column, point, soc, Charge, charged);
+
+                slope = (slope + charged) / 2;
+                return (low + high) / 2;
+            }
+
+            const uint16_t *curve = TABLE.millivolts[column][direction];
+            uint16_t lowVoltage = pgm_read_word(&curve[point]);
+            uint16_t rise = pgm_read_word(&curve[point + 1]) - lowVoltage;
+            uint16_t lowSoc = pgm_read_word(&SOC[point]);
+            uint16_t span = pgm_read_word(&SOC[point + 1]) - lowSoc;
+
+            slope = (int32_t)rise * 10000 / span;
+            return lowVoltage + (uint32_t)rise * (soc - lowSoc) / span;
+        }
+
+        uint16_t voltage(uint16_t soc, uint16_t temperature, Direction direction, int32_t &slope)
+        {
+            if (soc > 10000) {
+                soc = 10000;
+            }
+
+            uint8_t point = segment(soc);
+            if (point == POINTS - 1) {
+                --point;
+            }
+
+            uint16_t coldest = pgm_read_word(&TEMPERATURE[0]);
+            uint16_t hottest = pgm_read_word(&TEMPERATURE[TEMPERATURES - 1]);
+
+            if (temperature <= coldest) {
+                return voltage(0, point, soc, direction, slope);
+            }
+
+            if (temperature >= hottest) {
+                return voltage(TEMPERATURES - 1, point, soc, direction, slope);
+            }
+
+            uint8_t column = 0;
+            while (pgm_read_word(&TEMPERATURE[column + 1]) <= temperature) {
+                ++column;
+            }
+
+            uint16_t low = pgm_read_word(&TEMPERATURE[column]);
+            uint16_t high = pgm_read_word(&TEMPERATURE[column + 1]);
+            int32_t warmerSlope;
+            int32_t colder = voltage(column, point, soc, direction, slope);
+            int32_t warmer = voltage(column + 1, point, soc, direction, warmerSlope);
+
+            slope += (warmerSlope - slope) * (temperature - low) / (high - low);
+            return colder + (warmer - colder) * (temperature - low) / (high - low);
+        }
+
+        bool RestDetector::update(int16_t milliAmps)
+        {
+            if (milliAmps > (int16_t)BatteryConfig::OCV_REST_CURRENT || milliAmps < -(int16_t)BatteryConfig::OCV_REST_CURRENT) {
+                seconds = 0;
+                last = milliAmps > 0 ? Charge : Discharge;
+                corrected = false;
+
+                return false;
+            }
+
+            if (seconds < BatteryConfig::OCV_REST_TIME) {
+                ++seconds;
+            }
+
+            if (rested() && !corrected) {
+                corrected = true;
+                return true;
+            }
+
+            return false;
+        }
+
+        bool RestDetector::rested() const
+        {
+            return seconds >= BatteryConfig::OCV_REST_TIME;
+        }
+
+        Direction RestDetector::direction() const
+        {
+            return last;
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#ifndef SMART_BATTERY_FIRMWARE_OCV_H
+#define SMART_BATTERY_FIRMWARE_OCV_H
+
+#include "config.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace OCV {
+        /**
+         * State of charge from the open circuit voltage of a rested cell. The OCV -> SOC curves live in flash
+         * and are generated at build time from the chemistry's curve shape, stretched between the configured
+         * MIN_CELL_VOLTAGE (empty) and MAX_CELL_VOLTAGE (full).
+         *
+         * There is a curve for cells that relaxed after charging and one for after discharging (the OCV
+         * hysteresis), each at several temperatures. A lookup is a binary search over the voltages and a linear
+         * interpolation in integers, then another interpolation between the two nearest temperatures.
+        **/
+
+        const uint8_t POINTS = 12;
+        const uint8_t TEMPERATURES = 3;
+
+        // SOC at each point of the curves, in 0.01%
+        constexpr uint16_t SOC[POINTS] PROGMEM = {
+            0, 500, 1000, 2000, 3000, 4000, 5000, 6000, 7000, 8000, 9000, 10000
+        };
+
+        // Temperature of each column, in 0.1K: 0C, 25C, 45C
+        constexpr uint16_t TEMPERATURE[TEMPERATURES] PROGMEM = { 2732, 2982, 3182 };
+
+        // Shape of a chemistry's OCV curve at 25C
+        struct Chemistry {
+            uint16_t shape[POINTS];        // Permille of the way from empty to full voltage, at each SOC point
+            uint8_t  hysteresis[POINTS];   // mV the curve sits higher after charging than after discharging
+            int16_t  entropic[POINTS];     // uV/K the OCV moves with temperature
+        };
+
+        // Graphite against cobalt/NMC cathodes, as in most 18650s. Steep below 10%, flat in the middle.
+        constexpr Chemistry LION = {
+            {    0,  200,  290,  380,  450,  510,  560,  620,  690,  780,  880, 1000 },
+            {    5,   20,   25,   20,   15,   15,   15,   15,   15,   10,   10,    0 },
+            {  250,  200,  150,  100,   50,    0,  -50, -100, -100,  -50,    0,    0 }
+        };
+
+        // Pouch lithium polymer cells: a little flatter again through the middle
+        constexpr Chemistry LIP = {
+            {    0,  180,  280,  390,  470,  530,  580,  640,  710,  790,  890, 1000 },
+            {    5,   15,   20,   15,   15,   10,   10,   10,   10,   10,    5,    0 },
+            {  250,  200,  150,  100,   50,    0,  -50,  -50,  -50,  -50,    0,    0 }
+        };
+
+        constexpr bool equals(const char *a, const char *b) {
+            return *a == *b && (*a == '\0' || equals(a + 1, b + 1));
+        }
+
+        // Picked by the chemistry reported in 0x22 DeviceChemistry
+        constexpr const Chemistry &chemistry() {
+            return equals(BatteryConfig::BATTERY_CHEMISTRY, "LION") ? LION : LIP;
+        }
+
+        static_assert(equals(BatteryConfig::BATTERY_CHEMISTRY, "LION") || equals(BatteryConfig::BATTERY_CHEMISTRY, "LIP"),
+                      "No OCV curve for this BATTERY_CHEMISTRY");
+
+        // How far off the SOC of a rested cell can be (curve fit, hysteresis, temperature), in %
+        const uint8_t MAX_ERROR = 3;
+
+        enum Direction: uint8_t {
+            Discharge = 0,  // Rested after discharging
+            Charge    = 1,  // Rested after charging
+            Unknown   = 2   // No history, e.g. at power on: halfway between the two
+        };
+
+        struct Table {
+            uint16_t millivolts[TEMPERATURES][2][POINTS];
+        };
+
+        constexpr Table makeTable(const Chemistry &chemistry) {
+            Table table {};
+            const int32_t range = BatteryConfig::MAX_CELL_VOLTAGE - BatteryConfig::MIN_CELL_VOLTAGE;
+
+            for (uint8_t column = 0; column < TEMPERATURES; ++column) {
+                int32_t kelvin = ((int32_t)TEMPERATURE[column] - 2982) / 10;
+
+                for (uint8_t point = 0; point < POINTS; ++point) {
+                    int32_t millivolts = BatteryConfig::MIN_CELL_VOLTAGE + range * chemistry.shape[point] / 1000 +
+                                         kelvin * chemistry.entropic[point] / 1000;
+
+                    table.millivolts[column][Discharge][point] = millivolts;
+                    table.millivolts[column][Charge][point] = millivolts + chemistry.hysteresis[point];
+                }
+            }
+
+            return table;
+        }
+
+        // The binary search needs every curve to rise strictly
+        constexpr bool isMonotonic(const Table &table) {
+            for (uint8_t column = 0; column < TEMPERATURES; ++column) {
+                for (uint8_t direction = 0; direction < 2; ++direction) {
+                    for (uint8_t point = 1; point < POINTS; ++point) {
+                        if (table.millivolts[column][direction][point] <= table.millivolts[column][direction][point - 1]) {
+                            return false;
+                        }
+                    }
+                }
+            }
+
+            return true;
+        }
+
+        static_assert(isMonotonic(makeTable(chemistry())), "OCV curves must rise strictly with SOC");
+
+        // SOC in 0.01% of a cell at the given rested voltage (mV) and temperature (0.1K)
+        uint16_t stateOfCharge(uint16_t millivolts, uint16_t temperature, Direction direction);
+
+        // The other way around: rested voltage (mV) of a cell at the given SOC (0.01%), and the slope of the curve
+        // there in mV per 100% SOC
+        uint16_t voltage(uint16_t soc, uint16_t temperature, Direction direction, int32_t &slope);
+
+        /**
+         * Decides when the cells have rested long enough for their OCV to be trusted, and which way they were
+         * going before, which picks the curve. Starts out rested: at power on the cells have had no load.
+        **/
+        class RestDetector {
+            public:
+                constexpr RestDetector() : seconds(BatteryConfig::OCV_REST_TIME), last(Unknown), corrected(false) { }
+
+                // Once a second, with the average current. True once per rest, when the OCV may be applied.
+                bool update(int16_t milliAmps);
+
+                bool rested() const;
+                Direction direction() const;
+
+            private:
+                uint16_t seconds;   // At rest for this long, saturating at OCV_REST_TIME
+                Direction last;
+                bool corrected;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,56 @@
+#include "pec.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace PEC {
+
+        struct ByteTable {
+            uint8_t values[256];
+        };
+
+        struct NibbleTable {
+            uint8_t values[16];
+        };
+
+        // TABLE[n] is the CRC of the single byte n
+        constexpr ByteTable makeByteTable() {
+            ByteTable table {};
+
+            for (uint16_t n = 0; n < 256; ++n) {
+                table.values[n] = updateBitwise(0, (uint8_t)n);
+            }
+
+            return table;
+        }
+
+        // NIBBLE_TABLE[n] is the remainder left after shifting the nibble n out of the top of the register,
+        // which is the same as the CRC of the byte 0x0n
+        constexpr NibbleTable makeNibbleTable() {
+            NibbleTable table {};
+
+            for (uint8_t n = 0; n < 16; ++n) {
+                table.values[n] = updateBitwise(0, n);
+            }
+
+            return table;
+        }
+
+        const ByteTable TABLE PROGMEM = makeByteTable();
+        const NibbleTable NIBBLE_TABLE PROGMEM = makeNibbleTable();
+
+        uint8_t updateTable(uint8_t crc, uint8_t byte)
+        {
+            return pgm_read_byte(&TABLE.values[crc ^ byte]);
+        }
+
+        uint8_t updateNibble(uint8_t crc, uint8_t byte)
+        {
+            crc ^= byte;
+            crc = (uint8_t)(crc << 4) ^ pgm_read_byte(&NIBBLE_TABLE.values[crc >> 4]);
+            crc = (uint8_t)(crc << 4) ^ pgm_read_byte(&NIBBLE_TABLE.values[crc >> 4]);
+
+            return crc;
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef SMART_BATTERY_FIRMWARE_PEC_H
+#define SMART_BATTERY_FIRMWARE_PEC_H
+
+#include "config.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace PEC {
+        /**
+         * SMBus packet error checking is a CRC-8 with the polynomial x^8 + x^2 + x + 1 (0x07), processed MSB first
+         * with an initial value of 0. It covers every byte of the transaction, including the address bytes.
+        **/
+
+        const uint8_t POLYNOMIAL = 0x07;
+
+        // Address bytes of this battery (0x0B) as they appear on the bus
+        const uint8_t ADDRESS_WRITE = 0x0B << 1;        // 0x16, sent before the command byte
+        const uint8_t ADDRESS_READ  = (0x0B << 1) | 1;  // 0x17, sent on the repeated start of a read
+
+        // Bit-at-a-time reference. Too slow for the bus path, but usable in constant expressions,
+        // which is how the lookup tables are generated.
+        constexpr uint8_t updateBitwise(uint8_t crc, uint8_t byte) {
+            crc ^= byte;
+
+            for (uint8_t bit = 0; bit < 8; ++bit) {
+                crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ POLYNOMIAL) : (uint8_t)(crc << 1);
+            }
+
+            return crc;
+        }
+
+        // One lookup per byte, 256 byte table in flash
+        extern uint8_t updateTable(uint8_t crc, uint8_t byte);
+
+        // Two lookups per byte, 16 byte table in flash
+        extern uint8_t updateNibble(uint8_t crc, uint8_t byte);
+
+        // Add a byte to a running PEC using the table selected in config.hpp.
+        // The unused table is never referenced and is dropped by the linker.
+        inline uint8_t update(uint8_t crc, uint8_t byte) {
+            if (HardwareConfig::PEC_NIBBLE_TABLE) {
+                return updateNibble(crc, byte);
+            }
+
+            return updateTable(crc, byte);
+        }
+
+        // Every read reply is preceded by the write address, the command and the read address
+        inline uint8_t seed(uint8_t command) {
+            return update(update(update(0, ADDRESS_WRITE), command), ADDRESS_READ);
+        }
+    }
+}
+
+#endif
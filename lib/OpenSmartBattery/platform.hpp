@@ -0,0 +1,84 @@
+#ifndef SMART_BATTERY_FIRMWARE_PLATFORM_H
+#define SMART_BATTERY_FIRMWARE_PLATFORM_H
+
+// Everything that differs between the AVR targets and the native test environment lives here, so that the
+// pure logic (PEC, lookup tables, estimators, ...) can be compiled and unit tested on the host
+
+#ifdef ARDUINO
+    #include <Arduino.h>
+    #include <avr/pgmspace.h>
+    #include <util/atomic.h>
+
+#else
+    #include <stdint.h>
+
+    // Flash and RAM share one address space on the host
+    #define PROGMEM
+    #define pgm_read_byte(address)  (*(const uint8_t *)(address))
+    #define pgm_read_word(address)  (*(const uint16_t *)(address))
+    #define pgm_read_dword(address) (*(const uint32_t *)(address))
+    #define pgm_read_ptr(address)   (*(const void * const *)(address))
+
+    // Clock of the target, for code that converts between cycles and time
+    #ifndef F_CPU
+        #define F_CPU 8000000UL
+    #endif
+
+    // The host has no interrupts to hold off
+    #define ATOMIC_RESTORESTATE
+    #define ATOMIC_BLOCK(type) for (bool _atomicOnce = true; _atomicOnce; _atomicOnce = false)
+
+    // Peripheral registers are plain variables on the host, defined by the tests, which play the hardware.
+    // Bit positions follow the ATtiny84.
+    extern volatile uint8_t ADMUX, ADCSRA, ADCSRB, DIDR0;
+    extern volatile uint16_t ADC;
+    extern volatile uint8_t PORTA, DDRA, PINA;
+    extern volatile uint8_t PORTB;
+    extern volatile uint8_t USICR, USISR, USIDR;
+
+    // The ATtiny84 core's pin numbering: 0-7 are PA0-PA7, 8-10 are PB2 down to PB0, 11 is PB3
+    #define digitalPinToPort(pin)    ((pin) < 8 ? 0 : 1)
+    #define digitalPinToBitMask(pin) ((pin) < 8 ? _BV(pin) : (pin) == 11 ? _BV(3) : _BV(10 - (pin)))
+    #define portOutputRegister(port) ((port) ? &PORTB : &PORTA)
+
+    #define _BV(bit) (1 << (bit))
+
+    // Busy wait. The tests define it, and move the bus they play along meanwhile.
+    void _delay_us(double us);
+
+    #define REFS1 7
+    #define REFS0 6
+    #define ADEN  7
+    #define ADSC  6
+    #define ADATE 5
+    #define ADIF  4
+    #define ADIE  3
+
+    #define USISIE 7
+    #define USIOIE 6
+    #define USIWM1 5
+    #define USIWM0 4
+    #define USICS1 3
+    #define USICS0 2
+    #define USICLK 1
+    #define USITC  0
+    #define USISIF 7
+    #define USIOIF 6
+    #define USIPF  5
+
+    // Port pin numbers used by config.hpp
+    #define PA0 0
+    #define PA1 1
+    #define PA2 2
+    #define PA3 3
+    #define PA4 4
+    #define PA5 5
+    #define PA6 6
+    #define PA7 7
+    #define PB0 0
+    #define PB1 1
+    #define PB2 2
+    #define PB3 3
+#endif
+
+#endif
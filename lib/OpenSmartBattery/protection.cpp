@@ -0,0 +1,138 @@
+#include "protection.hpp"
+#include "adc.hpp"
+#include "config.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Protection {
+
+        // Divider of each cell tap, Cell0 to Cell2
+        const uint8_t DIVIDERS[3] PROGMEM = {
+            HardwareConfig::Dividers::CELL_0_VOLTAGE,
+            HardwareConfig::Dividers::CELL_1_VOLTAGE,
+            HardwareConfig::Dividers::CELL_2_VOLTAGE
+        };
+
+        // Resolved once by begin(), so the interrupt writes the ports directly instead of going through
+        // digitalWrite()'s lookups
+        volatile uint8_t *CHARGE_PORT;
+        volatile uint8_t *OUTPUT_PORT;
+        uint8_t CHARGE_MASK;
+        uint8_t OUTPUT_MASK;
+
+        volatile uint8_t FAULTS = 0;
+
+        // Consecutive out-of-limit conversions of the current and each cell, by channel
+        static_assert(Analog::Current == 0 && Analog::Cell2 == 3, "STRIKES is indexed by channel");
+        uint8_t STRIKES[4];
+
+        // Undivided code of the tap below the cell converting next. The taps are converted in order, so it is
+        // never more than a conversion old.
+        uint16_t BELOW = 0;
+
+        // Interrupts are off: both callers are the ADC interrupt or inside an atomic block
+        inline void open(uint8_t faults) {
+            if (faults & OPENS_CHARGE) {
+                *CHARGE_PORT &= ~CHARGE_MASK;
+            }
+
+            if (faults & OPENS_OUTPUT) {
+                *OUTPUT_PORT &= ~OUTPUT_MASK;
+            }
+        }
+
+        void begin()
+        {
+            ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+                CHARGE_PORT = portOutputRegister(digitalPinToPort(HardwareConfig::Pins::CHARGE_TRANSISTOR));
+                OUTPUT_PORT = portOutputRegister(digitalPinToPort(HardwareConfig::Pins::OUTPUT_TRANSISTOR));
+                CHARGE_MASK = digitalPinToBitMask(HardwareConfig::Pins::CHARGE_TRANSISTOR);
+                OUTPUT_MASK = digitalPinToBitMask(HardwareConfig::Pins::OUTPUT_TRANSISTOR);
+
+                open(OPENS_CHARGE | OPENS_OUTPUT);
+
+                FAULTS = 0;
+                BELOW = 0;
+
+                for (uint8_t check = 0; check < 4; ++check) {
+                    STRIKES[check] = 0;
+                }
+            }
+        }
+
+        void check(uint8_t channel, uint16_t code)
+        {
+            uint8_t fault = 0;
+
+            if (channel == Analog::Current) {
+                if (code > CURRENT_HIGH) {
+                    fault = OverCurrentCharge;
+
+                } else if (code < CURRENT_LOW) {
+                    fault = OverCurrentDischarge;
+                }
+
+            } else if (channel <= Analog::Cell2) {
+                uint16_t tap = code * pgm_read_byte(&DIVIDERS[channel - Analog::Cell0]);
+
+                // A tap below the one under it reads as an empty cell, not a huge one
+                uint16_t cell = tap > BELOW ? tap - BELOW : 0;
+                BELOW = channel == Analog::Cell2 ? 0 : tap;
+
+                if (cell > CELL_HIGH) {
+                    fault = OverVoltage;
+
+                } else if (cell < CELL_LOW) {
+                    fault = UnderVoltage;
+                }
+
+            } else {
+                return;
+            }
+
+            if (!fault) {
+                STRIKES[channel] = 0;
+                return;
+            }
+
+            if (++STRIKES[channel] >= HardwareConfig::PROTECTION_CONVERSIONS) {
+                open(fault);
+                FAULTS = FAULTS | fault;
+                STRIKES[channel] = 0;
+            }
+        }
+
+        uint8_t faults()
+        {
+            return FAULTS;
+        }
+
+        void release(uint8_t faults)
+        {
+            ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+                FAULTS = FAULTS & ~faults;
+            }
+        }
+
+        void drive(bool charge, bool output)
+        {
+            // Atomic, or the interrupt could open a transistor between the check and the write
+            ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+                uint8_t faults = FAULTS;
+
+                if (charge && !(faults & OPENS_CHARGE)) {
+                    *CHARGE_PORT |= CHARGE_MASK;
+                } else {
+                    *CHARGE_PORT &= ~CHARGE_MASK;
+                }
+
+                if (output && !(faults & OPENS_OUTPUT)) {
+                    *OUTPUT_PORT |= OUTPUT_MASK;
+                } else {
+                    *OUTPUT_PORT &= ~OUTPUT_MASK;
+                }
+            }
+        }
+    }
+}
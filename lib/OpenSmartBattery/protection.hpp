@@ -0,0 +1,102 @@
+#ifndef SMART_BATTERY_FIRMWARE_PROTECTION_H
+#define SMART_BATTERY_FIRMWARE_PROTECTION_H
+
+#include "adc.hpp"
+#include "config.hpp"
+#include "platform.hpp"
+#include "scheduler.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Protection {
+        /**
+         * Fast cutoff, independent of the main loop. The ADC interrupt hands every raw conversion to check()
+         * before anything else, which compares it against the hard limits in BatteryConfig. Once a channel has
+         * been out of its window for HardwareConfig::PROTECTION_CONVERSIONS conversions in a row, the transistors
+         * are opened straight from the interrupt and the fault latches.
+         *
+         * The main loop only ever closes the transistors again through drive(), which refuses while a fault
+         * opening them is latched, and decides when a fault may be released (see checkValuesAndSetStates).
+         *
+         * The analog comparator would be faster still, but its inputs (AIN0/AIN1) are cell taps PA1/PA2, and
+         * its multiplexer input is taken from the ADC, so it can't run next to the conversions.
+        **/
+
+        enum Fault: uint8_t {
+            OverCurrentCharge    = 0x01,
+            OverCurrentDischarge = 0x02,
+            OverVoltage          = 0x04,
+            UnderVoltage         = 0x08
+        };
+
+        // Faults that open each transistor. Over-current opens both; a cell out of its voltage range only stops
+        // the direction that would push it further, so the other can bring it back.
+        const uint8_t OPENS_CHARGE = OverCurrentCharge | OverCurrentDischarge | OverVoltage;
+        const uint8_t OPENS_OUTPUT = OverCurrentCharge | OverCurrentDischarge | UnderVoltage;
+
+        // Limits in 10-bit ADC codes. Cell voltages are compared as the difference of two taps, each multiplied
+        // back by its divider, so in units of one undivided LSB.
+        constexpr uint16_t millivoltsToCode(uint32_t millivolts) {
+            return millivolts * 1024 / HardwareConfig::ADC_REFERENCE_MILLIVOLTS;
+        }
+
+        constexpr uint16_t milliampsToCodes(uint32_t milliamps) {
+            return milliamps * 1000 / HardwareConfig::CURRENT_MICROAMPS_PER_LSB;
+        }
+
+        const uint16_t CELL_HIGH    = millivoltsToCode(BatteryConfig::CELL_OVER_VOLTAGE);
+        const uint16_t CELL_LOW     = millivoltsToCode(BatteryConfig::CELL_UNDER_VOLTAGE);
+        const uint16_t CURRENT_HIGH = HardwareConfig::CURRENT_ZERO_CODE + milliampsToCodes(BatteryConfig::OVER_CURRENT_CHARGE);
+        const uint16_t CURRENT_LOW  = HardwareConfig::CURRENT_ZERO_CODE - milliampsToCodes(BatteryConfig::OVER_CURRENT_DISCHARGE);
+
+        static_assert(BatteryConfig::OVER_CURRENT_CHARGE * 1000UL / HardwareConfig::CURRENT_MICROAMPS_PER_LSB <
+                      1023 - HardwareConfig::CURRENT_ZERO_CODE, "Charge over-current is beyond the current sense range");
+        static_assert(BatteryConfig::OVER_CURRENT_DISCHARGE * 1000UL / HardwareConfig::CURRENT_MICROAMPS_PER_LSB <
+                      HardwareConfig::CURRENT_ZERO_CODE, "Discharge over-current is beyond the current sense range");
+        static_assert(HardwareConfig::PROTECTION_CONVERSIONS >= 1, "At least one conversion has to trip the protection");
+
+        /**
+         * Worst-case reaction time, from a limit being crossed to the transistors opening, in CPU cycles.
+         *
+         * A crossing can land just after its channel's sample and hold has closed (1.5 ADC clocks into the
+         * conversion). That conversion misses it; the channel then has to be converted PROTECTION_CONVERSIONS
+         * more times, once per scan, and the last of those only completes at the end of its conversion.
+         *
+         * Free-running, scans are back to back. In noise reduction mode there is one scan per scheduler tick,
+         * done when the main loop goes to sleep, and the main loop may run its longest pass before it gets to
+         * that: scans are then up to a tick plus HardwareConfig::MAIN_LOOP_PASS_MICROSECONDS apart. That pass is
+         * an estimate too, and the tests only model the free-running ADC.
+         *
+         * ISR_CYCLES covers the interrupt response (4 cycles, plus up to 4 to finish the current instruction),
+         * the ISR prologue and the window check up to the port write. It is an estimate, not counted from the
+         * generated code. Either way, another interrupt handler running at the time adds its own runtime.
+        **/
+        const uint16_t CONVERSION_CYCLES = 13 << HardwareConfig::ADC_PRESCALER_BITS;
+        const uint16_t SAMPLE_CYCLES     = 3 << (HardwareConfig::ADC_PRESCALER_BITS - 1);
+        const uint16_t ISR_CYCLES        = 100;
+
+        const uint32_t SCAN_CYCLES = HardwareConfig::ADC_NOISE_REDUCTION
+            ? F_CPU / Scheduler::TICK_HZ + F_CPU / 1000000 * HardwareConfig::MAIN_LOOP_PASS_MICROSECONDS
+            : (uint32_t)CONVERSION_CYCLES * Analog::COUNT;
+
+        const uint32_t LATENCY_CYCLES = HardwareConfig::PROTECTION_CONVERSIONS * SCAN_CYCLES
+                                      + CONVERSION_CYCLES - SAMPLE_CYCLES + ISR_CYCLES;
+
+        // Resolve the transistor pins, open both and clear every fault
+        void begin();
+
+        // Body of the window check in the ADC interrupt: the raw 10-bit conversion of the given channel
+        void check(uint8_t channel, uint16_t code);
+
+        // Latched faults
+        uint8_t faults();
+
+        // Forget the given faults; the transistors stay as they are until the next drive()
+        void release(uint8_t faults);
+
+        // Close (true) or open (false) the transistors. A transistor stays open while a fault opening it is latched.
+        void drive(bool charge, bool output);
+    }
+}
+
+#endif
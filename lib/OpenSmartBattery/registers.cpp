@@ -0,0 +1,38 @@
+#include "registers.hpp"
+#include "pec.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Registers {
+
+        bool RegisterFile::set(Register index, uint16_t value)
+        {
+            uint8_t *entry = entries[index];
+            uint8_t lower = value & 0xff;
+            uint8_t higher = value >> 8;
+
+            if (entry[0] == lower && entry[1] == higher) {
+                return false;
+            }
+
+            uint8_t crc = PEC::seed(pgm_read_byte(&COMMANDS[index]));
+            crc = PEC::update(crc, lower);
+            crc = PEC::update(crc, higher);
+
+            // A request must not see the new value with the old PEC
+            ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+                entry[0] = lower;
+                entry[1] = higher;
+                entry[2] = crc;
+            }
+
+            return true;
+        }
+
+        uint16_t RegisterFile::get(Register index) const
+        {
+            return entries[index][0] | (entries[index][1] << 8);
+        }
+    }
+}
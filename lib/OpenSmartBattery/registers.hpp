@@ -0,0 +1,74 @@
+#ifndef SMART_BATTERY_FIRMWARE_REGISTERS_H
+#define SMART_BATTERY_FIRMWARE_REGISTERS_H
+
+#include "pec.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Registers {
+        /**
+         * The word registers hosts poll several times a second, kept ready to send: value LSB, value MSB
+         * and the PEC of the whole reply. The main loop refreshes an entry (and its PEC) only when the value
+         * changes; answering a request is three byte loads.
+         *
+         * The registers the host writes are kept here too, so the value the main loop applied is the one
+         * read back.
+        **/
+
+        enum Register: uint8_t {
+            RemainingCapacityAlarm = 0,  // 0x01
+            RemainingTimeAlarm     = 1,  // 0x02
+            BatteryMode            = 2,  // 0x03
+            AtRate                 = 3,  // 0x04
+            Voltage                = 4,  // 0x09
+            Current                = 5,  // 0x0a
+            RelativeStateOfCharge  = 6,  // 0x0d
+            RemainingCapacity      = 7,  // 0x0f
+            COUNT
+        };
+
+        // Bytes of an entry, in the order they are sent
+        const uint8_t ENTRY_SIZE = 3;
+
+        // Command byte of each register, needed for its PEC
+        constexpr uint8_t COMMANDS[COUNT] PROGMEM = { 0x01, 0x02, 0x03, 0x04, 0x09, 0x0a, 0x0d, 0x0f };
+
+        class RegisterFile {
+            public:
+                // Every register starts out as 0x0000 with a valid PEC, computed at build time
+                constexpr RegisterFile() : entries {} {
+                    for (uint8_t index = 0; index < COUNT; ++index) {
+                        preset((Register)index, 0);
+                    }
+                }
+
+                // Build time only: the value a register starts out with, and its PEC
+                constexpr void preset(Register index, uint16_t value) {
+                    uint8_t crc = PEC::updateBitwise(0, PEC::ADDRESS_WRITE);
+                    crc = PEC::updateBitwise(crc, COMMANDS[index]);
+                    crc = PEC::updateBitwise(crc, PEC::ADDRESS_READ);
+                    crc = PEC::updateBitwise(crc, value & 0xff);
+
+                    entries[index][0] = value & 0xff;
+                    entries[index][1] = value >> 8;
+                    entries[index][2] = PEC::updateBitwise(crc, value >> 8);
+                }
+
+                // Main loop only. Returns true if the value changed.
+                bool set(Register index, uint16_t value);
+
+                uint16_t get(Register index) const;
+
+                // What the TWI handler sends for the register
+                constexpr const uint8_t *entry(Register index) const {
+                    return entries[index];
+                }
+
+            private:
+                uint8_t entries[COUNT][ENTRY_SIZE];
+        };
+    }
+}
+
+#endif
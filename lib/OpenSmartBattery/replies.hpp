@@ -0,0 +1,81 @@
+#ifndef SMART_BATTERY_FIRMWARE_REPLIES_H
+#define SMART_BATTERY_FIRMWARE_REPLIES_H
+
+#include "pec.hpp"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace StaticReplies {
+        /**
+         * Replies that are fixed at build time are generated here by constexpr code, PEC byte included,
+         * and stored in flash. Serving one is a straight copy from flash to the bus.
+         *
+         * bytes[0] holds the number of bytes that follow; those are sent exactly as stored
+         * (length byte for block replies, data LSB->MSB, PEC).
+        **/
+
+        template<size_t SIZE>
+        struct StaticReply {
+            uint8_t bytes[SIZE + 1];
+        };
+
+        constexpr uint8_t seed(uint8_t command) {
+            return PEC::updateBitwise(PEC::updateBitwise(PEC::updateBitwise(0, PEC::ADDRESS_WRITE), command), PEC::ADDRESS_READ);
+        }
+
+        // Fill in the trailing PEC byte of a reply whose data has already been written
+        template<size_t SIZE>
+        constexpr StaticReply<SIZE> withPEC(uint8_t command, StaticReply<SIZE> reply) {
+            uint8_t crc = seed(command);
+
+            for (size_t x = 1; x < SIZE; ++x) {
+                crc = PEC::updateBitwise(crc, reply.bytes[x]);
+            }
+
+            reply.bytes[0] = SIZE;
+            reply.bytes[SIZE] = crc;
+
+            return reply;
+        }
+
+        constexpr StaticReply<3> wordReply(uint8_t command, uint16_t value) {
+            StaticReply<3> reply {};
+            reply.bytes[1] = value & 0xff;
+            reply.bytes[2] = value >> 8;
+
+            return withPEC(command, reply);
+        }
+
+        template<size_t LENGTH>
+        constexpr StaticReply<LENGTH + 2> blockReply(uint8_t command, const uint8_t (&data)[LENGTH]) {
+            static_assert(LENGTH <= 32, "SMBus blocks are at most 32 bytes");
+
+            StaticReply<LENGTH + 2> reply {};
+            reply.bytes[1] = LENGTH;
+
+            for (size_t x = 0; x < LENGTH; ++x) {
+                reply.bytes[x + 2] = data[x];
+            }
+
+            return withPEC(command, reply);
+        }
+
+        // Strings are sent without their terminating NUL
+        template<size_t LENGTH>
+        constexpr StaticReply<LENGTH + 1> blockReply(uint8_t command, const char (&text)[LENGTH]) {
+            static_assert(LENGTH - 1 <= 32, "SMBus blocks are at most 32 bytes");
+
+            StaticReply<LENGTH + 1> reply {};
+            reply.bytes[1] = LENGTH - 1;
+
+            for (size_t x = 0; x < LENGTH - 1; ++x) {
+                reply.bytes[x + 2] = text[x];
+            }
+
+            return withPEC(command, reply);
+        }
+    }
+}
+
+#endif
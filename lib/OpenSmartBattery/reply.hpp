@@ -0,0 +1,113 @@
+#ifndef SMART_BATTERY_FIRMWARE_REPLY_H
+#define SMART_BATTERY_FIRMWARE_REPLY_H
+
+#include "pec.hpp"
+#include "smbus.hpp"
+#include "utils.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+
+    /**
+     * Streams a reply into the SMBus transmit buffer, updating the PEC as each byte goes out.
+     * Handlers write straight into it; requestEvent only brackets them with begin() and end().
+     * Byte order is LSB -> MSB, as everywhere else on the bus.
+    **/
+    class ReplyWriter {
+        public:
+            // Seed the PEC with the bytes the host has already sent for this transaction
+            inline void begin(uint8_t command, bool isBlock) {
+                crc = PEC::seed(command);
+                block = isBlock;
+                error = Utils::AlarmErrorCode::Ok;
+            }
+
+            // Send nothing after all, for a reason the host finds in BatteryStatus. It reads the idle bus level,
+            // which no PEC matches. Only before anything has been written.
+            inline void refuse(Utils::AlarmErrorCode code) {
+                error = code;
+            }
+
+            inline Utils::AlarmErrorCode refused() const {
+                return error;
+            }
+
+            inline void write(uint8_t byte) {
+                SMBus::write(byte);
+                crc = PEC::update(crc, byte);
+
+                #ifdef DEBUG
+                    if (byte < 16) Utils::Serial.print('0');
+                    Utils::Serial.print(byte, HEX);
+                    Utils::Serial.print(' ');
+                #endif
+            }
+
+            // Block replies are prefixed with their byte count; does nothing for word replies
+            inline void writeLength(uint8_t length) {
+                if (block) {
+                    write(length);
+                }
+            }
+
+            inline void writeWord(uint16_t word) {
+                writeLength(2);
+                write(word & 0xff);
+                write(word >> 8);
+            }
+
+            inline void writeBlock(const uint8_t *data, uint8_t length) {
+                writeLength(length);
+
+                for (uint8_t x = 0; x < length; ++x) {
+                    write(data[x]);
+                }
+            }
+
+            // writeBlock() for data kept in flash (PROGMEM), which has to be read with pgm_read_byte on the AVR
+            inline void writeFlash(const uint8_t *data, uint8_t length) {
+                writeLength(length);
+
+                for (uint8_t x = 0; x < length; ++x) {
+                    write(pgm_read_byte(data + x));
+                }
+            }
+
+            // Copy a precomputed reply (see replies.hpp) from flash to the bus. It already carries its PEC,
+            // so nothing else may be written for this transaction, including end().
+            inline void writeStatic(const uint8_t *reply) {
+                uint8_t size = pgm_read_byte(reply);
+
+                for (uint8_t x = 1; x <= size; ++x) {
+                    SMBus::write(pgm_read_byte(reply + x));
+                }
+            }
+
+            // Send a register file entry (see registers.hpp): value LSB, value MSB and its PEC, all from RAM
+            inline void writeCached(const uint8_t *entry) {
+                SMBus::write(entry[0]);
+                SMBus::write(entry[1]);
+                SMBus::write(entry[2]);
+            }
+
+            // SMBus messages end with a CRC-8 byte
+            inline void end() {
+                if (error != Utils::AlarmErrorCode::Ok) {
+                    return;
+                }
+
+                SMBus::write(crc);
+
+                #ifdef DEBUG
+                    Utils::Serial.print("\n");
+                #endif
+            }
+
+        private:
+            uint8_t crc;
+            bool block;
+            Utils::AlarmErrorCode error;
+    };
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include "scheduler.hpp"
+#include "adc.hpp"
+#include "config.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+#ifdef ARDUINO
+    #include <avr/interrupt.h>
+    #include <avr/sleep.h>
+#endif
+
+namespace OpenSmartBattery {
+    namespace Scheduler {
+
+        volatile uint16_t TICKS = 0;
+        uint16_t LAST_SLEEP_TICK = 0;
+        uint16_t LAST_SCAN_TICK = 0;
+
+        void begin()
+        {
+            #ifdef ARDUINO
+            // Timer1 in CTC mode, prescaler 64, compare match A every 1ms.
+            // Timer0 stays with the Arduino core for millis().
+            // The timer stands still while the ADC converts in noise reduction sleep, so the compare value leaves
+            // out the cycles of one scan. sleepUntilTick() does exactly one scan per tick, so the tick is accurate
+            // to the wake-up latency, a few cycles per conversion.
+            static_assert(Analog::QUIET_CYCLES_PER_TICK < F_CPU / TICK_HZ, "ADC scan takes longer than a tick");
+
+            ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+                TCCR1A = 0;
+                TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);
+                OCR1A  = (F_CPU / TICK_HZ - Analog::QUIET_CYCLES_PER_TICK) / 64 - 1;
+                TIMSK1 |= _BV(OCIE1A);
+            }
+            #endif
+        }
+
+        uint16_t now()
+        {
+            uint16_t ticks;
+
+            ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+                ticks = TICKS;
+            }
+
+            return ticks;
+        }
+
+        void tick()
+        {
+            TICKS = TICKS + 1;
+        }
+
+        void schedule(const Task *tasks, TaskState *states, uint8_t count)
+        {
+            uint16_t start = now();
+
+            for (uint8_t index = 0; index < count; ++index) {
+                states[index].release = start + pgm_read_word(&tasks[index].period);
+                states[index].overruns = 0;
+            }
+        }
+
+        void runPending(const Task *tasks, TaskState *states, uint8_t count)
+        {
+            for (uint8_t index = 0; index < count; ++index) {
+                TaskState &state = states[index];
+                uint16_t release = state.release;
+
+                // Signed difference so that the comparison survives the tick counter wrapping
+                if ((int16_t)(now() - release) < 0) {
+                    continue;
+                }
+
+                TaskFunction run = (TaskFunction)pgm_read_ptr(&tasks[index].run);
+                run();
+
+                // Read after the task, so that less is saved on the stack under it
+                uint16_t period = pgm_read_word(&tasks[index].period);
+                uint16_t deadline = pgm_read_word(&tasks[index].deadline);
+
+                uint16_t finished = now();
+                if ((uint16_t)(finished - release) > deadline && state.overruns < 255) {
+                    ++state.overruns;
+                }
+
+                // Fell a whole period behind: skip the missed releases instead of running back-to-back
+                release += period;
+                if ((int16_t)(finished - release) >= 0) {
+                    release = finished + period;
+
+                    if (state.overruns < 255) {
+                        ++state.overruns;
+                    }
+                }
+
+                state.release = release;
+            }
+        }
+
+        void sleepUntilTick()
+        {
+            #ifdef ARDUINO
+            // One scan for every tick, catching up after a task that ran long
+            if (HardwareConfig::ADC_NOISE_REDUCTION) {
+                while (LAST_SCAN_TICK != now()) {
+                    Analog::convertQuietly(Analog::CONVERSIONS_PER_TICK);
+                    ++LAST_SCAN_TICK;
+                }
+            }
+
+            set_sleep_mode(SLEEP_MODE_IDLE);
+
+            // Interrupts are only re-enabled by the instruction right before sleep, so a tick arriving
+            // after the check still wakes us up instead of being slept through
+            cli();
+            if (TICKS == LAST_SLEEP_TICK) {
+                sleep_enable();
+                sei();
+                sleep_cpu();
+                sleep_disable();
+            }
+            sei();
+            #endif
+
+            LAST_SLEEP_TICK = now();
+        }
+    }
+}
+
+#ifdef ARDUINO
+    #ifdef TIM1_COMPA_vect
+        ISR(TIM1_COMPA_vect)      // ATtiny84
+    #else
+        ISR(TIMER1_COMPA_vect)    // ATmega
+    #endif
+    {
+        OpenSmartBattery::Scheduler::tick();
+    }
+#endif
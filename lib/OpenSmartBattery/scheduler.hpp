@@ -0,0 +1,63 @@
+#ifndef SMART_BATTERY_FIRMWARE_SCHEDULER_H
+#define SMART_BATTERY_FIRMWARE_SCHEDULER_H
+
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Scheduler {
+        /**
+         * Cooperative scheduler driven by a 1ms Timer1 tick. Tasks are declared in a constexpr table in flash;
+         * the only RAM they need is a TaskState each. Tasks run to completion in table order, and the CPU sleeps
+         * in idle mode (TWI, ADC and timers keep running) until the next tick whenever nothing is due. With
+         * HardwareConfig::ADC_NOISE_REDUCTION, each tick's ADC scan happens in that sleep first.
+        **/
+
+        const uint16_t TICK_HZ = 1000;  // One tick per ms
+
+        typedef void (*TaskFunction)();
+
+        struct Task {
+            TaskFunction run;
+            uint16_t period;    // ticks between releases
+            uint16_t deadline;  // ticks after its release by which the task must have finished
+        };
+
+        struct TaskState {
+            uint16_t release;   // tick at which the task is next due
+            uint8_t  overruns;  // times the task finished after its deadline or skipped a period (saturates)
+        };
+
+        // Start the tick timer
+        void begin();
+
+        // Current tick, wraps every ~65s
+        uint16_t now();
+
+        // Advance the tick; called by the timer interrupt (or directly by tests)
+        void tick();
+
+        // Make every task first due one period from now. The slow ones then start out with the ADC rings full
+        // (Analog::primed), instead of all running on tick 0.
+        void schedule(const Task *tasks, TaskState *states, uint8_t count);
+
+        // Run every task that is due, once
+        void runPending(const Task *tasks, TaskState *states, uint8_t count);
+
+        // Sleep until the next interrupt if no tick has passed since the last call, converting a scan of the ADC
+        // channels on the way in noise reduction mode
+        void sleepUntilTick();
+
+        template<uint8_t COUNT>
+        inline void schedule(const Task (&tasks)[COUNT], TaskState (&states)[COUNT]) {
+            schedule(tasks, states, COUNT);
+        }
+
+        template<uint8_t COUNT>
+        inline void runPending(const Task (&tasks)[COUNT], TaskState (&states)[COUNT]) {
+            runPending(tasks, states, COUNT);
+        }
+    }
+}
+
+#endif
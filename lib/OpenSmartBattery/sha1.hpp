@@ -0,0 +1,217 @@
+#ifndef SMART_BATTERY_FIRMWARE_SHA1_H
+#define SMART_BATTERY_FIRMWARE_SHA1_H
+
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace SHA1 {
+        /**
+         * SHA-1 (FIPS 180-4) a compression at a time, for HMAC-SHA1 authentication. Everything is constexpr, so
+         * that what only depends on the key is hashed at build time (see keyMidstate) and only the challenge is
+         * left for the AVR.
+         *
+         * Lean on RAM, for the ATtiny84: nothing is static, and the message schedule rolls through the 16 words of
+         * the block instead of expanding it to 80 words (320 bytes): word t of the schedule overwrites word t - 16,
+         * which is no longer needed. The HMAC's 20 byte messages are hashed in place (see finishInPlace), so that
+         * a step's scratch is the 44 bytes of the block that don't fit in the buffer and the working variables.
+         * The round constants are immediates, which live in flash with the code.
+        **/
+
+        const uint8_t BLOCK_SIZE  = 64;
+        const uint8_t DIGEST_SIZE = 20;
+
+        // HMAC pads, XORed into the key block
+        const uint8_t IPAD = 0x36;
+        const uint8_t OPAD = 0x5c;
+
+        struct State {
+            uint32_t h[5];
+        };
+
+        constexpr State INITIAL = { { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 } };
+
+        constexpr uint32_t rotate(uint32_t word, uint8_t bits) {
+            return word << bits | word >> (32 - bits);
+        }
+
+        // The 16 words of a block, in an array
+        struct Words {
+            uint32_t *w;
+
+            constexpr uint32_t get(uint8_t index) const {
+                return w[index];
+            }
+
+            constexpr void set(uint8_t index, uint32_t word) {
+                w[index] = word;
+            }
+        };
+
+        // The 80 rounds, from and to the working variables `v`; `words` is the block, overwritten by the schedule
+        template<typename Block>
+        constexpr void rounds(State &v, Block &words) {
+            uint32_t a = v.h[0], b = v.h[1], c = v.h[2], d = v.h[3], e = v.h[4];
+
+            for (uint8_t t = 0; t < 80; ++t) {
+                uint32_t word = words.get(t & 15);
+
+                if (t >= 16) {
+                    word ^= words.get((t + 13) & 15) ^ words.get((t + 8) & 15) ^ words.get((t + 2) & 15);
+                    word = rotate(word, 1);
+                    words.set(t & 15, word);
+                }
+
+                uint32_t f = t < 20 ? ((b & c) | (~b & d)) + 0x5a827999
+                           : t < 40 ? (b ^ c ^ d) + 0x6ed9eba1
+                           : t < 60 ? ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc
+                           :          (b ^ c ^ d) + 0xca62c1d6;
+
+                uint32_t next = rotate(a, 5) + f + e + word;
+                e = d;
+                d = c;
+                c = rotate(b, 30);
+                b = a;
+                a = next;
+            }
+
+            v = { { a, b, c, d, e } };
+        }
+
+        // Fold a block, as 16 big endian words, into the state. The words are overwritten.
+        constexpr void compress(State &state, uint32_t (&w)[16]) {
+            State v = state;
+            Words words = { w };
+            rounds(v, words);
+
+            for (uint8_t x = 0; x < 5; ++x) {
+                state.h[x] += v.h[x];
+            }
+        }
+
+        // Byte `index` of a block, as SHA-1 reads it: big endian within each word
+        constexpr void setByte(uint32_t (&w)[16], uint8_t index, uint8_t byte) {
+            w[index >> 2] |= (uint32_t)byte << (24 - 8 * (index & 3));
+        }
+
+        /**
+         * Fold the rest of a message into the state, with the padding and the length of the whole message,
+         * `hashed` bytes of which (a multiple of the block size) have been compressed already. A challenge of up
+         * to 55 bytes is one compression; longer messages take a compression per block, plus one if the padding
+         * doesn't fit after the last bytes.
+        **/
+        constexpr void finish(State &state, const uint8_t *bytes, uint16_t length, uint16_t hashed) {
+            const uint16_t padded = (length + 8) / BLOCK_SIZE * BLOCK_SIZE + BLOCK_SIZE;
+            uint32_t w[16] = {};
+
+            for (uint16_t x = 0; x < padded; ++x) {
+                if (x < length) {
+                    setByte(w, x % BLOCK_SIZE, bytes[x]);
+                } else if (x == length) {
+                    setByte(w, x % BLOCK_SIZE, 0x80);
+                }
+
+                if (x % BLOCK_SIZE == BLOCK_SIZE - 1) {
+                    if (x == padded - 1) {
+                        w[15] = (uint32_t)(hashed + length) * 8;
+                    }
+
+                    compress(state, w);
+
+                    for (uint32_t &word : w) {
+                        word = 0;
+                    }
+                }
+            }
+        }
+
+        constexpr void digest(const State &state, uint8_t *output) {
+            for (uint8_t x = 0; x < DIGEST_SIZE; ++x) {
+                output[x] = state.h[x >> 2] >> (24 - 8 * (x & 3));
+            }
+        }
+
+        // The state after the key block of an HMAC, which only depends on the key; keys longer than a block are
+        // hashed first, as RFC 2104 has it
+        constexpr State keyMidstate(const uint8_t *key, uint16_t length, uint8_t pad) {
+            uint8_t hashed[DIGEST_SIZE] = {};
+
+            if (length > BLOCK_SIZE) {
+                State state = INITIAL;
+                finish(state, key, length, 0);
+                digest(state, hashed);
+
+                key = hashed;
+                length = DIGEST_SIZE;
+            }
+
+            uint32_t w[16] = {};
+            for (uint8_t x = 0; x < BLOCK_SIZE; ++x) {
+                setByte(w, x, (x < length ? key[x] : 0) ^ pad);
+            }
+
+            State state = INITIAL;
+            compress(state, w);
+            return state;
+        }
+
+        // A state kept in flash
+        inline State load(const State *state) {
+            State loaded = {};
+
+            for (uint8_t x = 0; x < 5; ++x) {
+                loaded.h[x] = pgm_read_dword(&state->h[x]);
+            }
+
+            return loaded;
+        }
+
+        /**
+         * The block of a 20 byte message after one block already hashed, such as the challenge or the inner hash
+         * of an HMAC: words 0-4 are the message, read and written big endian where it is, the rest is the padding
+         * and the length of 84 bytes.
+        **/
+        struct InPlace {
+            uint8_t *message;
+            uint32_t rest[11];
+
+            uint32_t get(uint8_t index) const {
+                if (index >= 5) {
+                    return rest[index - 5];
+                }
+
+                const uint8_t *bytes = message + 4 * index;
+                return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint16_t)bytes[2] << 8 | bytes[3];
+            }
+
+            void set(uint8_t index, uint32_t word) {
+                if (index >= 5) {
+                    rest[index - 5] = word;
+                    return;
+                }
+
+                uint8_t *bytes = message + 4 * index;
+                bytes[0] = word >> 24;
+                bytes[1] = word >> 16;
+                bytes[2] = word >> 8;
+                bytes[3] = word;
+            }
+        };
+
+        // finish() and digest() of DIGEST_SIZE bytes, from a state in flash, the digest replacing the message.
+        // Only 44 bytes of the block are on the stack, and no copy of the state besides the working variables.
+        inline void finishInPlace(const State *midstate, uint8_t *buffer) {
+            InPlace words = { buffer, { 0x80000000 } };
+            words.rest[10] = (uint32_t)(BLOCK_SIZE + DIGEST_SIZE) * 8;
+
+            State v = load(midstate);
+            rounds(v, words);
+
+            for (uint8_t x = 0; x < 5; ++x) {
+                words.set(x, pgm_read_dword(&midstate->h[x]) + v.h[x]);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,446 @@
+#include "smbus.hpp"
+#include "OpenSmartBattery.hpp"
+#include "config.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+#ifdef SMBUS_WIRE
+    #include <Wire.h>
+#elif defined(ARDUINO)
+    #include <util/delay.h>
+#endif
+
+namespace OpenSmartBattery {
+    namespace SMBus {
+
+        #ifndef SMBUS_WIRE
+
+        constexpr bool pinMapUses(uint8_t pin) {
+            for (uint8_t other : HardwareConfig::Pins::ALL) {
+                if (other == pin) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Anything else on SCL or SDA would be driven by the bus, and drive it
+        static_assert(!pinMapUses(CLOCK_PIN) && !pinMapUses(DATA_PIN), "HardwareConfig::Pins must keep off SCL and SDA");
+
+        // USICR in two-wire mode, shifting on the external clock. LISTEN only watches for a START; TRANSFER also
+        // takes the counter overflow interrupt, and holds SCL low at every overflow until the interrupt clears it.
+        const uint8_t LISTEN   = _BV(USISIE) | _BV(USIWM1) | _BV(USICS1);
+        const uint8_t TRANSFER = _BV(USISIE) | _BV(USIOIE) | _BV(USIWM1) | _BV(USIWM0) | _BV(USICS1);
+
+        // Passes of the wait for the end of a START in onStart() in tHIGH:MAX, the 50us SMBus lets SCL stay high
+        // without the bus counting as idle; ~6 cycles each (estimated)
+        const uint16_t START_WAIT_LOOPS = F_CPU / 1000000 * 50 / 6;
+
+        // USISR counter presets: the counter sees both clock edges and overflows at 16
+        const uint8_t SHIFT_BYTE = 0;
+        const uint8_t SHIFT_BIT  = 14;
+
+        // What has just been shifted when the counter overflows
+        enum State: uint8_t {
+            Address,    // The address byte
+            WriteAck,   // Our ACK of the address or a data byte of a write
+            WriteData,  // A data byte of a write
+            ReadAck,    // Our ACK of the address of a read
+            ReadData,   // A byte of the reply
+            HostAck     // The host's ACK (wants more) or NACK (done) of that byte
+        };
+
+        // The write coming in, or the reply going out
+        static constexpr uint8_t (&BUFFER)[BUFFER_SIZE] = Block::ARENA;
+        uint8_t LENGTH = 0;
+        uint8_t POSITION = 0;
+
+        State STATE = Address;
+        volatile bool WRITING = false;  // BUFFER holds a write that hasn't been handed over yet
+        volatile bool BUS_FREE = true;  // No START since the last STOP we know of
+
+        // Drive SDA low for the ninth bit
+        inline void ack()
+        {
+            USIDR = 0;
+            DDRA |= _BV(DATA_PIN);
+            USISR = _BV(USIOIF) | SHIFT_BIT;
+        }
+
+        // Let go of the bus until the next START. Releasing SDA for the ninth bit NACKs it.
+        inline void listen()
+        {
+            DDRA &= ~_BV(DATA_PIN);
+            USICR = LISTEN;
+            USISR = _BV(USIOIF);
+        }
+
+        inline void finishWrite()
+        {
+            if (WRITING) {
+                WRITING = false;
+                receiveEvent(BUFFER, LENGTH);
+            }
+        }
+
+        void begin()
+        {
+            // SCL is an output so the USI can hold it low; both lines are open drain in two-wire mode
+            PORTA |= _BV(CLOCK_PIN) | _BV(DATA_PIN);
+            DDRA |= _BV(CLOCK_PIN);
+            DDRA &= ~_BV(DATA_PIN);
+
+            USICR = LISTEN;
+            USISR = _BV(USISIF) | _BV(USIOIF) | _BV(USIPF);
+        }
+
+        void write(uint8_t byte)
+        {
+            if (LENGTH < BUFFER_SIZE) {
+                BUFFER[LENGTH++] = byte;
+            }
+        }
+
+        void poll()
+        {
+            // USIPF is only cleared on a START, so it being set means the write ended with a STOP
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                if (WRITING && (USISR & _BV(USIPF))) {
+                    finishWrite();
+                }
+            }
+        }
+
+        void onStart()
+        {
+            // A write followed by a repeated start (the command byte of a read), or by a START without a STOP
+            // in between, ends here. SCL is held low meanwhile.
+            finishWrite();
+
+            STATE = Address;
+            BUS_FREE = false;
+            DDRA &= ~_BV(DATA_PIN);
+
+            // The START is complete once the host pulls SCL low; SDA going high first makes it a STOP after all.
+            // A few us normally; SCL high for longer than SMBus allows means the bus has gone idle, or something
+            // other than a host is on it, and the interrupt lets go rather than wait for it.
+            uint16_t loops = START_WAIT_LOOPS;
+            while ((PINA & _BV(CLOCK_PIN)) && !(PINA & _BV(DATA_PIN))) {
+                if (--loops == 0) {
+                    listen();
+                    USISR = _BV(USISIF) | _BV(USIOIF);
+                    return;
+                }
+            }
+
+            USICR = (PINA & _BV(DATA_PIN)) ? LISTEN : TRANSFER;
+            USISR = _BV(USISIF) | _BV(USIOIF) | _BV(USIPF) | SHIFT_BYTE;
+        }
+
+        void onOverflow()
+        {
+            switch (STATE) {
+                case Address: {
+                    uint8_t address = USIDR;
+
+                    if ((address >> 1) != ADDRESS) {
+                        listen();
+                        return;
+                    }
+
+                    LENGTH = 0;
+
+                    // The reply is written while SCL is still held low, so it is complete before the host
+                    // clocks its first byte
+                    if (address & 1) {
+                        POSITION = 0;
+                        requestEvent();
+                        STATE = ReadAck;
+
+                    } else {
+                        WRITING = true;
+                        STATE = WriteAck;
+                    }
+
+                    ack();
+                    return;
+                }
+
+                case WriteAck:
+                    DDRA &= ~_BV(DATA_PIN);
+                    STATE = WriteData;
+                    USISR = _BV(USIOIF) | SHIFT_BYTE;
+                    return;
+
+                case WriteData:
+                    // More than any SBS write: NACKed, and handed over as too long
+                    if (LENGTH == BUFFER_SIZE) {
+                        LENGTH = BUFFER_SIZE + 1;
+                        listen();
+                        return;
+                    }
+
+                    BUFFER[LENGTH++] = USIDR;
+                    STATE = WriteAck;
+                    ack();
+                    return;
+
+                case HostAck:
+                    if (USIDR) {
+                        listen();
+                        return;
+                    }
+                    [[fallthrough]];
+
+                case ReadAck:
+                    // Reading past the end of the reply gets the idle bus level
+                    USIDR = POSITION < LENGTH ? BUFFER[POSITION++] : 0xff;
+                    DDRA |= _BV(DATA_PIN);
+                    STATE = ReadData;
+                    USISR = _BV(USIOIF) | SHIFT_BYTE;
+                    return;
+
+                case ReadData:
+                    DDRA &= ~_BV(DATA_PIN);
+                    USIDR = 0;
+                    STATE = HostAck;
+                    USISR = _BV(USIOIF) | SHIFT_BIT;
+                    return;
+            }
+        }
+
+        #else
+
+        /**
+         * Wire backend, for parts with a TWI. Wire buffers each transaction itself (32 bytes, so the longest
+         * block writes get cut short) and calls back once it is complete; writes are copied into the arena.
+        **/
+        void onReceive(int)
+        {
+            uint8_t length = 0;
+
+            while (Wire.available() && length < BUFFER_SIZE) {
+                Block::ARENA[length++] = Wire.read();
+            }
+
+            receiveEvent(Block::ARENA, Wire.available() ? BUFFER_SIZE + 1 : length);
+        }
+
+        void begin()
+        {
+            Wire.begin(ADDRESS);
+            Wire.onReceive(onReceive);
+            Wire.onRequest(requestEvent);
+        }
+
+        void write(uint8_t byte)
+        {
+            Wire.write(byte);
+        }
+
+        void poll() { }
+
+        #endif
+    }
+
+    #ifndef SMBUS_WIRE
+    namespace SMBus {
+        namespace Master {
+            /**
+             * USI backend: a bit-banged master at ~80kHz. start() sends the START, and each poll() one byte and
+             * its ACK, ~0.12ms; SCL stays low in between, which SMBus allows a master for up to 10ms per byte
+             * (tLOW:MEXT). The start condition interrupt is off meanwhile so the slave side doesn't answer our
+             * own frames.
+             *
+             * A slave holding SCL low for more than a few us makes poll() return and carry on from the same bit
+             * next time, rather than wait it out; a slave that holds on for STRETCH_POLLS polls (tTIMEOUT) has
+             * lost the frame.
+             *
+             * Every 1 sent is read back; someone else holding SDA low means they won arbitration, and we let go of
+             * both lines on the spot. What we lose to is never for this battery: frames to the host (0x10) and
+             * the charger (0x12) go out before any address byte of ours (0x16, 0x17) can win against them. The
+             * slave side picks the bus up again at the next START.
+            **/
+            using Broadcast::Outcome;
+            using Broadcast::Pending;
+            using Broadcast::Sent;
+            using Broadcast::Lost;
+            using Broadcast::Nack;
+
+            const uint8_t LOW_US  = 5;  // SMBus tLOW >= 4.7us
+            const uint8_t HIGH_US = 4;  // SMBus tHIGH >= 4.0us
+            const uint8_t STRETCH_US = 50;     // Longest a poll waits for SCL to come up
+            const uint8_t STRETCH_POLLS = 25;  // A slave may stretch the clock 25ms in all (tTIMEOUT), a tick a poll
+
+            const uint8_t *PENDING_FRAME;
+            uint8_t PENDING_LENGTH;
+
+            uint8_t POSITION;   // Byte of the frame on the bus
+            uint8_t MASK;       // Its next bit, or 0 for the ACK
+            uint8_t STRETCHED;  // Polls that ended with a slave holding SCL low
+
+            // Release SCL and wait for any slave stretching it, then for the high time. False if it is still
+            // held after STRETCH_US; SCL is left released.
+            inline bool releaseClock()
+            {
+                PORTA |= _BV(CLOCK_PIN);
+
+                for (uint8_t waited = 0; !(PINA & _BV(CLOCK_PIN)); ++waited) {
+                    if (waited == STRETCH_US) {
+                        return false;
+                    }
+                    _delay_us(1);
+                }
+
+                _delay_us(HIGH_US);
+                return true;
+            }
+
+            // Clock one bit out, and return what SDA read while SCL was high: 0 where a 1 was sent means another
+            // master or an ACK is holding it low. 2 if a slave is still stretching the clock.
+            inline uint8_t clockBit(uint8_t bit)
+            {
+                if (bit) {
+                    PORTA |= _BV(DATA_PIN);
+                } else {
+                    PORTA &= ~_BV(DATA_PIN);
+                }
+
+                _delay_us(LOW_US);
+
+                if (!releaseClock()) {
+                    return 2;
+                }
+
+                uint8_t line = (PINA & _BV(DATA_PIN)) ? 1 : 0;
+                PORTA &= ~_BV(CLOCK_PIN);
+
+                return line;
+            }
+
+            // End the frame, and go back to the slave side, minus our own START and STOP
+            Outcome finish(Outcome outcome)
+            {
+                if (outcome == Lost) {
+                    PORTA |= _BV(DATA_PIN) | _BV(CLOCK_PIN);
+
+                } else {
+                    // STOP: SDA rises while SCL is high, then the bus free time
+                    PORTA &= ~_BV(DATA_PIN);
+                    _delay_us(LOW_US);
+                    releaseClock();
+                    PORTA |= _BV(DATA_PIN);
+                    _delay_us(LOW_US);
+                }
+
+                DDRA &= ~_BV(DATA_PIN);
+                USISR = _BV(USISIF) | _BV(USIOIF) | _BV(USIPF);
+                USICR = LISTEN;
+                BUS_FREE = outcome != Lost;
+
+                return outcome;
+            }
+
+            bool idle()
+            {
+                return (BUS_FREE || (USISR & _BV(USIPF))) && (PINA & _BV(CLOCK_PIN)) && (PINA & _BV(DATA_PIN));
+            }
+
+            void start(const uint8_t *frame, uint8_t length)
+            {
+                PENDING_FRAME = frame;
+                PENDING_LENGTH = length;
+                POSITION = 0;
+                MASK = 0x80;
+                STRETCHED = 0;
+
+                // Two-wire mode with no clock source, so that USIDR stays all ones and SDA follows PORTA alone. Clocked
+                // by SCL like the slave side, USIDR would shift SDA in and drive each bit back out eight clocks
+                // later: low through every ACK slot, and against the next 1 sent.
+                USICR = _BV(USIWM1);
+                USIDR = 0xff;
+                PORTA |= _BV(DATA_PIN) | _BV(CLOCK_PIN);
+                DDRA |= _BV(DATA_PIN);
+
+                // START: SDA falls while SCL is high. The start detector holds SCL until USISIF is cleared.
+                PORTA &= ~_BV(DATA_PIN);
+                _delay_us(HIGH_US);
+                PORTA &= ~_BV(CLOCK_PIN);
+                USISR = _BV(USISIF);
+            }
+
+            // A slave is holding SCL low: try the same bit again next poll, unless it has held on too long
+            inline Outcome stretched()
+            {
+                return ++STRETCHED < STRETCH_POLLS ? Pending : finish(Lost);
+            }
+
+            Outcome poll()
+            {
+                uint8_t byte = PENDING_FRAME[POSITION];
+
+                for (; MASK; MASK >>= 1) {
+                    uint8_t bit = byte & MASK ? 1 : 0;
+                    uint8_t line = clockBit(bit);
+
+                    if (line == 2) {
+                        return stretched();
+                    }
+
+                    if (line != bit) {
+                        return finish(Lost);
+                    }
+                }
+
+                uint8_t acked = clockBit(1);
+
+                if (acked == 2) {
+                    return stretched();
+                }
+
+                if (acked == 1) {
+                    return finish(Nack);
+                }
+
+                MASK = 0x80;
+                return ++POSITION == PENDING_LENGTH ? finish(Sent) : Pending;
+            }
+        }
+    }
+    #endif
+
+    #if defined(ARDUINO) && !defined(SMBUS_WIRE)
+    namespace Broadcast {
+        namespace Link {
+            bool idle()
+            {
+                return SMBus::Master::idle();
+            }
+
+            void start(const uint8_t *frame, uint8_t length)
+            {
+                SMBus::Master::start(frame, length);
+            }
+
+            Outcome poll()
+            {
+                return SMBus::Master::poll();
+            }
+        }
+    }
+    #endif
+}
+
+#ifdef ARDUINO
+    #ifndef SMBUS_WIRE
+    ISR(USI_STR_vect)
+    {
+        OpenSmartBattery::SMBus::onStart();
+    }
+
+    ISR(USI_OVF_vect)
+    {
+        OpenSmartBattery::SMBus::onOverflow();
+    }
+    #endif
+#endif
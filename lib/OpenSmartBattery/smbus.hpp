@@ -0,0 +1,67 @@
+#ifndef SMART_BATTERY_FIRMWARE_SMBUS_H
+#define SMART_BATTERY_FIRMWARE_SMBUS_H
+
+#include "block.hpp"
+#include "broadcast.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+// The ATtiny84 (and the host tests, which play its USI) get the USI driver; anything with a TWI goes through Wire
+#if defined(ARDUINO) && !defined(USICR)
+    #define SMBUS_WIRE
+#endif
+
+namespace OpenSmartBattery {
+    namespace SMBus {
+        /**
+         * SMBus slave at ADDRESS. On the USI, a state machine in the start condition and counter overflow
+         * interrupts handles the bus a byte at a time and calls into the firmware directly:
+         *
+         *  - the bytes of a write (command byte included) collect in the block arena, and are handed to
+         *    receiveEvent() when the write ends: on the repeated start of a read, or on the STOP, which the
+         *    USI has no interrupt for and poll() picks up. A write that doesn't fit is NACKed where it
+         *    overflows, and handed over with a count of BUFFER_SIZE + 1.
+         *  - when the host addresses the battery for a read, requestEvent() writes the reply into the arena
+         *    from the address interrupt, and it is shifted out from there.
+         *
+         * SCL is held low from the last edge of every byte until its interrupt is done with it (clock
+         * stretching), so a reply is always ready by the time the host clocks it. Blocks are sized for the
+         * SBS maximum of 32 bytes.
+        **/
+
+        const uint8_t ADDRESS = 0x0B;
+
+        const uint8_t BUFFER_SIZE = Block::ARENA_SIZE;
+
+        #ifndef SMBUS_WIRE
+        // Fixed by the USI
+        const uint8_t CLOCK_PIN = PA4;  // USCK/SCL
+        const uint8_t DATA_PIN  = PA6;  // DI/SDA
+        #endif
+
+        // Start listening on the bus
+        void begin();
+
+        // Append a byte to the reply being built; only from requestEvent()
+        void write(uint8_t byte);
+
+        // Every tick: hand a write that has ended with a STOP to receiveEvent()
+        void poll();
+
+        // Bodies of the USI start condition and counter overflow interrupts; also what tests call in place
+        // of the hardware
+        void onStart();
+        void onOverflow();
+
+        #ifndef SMBUS_WIRE
+        // Bus master on the USI, behind Broadcast::Link; the same calls. Built on the host too, for the tests.
+        namespace Master {
+            bool idle();
+            void start(const uint8_t *frame, uint8_t length);
+            Broadcast::Outcome poll();
+        }
+        #endif
+    }
+}
+
+#endif
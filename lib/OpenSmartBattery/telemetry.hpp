@@ -0,0 +1,35 @@
+#ifndef SMART_BATTERY_FIRMWARE_TELEMETRY_H
+#define SMART_BATTERY_FIRMWARE_TELEMETRY_H
+
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+
+    // What the measurement loop computes for the SMBus handlers. The values only the host reads as words
+    // (voltage, current, remaining capacity, RSOC, BatteryMode) are in the register file instead.
+    //
+    // There is one copy: a handler only ever sends one of these words, so it needs each word whole, not all of
+    // them from the same publish. The main loop stores them with store(), the handlers just read them.
+    struct Telemetry {
+        int16_t  averageCurrent;         // mA
+        uint16_t temperature;            // 0.1K
+        uint16_t fullChargeCapacity;     // mAh
+        uint8_t  absoluteStateOfCharge;  // %
+        uint8_t  maxError;               // % the state of charge may be off by
+        uint16_t chargingCurrent;        // mA requested from the charger
+        uint16_t chargingVoltage;        // mV requested from the charger
+        uint16_t cellVoltage[3];         // mV, 0x3c-0x3e
+        uint16_t batteryStatus;          // 0x16 register word
+    };
+
+    // Store a word the SMBus interrupt may be reading, so that it never sees half of the old value
+    template<typename Word, typename Value>
+    inline void store(Word &word, Value value) {
+        ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+            word = value;
+        }
+    }
+}
+
+#endif
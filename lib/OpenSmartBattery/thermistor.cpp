@@ -0,0 +1,26 @@
+#include "thermistor.hpp"
+#include "platform.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Thermistor {
+
+        const Table TABLE PROGMEM = makeTable();
+
+        uint16_t temperature(uint16_t code)
+        {
+            uint8_t point = code >> STEP_BITS;
+            uint16_t offset = code & ((1 << STEP_BITS) - 1);
+
+            if (point >= POINTS - 1) {
+                return pgm_read_word(&TABLE.temperatures[POINTS - 1]);
+            }
+
+            // The curve falls with the code: hotter means less resistance
+            uint16_t warmer = pgm_read_word(&TABLE.temperatures[point]);
+            uint16_t colder = pgm_read_word(&TABLE.temperatures[point + 1]);
+
+            return warmer - (((uint32_t)(warmer - colder) * offset + (1 << (STEP_BITS - 1))) >> STEP_BITS);
+        }
+    }
+}
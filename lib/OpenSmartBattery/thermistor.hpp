@@ -0,0 +1,93 @@
+#ifndef SMART_BATTERY_FIRMWARE_THERMISTOR_H
+#define SMART_BATTERY_FIRMWARE_THERMISTOR_H
+
+#include "adc.hpp"
+#include "config.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Thermistor {
+        /**
+         * Pack temperature from the NTC thermistor without any floating point at run time. The beta equation
+         *
+         *     1/T = 1/T25 + ln(R/R25) / beta
+         *
+         * is evaluated at build time for evenly spaced ADC codes, and the firmware interpolates between them.
+        **/
+
+        const uint8_t SEGMENT_BITS = 5;                      // 32 segments across the ADC range
+        const uint8_t POINTS = (1 << SEGMENT_BITS) + 1;
+
+        // ADC codes per segment, at the temperature channel's (oversampled) resolution
+        const uint8_t CODE_BITS = 10 + Analog::oversampleBits(Analog::Temperature);
+        const uint8_t STEP_BITS = CODE_BITS - SEGMENT_BITS;
+
+        // Beyond these the thermistor is open or shorted, not measuring: readings are clamped to them
+        const uint16_t COLDEST = 2332;  // -40C
+        const uint16_t HOTTEST = 3982;  // 125C
+
+        // Natural logarithm for constant expressions: scale into [0.75, 1.5] by powers of two, then
+        // ln(x) = 2 atanh((x - 1) / (x + 1)) by its series
+        constexpr double logarithm(double x) {
+            int8_t twos = 0;
+
+            while (x > 1.5) {
+                x /= 2;
+                ++twos;
+            }
+
+            while (x < 0.75) {
+                x *= 2;
+                --twos;
+            }
+
+            double y = (x - 1) / (x + 1), power = y, sum = 0;
+
+            for (uint8_t n = 1; n < 40; n += 2) {
+                sum += power / n;
+                power *= y * y;
+            }
+
+            return twos * 0.69314718055994531 + 2 * sum;
+        }
+
+        // Temperature in 0.1K at an ADC code, by the beta equation
+        constexpr uint16_t beta(uint32_t code) {
+            const uint32_t full = 1UL << CODE_BITS;
+
+            if (code == 0) {
+                return HOTTEST;
+            }
+
+            if (code >= full) {
+                return COLDEST;
+            }
+
+            double resistance = (double)HardwareConfig::THERMISTOR_SERIES * code / (full - code);
+            double kelvin = 1 / (1 / 298.15 +
+                                 logarithm(resistance / HardwareConfig::THERMISTOR_R25) / HardwareConfig::THERMISTOR_BETA);
+            double tenths = kelvin * 10 + 0.5;
+
+            return tenths < COLDEST ? COLDEST : tenths > HOTTEST ? HOTTEST : (uint16_t)tenths;
+        }
+
+        struct Table {
+            uint16_t temperatures[POINTS];
+        };
+
+        constexpr Table makeTable() {
+            Table table {};
+
+            for (uint8_t point = 0; point < POINTS; ++point) {
+                table.temperatures[point] = beta((uint32_t)point << STEP_BITS);
+            }
+
+            return table;
+        }
+
+        // Temperature in 0.1K for an ADC code of the temperature channel
+        uint16_t temperature(uint16_t code);
+    }
+}
+
+#endif
@@ -3,14 +3,17 @@
 
 #include "config.hpp"
 #include <stdint.h>
-#include <SoftwareSerial.h>
+
+#ifdef DEBUG
+    #include <SoftwareSerial.h>
+#endif
 
 namespace OpenSmartBattery {
     namespace Utils {
 
         #ifdef DEBUG
             extern SoftwareSerial Serial;
-            extern void logCommand(char *message, uint8_t command);
+            extern void logCommand(const __FlashStringHelper *message, uint8_t command);
         #endif
 
         // Calculated values from config
@@ -21,12 +24,15 @@ namespace OpenSmartBattery {
         const uint16_t BATTERY_CAPACITY_DESIGN = BatteryConfig::CELL_CAPACITY * BatteryConfig::CELLS_IN_PARALLEL;   // mA: Total capacity of pack
         const uint16_t BATTERY_CAPACITY        = BATTERY_CAPACITY_DESIGN * (BatteryConfig::CELL_WEAR / 100.0);      // mA: Multiplied by BATTERY_VOLTAGE when calculating Wh.
 
+        // Packed as (year - 1980) * 512 + month * 32 + day
+        const uint16_t MANUFACTURE_DATE = (BatteryConfig::MANUFACTURE_YEAR - 1980) * 512 +
+                                          BatteryConfig::MANUFACTURE_MONTH * 32 +
+                                          BatteryConfig::MANUFACTURE_DAY;
+
         extern void splitNum(uint16_t num, uint8_t* higher, uint8_t* lower);
         extern void splitNum(int32_t num, uint8_t* higher, uint8_t* lower);
-        extern bool needsLength(uint8_t type);
 
-        extern uint8_t calculateCRC(uint8_t* dataArray, uint8_t dataArrayLength, uint8_t command);
-        static void addByteToCRC(bool CRC[8], uint8_t byteToAdd);
+        extern uint8_t calculateCRC(uint8_t* dataArray, uint8_t dataArrayLength, uint8_t command, bool withLength);
 
         // ----
         enum PowerState: uint8_t {
@@ -46,44 +52,166 @@ namespace OpenSmartBattery {
             UnknownError        = 0b0111
         };
 
+        /**
+         * One bit of a 16-bit register word, read and written like a bool. BitFlags share a union with the word
+         * they are a bit of, so each of them is the whole word: setting a flag is one and/or on it, and the word
+         * is always ready to be sent as it is. Only the flag's own bit is ever written, copies included.
+        **/
+        template<uint8_t BIT>
+        struct BitFlag {
+            uint16_t raw;
+
+            static const uint16_t MASK = 1 << BIT;
+
+            constexpr operator bool() const {
+                return raw & MASK;
+            }
+
+            BitFlag &operator=(bool value) {
+                raw = value ? raw | MASK : raw & ~MASK;
+                return *this;
+            }
+
+            BitFlag &operator=(const BitFlag &other) {
+                return *this = (bool)other;
+            }
+        };
+
+        // Flags that comprise the 0x03 BatteryMode() output
         class BatteryMode {
             public:
-                bool internalChargeController;
-                bool primaryBatterySupport;
-                bool conditionFlag;
-                bool chargeControllerEnabled;
-                bool primaryBattery;
-                bool alarmMode;
-                bool chargerMode;
-                bool capacityMode;
-            
-                BatteryMode();
-                void asSplitBytes(uint8_t*, uint8_t*);
+                union {
+                    uint16_t raw;  // As the host reads it from 0x03
+
+                    BitFlag<0>  internalChargeController;  // R/O | Pack has a charger than controls voltage and current (not just a protection circuit!)
+                    BitFlag<1>  primaryBatterySupport;     // R/O | Pack has internal switch for multiple batteries
+
+                    // Bits 2-6 are reserved for future use by the SBS standards committee
+
+                    BitFlag<7>  conditionFlag;             // R/O | Battery requests conditioning cycle
+                    BitFlag<8>  chargeControllerEnabled;   // R/W | If INTERNAL_CHARGE_CONTROLLER is set, enable/disable internal charge controller
+                    BitFlag<9>  primaryBattery;            // R/W | If PRIMARY_BATTERY_SUPPORT is set, select this battery pack as the sole battery in use
+
+                    // Bits 10-12 are reserved for future use by the SBS standards committee
+
+                    BitFlag<13> alarmMode;     // R/W | System is responsible for detecting and responding to alarm events. This is cleared automatically every <=45s by this firmware.
+                    BitFlag<14> chargerMode;   // R/W | System is responding for polling ChargingCurrent() and ChargingVoltage() (auto broadcasting every 5-60s is disabled)
+                    BitFlag<15> capacityMode;  // R/W | Report in mW/10 instead of mA
+                };
+
+                constexpr BatteryMode() :
+                    raw(BatteryConfig::HAS_INTERNAL_CHARGE_CONTROLLER << 0 |
+                         BatteryConfig::HAS_MULTI_BATTERY_SUPPORT << 1 |
+                         BatteryConfig::REQUEST_CONDITIONING_CYCLE << 7) {}
+
+                constexpr BatteryMode(const BatteryMode &other) : raw(other.raw) {}
+
+                BatteryMode &operator=(const BatteryMode &other) {
+                    raw = other.raw;
+                    return *this;
+                }
+
+                constexpr uint16_t asWord() const {
+                    return raw;
+                }
+
+                void asSplitBytes(uint8_t*, uint8_t*) const;
+                void fromWord(uint16_t);
         };
 
+        // Flags that comprise 0x16 BatteryStatus()
         class BatteryStatus {
             public:
+                // Current error code, bits 0-3. Kept out of the word: the SMBus interrupt sets it, while the main
+                // loop writes the flags, and neither may write back a stale copy of the other's bits.
                 AlarmErrorCode errorCode;
-                bool fullyDischarged;
-                bool fullyCharged;
-                bool discharging;
-                bool initialized;
-                bool remainingTimeAlarm;
-                bool remainingCapacityAlarm;
-                bool terminateDischargeAlarm;
-                bool overTempAlarm;
-                bool terminateChargeAlarm;
-                bool overchargedAlarm;
-
-                BatteryStatus();
-                void asSplitBytes(uint8_t*, uint8_t*);
-
-                inline bool canCharge() {
-                    return !(fullyCharged || overTempAlarm || terminateChargeAlarm || overchargedAlarm);
+
+                union {
+                    uint16_t raw;  // Bits 4-15; bits 0-3 are always clear
+
+                    // Status bits
+
+                    // Set: Battery is empty
+                    // Action: Stop discharging
+                    // Cleared: RelativeStateOfCharge() > 20%
+                    BitFlag<4> fullyDischarged;
+
+                    // Set: Battery is full
+                    // Action: Stop charging
+                    // Cleared: Battery is not longer full (this does not request charging on its own)
+                    BitFlag<5> fullyCharged;
+
+                    // Set: Battery is discharging. Note that this can be self-discharge, so it doesn't always mean
+                    //      the battery is delivering power to the system.
+                    // Action: N/A
+                    // Cleared: Battery is being charged
+                    BitFlag<6> discharging;
+
+                    // Set: Our capacity measurements are known to be accurate and can be trusted
+                    // Action: N/A
+                    // Cleared: Capacity measurements are seriously faulty (cannot be trusted)
+                    BitFlag<7> initialized;
+
+                    // Alarm bits
+
+                    // Set: AverageTimeToEmpty() < RemainingTimeAlarm()
+                    // Action: N/A
+                    // Cleared: AverageTimeToEmpty() > RemainingTimeAlarm() or RemainingTimeAlarm() == 0
+                    BitFlag<8> remainingTimeAlarm;
+
+                    // Set: RemainingCapacity() < RemainingCapacityAlarm()
+                    // Action: N/A
+                    // Cleared: RemainingCapacity() > RemainingCapacityAlarm() or RemainingCapacityAlarm() == 0
+                    BitFlag<9> remainingCapacityAlarm;
+
+                    // Bit 10 is reserved
+
+                    // Set: Battery is empty
+                    // Action: Stop discharge as soon as possible
+                    // Cleared: Discharge is no longer detected
+                    BitFlag<11> terminateDischargeAlarm;
+
+                    // Set: Temperature exceeded limit
+                    // Action: Stop charging
+                    // Cleared: Temperature has returned to acceptable level
+                    BitFlag<12> overTempAlarm;
+
+                    // Bit 13 is reserved
+
+                    // Set: Charging needs to be stopped temporarily
+                    // Action: Stop charging
+                    // Cleared: Charging is no longer detected and condition causing alarm has been resolved
+                    BitFlag<14> terminateChargeAlarm;
+
+                    // Set: Battery is fully charged and charging is complete.
+                    // Action: Stop charging
+                    // Cleared: Charging is no longer detected and remaining charge has dropped below full charge
+                    BitFlag<15> overchargedAlarm;
+                };
+
+                // Full and initialized
+                constexpr BatteryStatus() : errorCode(AlarmErrorCode::Ok), raw(1 << 5 | 1 << 7) {}
+
+                constexpr BatteryStatus(const BatteryStatus &other) : errorCode(other.errorCode), raw(other.raw) {}
+
+                BatteryStatus &operator=(const BatteryStatus &other) {
+                    errorCode = other.errorCode;
+                    raw = other.raw;
+                    return *this;
+                }
+
+                constexpr uint16_t asWord() const {
+                    return raw | errorCode;
+                }
+
+                void asSplitBytes(uint8_t*, uint8_t*) const;
+
+                inline bool canCharge() const {
+                    return !(raw & (fullyCharged.MASK | overTempAlarm.MASK | terminateChargeAlarm.MASK | overchargedAlarm.MASK));
                 }
 
-                inline bool canDischarge() {
-                    return !(fullyDischarged || overTempAlarm);  // terminateDischargeAlarm says "as soon as possible" not "immediately"
+                inline bool canDischarge() const {
+                    return !(raw & (fullyDischarged.MASK | overTempAlarm.MASK));  // terminateDischargeAlarm says "as soon as possible" not "immediately"
                 }
         };
     }
@@ -0,0 +1,46 @@
+#include "writes.hpp"
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Writes {
+
+        const uint8_t QUEUE_MASK = QUEUE_SIZE - 1;
+
+        volatile Write QUEUE[QUEUE_SIZE];
+        volatile uint8_t HEAD = 0;  // Written by push(): total writes queued, wraps
+        volatile uint8_t TAIL = 0;  // Written by take(): total writes taken, wraps
+
+        bool push(uint8_t command, uint16_t value)
+        {
+            uint8_t head = HEAD;
+
+            if ((uint8_t)(head - TAIL) == QUEUE_SIZE) {
+                return false;
+            }
+
+            // The slot is complete before head moves past it
+            volatile Write &write = QUEUE[head & QUEUE_MASK];
+            write.command = command;
+            write.value = value;
+            HEAD = head + 1;
+
+            return true;
+        }
+
+        bool take(Write &write)
+        {
+            uint8_t tail = TAIL;
+
+            if (tail == HEAD) {
+                return false;
+            }
+
+            volatile Write &queued = QUEUE[tail & QUEUE_MASK];
+            write.command = queued.command;
+            write.value = queued.value;
+            TAIL = tail + 1;
+
+            return true;
+        }
+    }
+}
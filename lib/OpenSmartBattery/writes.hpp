@@ -0,0 +1,33 @@
+#ifndef SMART_BATTERY_FIRMWARE_WRITES_H
+#define SMART_BATTERY_FIRMWARE_WRITES_H
+
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Writes {
+        /**
+         * Word writes from the host, on their way from the SMBus interrupt to the main loop. The interrupt only
+         * checks a write and pushes it, which takes the same time whatever the command; the main loop takes them
+         * in order and applies them, where nothing it changes can be halfway through an update.
+         *
+         * One producer (the interrupt) and one consumer (the main loop): head is only written by push() and tail
+         * only by take(), both single bytes, so neither side needs to lock the other out.
+        **/
+
+        const uint8_t QUEUE_SIZE = 4;  // A Write Word takes ~0.5ms at 100kHz, the main loop empties it every 1ms
+        static_assert((QUEUE_SIZE & (QUEUE_SIZE - 1)) == 0, "QUEUE_SIZE must be a power of two");
+
+        struct Write {
+            uint8_t command;
+            uint16_t value;
+        };
+
+        // Interrupt only. Returns false if the queue is full; the write is not queued.
+        bool push(uint8_t command, uint16_t value);
+
+        // Main loop only. Take the oldest write not yet taken; returns false if there is none.
+        bool take(Write &write);
+    }
+}
+
+#endif
@@ -1,18 +1,19 @@
 #include "OpenSmartBattery.hpp"
+#include "adc.hpp"
+#include "broadcast.hpp"
+#include "protection.hpp"
+#include "scheduler.hpp"
+#include "smbus.hpp"
 #include "utils.hpp"
 #include "config.hpp"
 
-#include <util/atomic.h>
-#include <util/delay.h>
 #include <Print.h>
-#include <Wire.h>
 #include <Arduino.h>
 
 using namespace OpenSmartBattery;
 
 void setup() {
     // Initialize all the pins; customize these in lib/OpenSmartBattery/config.hpp
-    pinMode(HardwareConfig::Pins::SERIAL_IN,  INPUT);
     pinMode(HardwareConfig::Pins::SERIAL_OUT, OUTPUT);
 
     pinMode(HardwareConfig::Pins::CHARGE_TRANSISTOR, OUTPUT);
@@ -30,9 +31,16 @@ void setup() {
     digitalWrite(HardwareConfig::Pins::CHARGE_TRANSISTOR, LOW);
     digitalWrite(HardwareConfig::Pins::OUTPUT_TRANSISTOR, LOW);
 
-    Wire.begin(0x0B);
-    Wire.onReceive(OpenSmartBattery::receiveEvent);
-    Wire.onRequest(OpenSmartBattery::requestEvent);
+    // Requests must never see an unpublished snapshot
+    OpenSmartBattery::publishTelemetry();
+
+    // Protection before the ADC, whose interrupt hands it every conversion
+    Protection::begin();
+    Analog::begin();
+    Scheduler::begin();
+    Scheduler::schedule(TASKS, TASK_STATES);
+
+    SMBus::begin();
 
     #ifdef DEBUG
         Utils::Serial.begin(115200);
@@ -41,18 +49,6 @@ void setup() {
 }
 
 void loop() {
-    _delay_us(1);
-
-    // These following two blocks MUST BE DONE ATOMICALLY to prevent an interrupt from ruining our day
-
-    // Every 5ms, run internal calculations to determine the current conditions of the battery
-    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
-        OpenSmartBattery::checkValuesAndSetStates();
-        OpenSmartBattery::calculateChargeParameters();
-    }
-
-    // Every 5-60s, report ChargingCurrent and ChargingVoltage
-    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
-        if (OpenSmartBattery::BATTERY_MODE.chargerMode && false) { }
-    }
+    Scheduler::runPending(TASKS, TASK_STATES);
+    Scheduler::sleepUntilTick();
 }
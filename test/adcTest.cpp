@@ -0,0 +1,180 @@
+#include "adc.hpp"
+#include "mockADC.hpp"
+#include "platform.hpp"
+#include "protection.hpp"
+#include "smbus.hpp"
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        void testADC() {
+            MockADC adc;
+            for (uint8_t channel = 0; channel < Analog::COUNT; ++channel) {
+                adc.input((Analog::Channel)channel) = 100 * (channel + 1);
+            }
+
+            DIDR0 = 0;
+            Protection::begin();
+            Analog::begin();
+            assert(ADCSRA & _BV(ADATE));
+
+            // The analog inputs do without their digital input buffers; SCL and SDA keep theirs
+            for (uint8_t channel = 0; channel < Analog::COUNT; ++channel) {
+                assert(DIDR0 & _BV(Analog::inputPin((Analog::Channel)channel)));
+            }
+            assert(!(DIDR0 & (_BV(SMBus::CLOCK_PIN) | _BV(SMBus::DATA_PIN))));
+            assert(ADCSRA & _BV(ADIE));
+            adc.start();
+            assert(!Analog::primed());
+
+            // The cells decimate 64 conversions into a sample, so their rings are the last to fill
+            adc.scan(64 * (Analog::RING_SIZE - 1));
+            assert(!Analog::primed());
+
+            // Every channel ends up with its own samples, despite ADMUX only applying two conversions later
+            adc.scan(64 + 2);
+            assert(Analog::primed());
+
+            for (uint8_t channel = 0; channel < Analog::COUNT; ++channel) {
+                Analog::Channel which = (Analog::Channel)channel;
+                assert(Analog::average(which) == (100 * (channel + 1)) << Analog::oversampleBits(which));
+            }
+
+            // Drain, then every new current sample is taken exactly once
+            static_assert(Analog::oversampleBits(Analog::Current) == 0, "The tests below count raw samples");
+
+            uint16_t sample;
+            while (Analog::take(Analog::Current, sample)) { }
+            uint16_t overruns = Analog::overruns();
+
+            adc.input(Analog::Current) = 512;
+            adc.scan(3);
+
+            uint8_t taken = 0;
+            while (Analog::take(Analog::Current, sample)) {
+                ++taken;
+            }
+            assert(taken == 3);
+            assert(sample == 512);
+            assert(Analog::overruns() == overruns);
+
+            // Falling behind loses the oldest samples and says so
+            adc.scan(Analog::RING_SIZE + 2);
+
+            taken = 0;
+            while (Analog::take(Analog::Current, sample)) {
+                ++taken;
+            }
+            assert(taken == Analog::RING_SIZE);
+            assert(Analog::overruns() == overruns + 2);
+        }
+
+        // RMS error, in 10-bit LSBs, of the samples of a channel over a sweep of one LSB of input
+        static double sweepError(MockADC &adc, Analog::Channel channel, double noise) {
+            const uint8_t STEPS = 16;
+            const uint8_t SAMPLES = 32;
+            uint8_t bits = Analog::oversampleBits(channel);
+            double squares = 0;
+
+            adc.noise = noise;
+
+            for (uint8_t step = 0; step < STEPS; ++step) {
+                double value = 500 + (double)step / STEPS;
+                adc.input(channel) = value;
+
+                // Flush what was converted before the input changed
+                uint16_t sample;
+                adc.scan(1 << (2 * bits));
+                while (Analog::take(channel, sample)) { }
+
+                for (uint8_t taken = 0; taken < SAMPLES; ) {
+                    adc.scan(1 << (2 * bits));
+
+                    while (Analog::take(channel, sample)) {
+                        double error = (double)sample / (1 << bits) - value;
+                        squares += error * error;
+                        ++taken;
+                    }
+                }
+            }
+
+            return sqrt(squares / (STEPS * SAMPLES));
+        }
+
+        void testOversampling() {
+            MockADC adc;
+            Protection::begin();
+            Analog::begin();
+            adc.start();
+
+            // A 10-bit channel resolves a slowly varying input to no better than its quantization, noise or not
+            double raw = sweepError(adc, Analog::Current, 0.7);
+
+            // Decimated channels average the noise away: each bit of oversampling should halve the error
+            double cell = sweepError(adc, Analog::Cell0, 0.7);
+            double pack = sweepError(adc, Analog::Pack, 0.7);
+
+            static_assert(Analog::oversampleBits(Analog::Cell0) == 3, "The gains below assume 13-bit cells");
+            static_assert(Analog::oversampleBits(Analog::Pack) == 2, "The gains below assume 12-bit pack voltage");
+
+            printf("Oversampling with 0.7 LSB noise, RMS error (LSB): 10 bit %.3f, pack %.3f, cells %.3f\n",
+                   raw, pack, cell);
+
+            assert(log2(raw / pack) >= 1.5);
+            assert(log2(raw / cell) >= 2.5);
+
+            // Without noise to dither it, oversampling can't see between codes: no gain
+            double quiet = sweepError(adc, Analog::Cell0, 0);
+            assert(quiet > 0.25);
+
+            // Decimated samples still span the whole range
+            adc.noise = 0;
+            adc.input(Analog::Cell1) = 1023;
+            adc.scan(64 * (Analog::RING_SIZE + 1));
+            assert(Analog::average(Analog::Cell1) == Analog::fullScale(Analog::Cell1));
+        }
+
+        void benchmarkADC() {
+            const uint32_t CONVERSIONS = 5000000;
+            MockADC adc;
+            for (uint8_t channel = 0; channel < 8; ++channel) {
+                adc.values[channel] = 300 + channel;
+            }
+
+            Protection::begin();
+            Analog::begin();
+            adc.start();
+
+            // Precompute the inputs, the mock's noise generator would dominate otherwise
+            uint16_t inputs[256];
+            for (uint16_t i = 0; i < 256; ++i) {
+                inputs[i] = 300 + (i * 7) % 5;
+            }
+
+            volatile uint32_t sink = 0;
+            uint16_t sample;
+            clock_t start = clock();
+
+            for (uint32_t i = 0; i < CONVERSIONS; ++i) {
+                ADC = inputs[i & 0xff];
+                Analog::onConversionComplete();
+
+                // Consume the current channel sample by sample, like the coulomb counter will
+                if (Analog::take(Analog::Current, sample)) {
+                    sink = sink + sample;
+                }
+            }
+
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            (void)sink;
+
+            printf("ADC pipeline: %.1f M conversions/s through ISR and consumer (hardware limit ~0.0096 M/s)\n",
+                   CONVERSIONS / seconds / 1e6);
+        }
+    }
+}
@@ -0,0 +1,245 @@
+#include "OpenSmartBattery.hpp"
+#include "platform.hpp"
+#include "authentication.hpp"
+#include "config.hpp"
+#include "mockUSI.hpp"
+#include "pec.hpp"
+#include "smbus.hpp"
+#include "utils.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+        using AuthenticationScheme = BatteryConfig::AuthenticationScheme;
+
+        // The other schemes, as config.hpp would pick them
+        constexpr uint8_t UNLOCK_CODE[] PROGMEM = { 0x4c, 0x45, 0x4e, 0x4f, 0x56, 0x4f };
+        constexpr uint8_t KEY_20[] PROGMEM = {
+            0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c,
+            0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c
+        };
+
+        template<typename Scheme>
+        static void respond(uint8_t *buffer) {
+            for (uint8_t step = 0; step < Scheme::STEPS; ++step) {
+                Scheme::step(step, buffer);
+            }
+        }
+
+        // Block Write of a challenge to 0x2f, with its PEC
+        static void writeChallenge(MockUSI &usi, const uint8_t *challenge) {
+            uint8_t crc = PEC::update(PEC::update(PEC::update(0, PEC::ADDRESS_WRITE), 0x2f),
+                                      Authentication::CHALLENGE_SIZE);
+
+            usi.start();
+            assert(usi.send(PEC::ADDRESS_WRITE));
+            assert(usi.send(0x2f));
+            assert(usi.send(Authentication::CHALLENGE_SIZE));
+
+            for (uint8_t x = 0; x < Authentication::CHALLENGE_SIZE; ++x) {
+                assert(usi.send(challenge[x]));
+                crc = PEC::update(crc, challenge[x]);
+            }
+
+            assert(usi.send(crc));
+            usi.stop();
+            SMBus::poll();
+        }
+
+        // Block Read of 0x2f: length, response, PEC. Returns whether it was answered with a valid PEC.
+        static bool readResponse(MockUSI &usi, uint8_t *bytes) {
+            const uint8_t length = AuthenticationScheme::RESPONSE_SIZE + 2;
+
+            usi.start();
+            assert(usi.send(PEC::ADDRESS_WRITE));
+            assert(usi.send(0x2f));
+            usi.start();
+            assert(usi.send(PEC::ADDRESS_READ));
+
+            for (uint8_t x = 0; x < length; ++x) {
+                bytes[x] = usi.receive(x < length - 1);
+            }
+            usi.stop();
+
+            uint8_t crc = PEC::seed(0x2f);
+            for (uint8_t x = 0; x < length - 1; ++x) {
+                crc = PEC::update(crc, bytes[x]);
+            }
+
+            return bytes[0] == AuthenticationScheme::RESPONSE_SIZE && crc == bytes[length - 1];
+        }
+
+        // HMAC-SHA1 under AUTH_KEY, from Python's hmac module; what cryptosuite2 answered before the midstates
+        struct Vector {
+            uint8_t challenge[Authentication::CHALLENGE_SIZE];
+            uint8_t response[AuthenticationScheme::RESPONSE_SIZE];
+        };
+
+        static const Vector VECTORS[] = {
+            {
+                { 0 },
+                { 0x8f, 0xaa, 0xcf, 0x84, 0x1c, 0xd7, 0x41, 0x8d, 0x7f, 0x2e,
+                  0xe1, 0x96, 0xeb, 0x19, 0x93, 0x23, 0x8e, 0x49, 0x2e, 0x58 }
+            },
+            {
+                { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+                  0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13 },
+                { 0x4b, 0xf5, 0x7c, 0xe2, 0x69, 0xe3, 0xf0, 0x11, 0xdf, 0x03,
+                  0xc3, 0xc0, 0xab, 0x2a, 0xc0, 0xd1, 0x9e, 0x1e, 0x5c, 0xae }
+            },
+            {
+                { 0xc3, 0x5a, 0x01, 0x99, 0x42, 0x10, 0xfe, 0x77, 0x38, 0x2b,
+                  0x65, 0xd0, 0x0e, 0x81, 0x1f, 0xa4, 0x5c, 0x93, 0x6e, 0x27 },
+                { 0xab, 0xa8, 0xef, 0x13, 0x66, 0x1a, 0x76, 0x4b, 0xee, 0x68,
+                  0x6e, 0x7e, 0x55, 0xfb, 0xb8, 0x5f, 0x4b, 0x8d, 0xf2, 0x02 }
+            }
+        };
+
+        void testAuthentication() {
+            using Utils::AlarmErrorCode;
+
+            MockUSI usi;
+            SMBus::begin();
+
+            const uint8_t challenge[Authentication::CHALLENGE_SIZE] = {
+                0xc3, 0x5a, 0x01, 0x99, 0x42, 0x10, 0xfe, 0x77, 0x38, 0x2b,
+                0x65, 0xd0, 0x0e, 0x81, 0x1f, 0xa4, 0x5c, 0x93, 0x6e, 0x27
+            };
+            uint8_t reply[AuthenticationScheme::RESPONSE_SIZE + 2];
+            uint8_t first[AuthenticationScheme::RESPONSE_SIZE + 2];
+
+            // Reads are refused with Busy until the main loop has been through every step
+            writeChallenge(usi, challenge);
+            assert(BATTERY_STATUS.errorCode == AlarmErrorCode::Ok);
+
+            for (uint8_t step = 0; step < AuthenticationScheme::STEPS; ++step) {
+                assert(!readResponse(usi, reply));
+                assert(reply[0] == 0xff);
+                assert(BATTERY_STATUS.errorCode == AlarmErrorCode::Busy);
+
+                // A new challenge can't be taken in the middle
+                writeChallenge(usi, challenge);
+                assert(BATTERY_STATUS.errorCode == AlarmErrorCode::Busy);
+
+                stepAuthentication();
+            }
+
+            assert(readResponse(usi, first));
+            assert(BATTERY_STATUS.errorCode == AlarmErrorCode::Ok);
+
+            // Nothing left to do; the response is read as often as the host likes
+            stepAuthentication();
+            assert(readResponse(usi, reply));
+            assert(memcmp(reply, first, sizeof(reply)) == 0);
+
+            // The next challenge starts over
+            writeChallenge(usi, challenge);
+            assert(BATTERY_STATUS.errorCode == AlarmErrorCode::Ok);
+            assert(!readResponse(usi, reply));
+
+            for (uint8_t step = 0; step < AuthenticationScheme::STEPS; ++step) {
+                stepAuthentication();
+            }
+
+            // The response is the HMAC of the challenge, over the bus
+            for (const Vector &vector : VECTORS) {
+                writeChallenge(usi, vector.challenge);
+
+                for (uint8_t step = 0; step < AuthenticationScheme::STEPS; ++step) {
+                    stepAuthentication();
+                }
+
+                assert(readResponse(usi, reply));
+                assert(memcmp(reply + 1, vector.response, AuthenticationScheme::RESPONSE_SIZE) == 0);
+            }
+        }
+
+        void testAuthenticationSchemes() {
+            uint8_t buffer[Authentication::CHALLENGE_SIZE];
+
+            // The unlock code, whatever the challenge
+            using Unlock = Authentication::UnlockCode<UNLOCK_CODE>;
+            static_assert(Unlock::RESPONSE_SIZE == sizeof(UNLOCK_CODE) && Unlock::STEPS == 1, "");
+
+            const uint8_t fills[] = { 0x00, 0xa5 };
+            for (uint8_t fill : fills) {
+                memset(buffer, fill, sizeof(buffer));
+                respond<Unlock>(buffer);
+                assert(memcmp(buffer, UNLOCK_CODE, sizeof(UNLOCK_CODE)) == 0);
+            }
+
+            // A 20 byte key: RFC 2202 test case 5, whose message happens to be 20 bytes
+            using Hmac20 = Authentication::HmacSha1<KEY_20>;
+            const uint8_t expected[] = {
+                0x4c, 0x1a, 0x03, 0x42, 0x4b, 0x55, 0xe0, 0x7f, 0xe7, 0xf2,
+                0x7b, 0xe1, 0xd5, 0x8b, 0xb9, 0x32, 0x4a, 0x9a, 0x5a, 0x04
+            };
+
+            memcpy(buffer, "Test With Truncation", sizeof(buffer));
+            respond<Hmac20>(buffer);
+            assert(memcmp(buffer, expected, sizeof(expected)) == 0);
+
+            // Passthrough leaves the challenge alone
+            memcpy(buffer, "Test With Truncation", sizeof(buffer));
+            respond<Authentication::Passthrough>(buffer);
+            assert(memcmp(buffer, "Test With Truncation", sizeof(buffer)) == 0);
+
+            // Without DEBUG, as here, the key can't be read back
+            static_assert(!BatteryConfig::AUTH_KEY_READBACK, "The host tests build without DEBUG");
+            for (uint8_t command = 0x63; command <= 0x66; ++command) {
+                receiveEvent(&command, 1);
+                requestEvent();
+                assert(BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::UnsupportedCommand);
+            }
+        }
+
+        // What the host sees: a host that writes a challenge and then polls 0x2f once a tick, against the main
+        // loop stepping once a tick. Before, the response was computed in full in the read's address interrupt,
+        // with SCL held throughout.
+        void benchmarkAuthentication() {
+            MockUSI usi;
+            SMBus::begin();
+
+            const uint8_t challenge[Authentication::CHALLENGE_SIZE] = { 0 };
+            uint8_t reply[AuthenticationScheme::RESPONSE_SIZE + 2];
+
+            while (!readResponse(usi, reply)) {
+                stepAuthentication();
+            }
+
+            writeChallenge(usi, challenge);
+
+            uint32_t interrupts = usi.interrupts;
+            uint8_t polls = 1;
+
+            while (!readResponse(usi, reply)) {
+                stepAuthentication();
+                ++polls;
+            }
+
+            const uint32_t ITERATIONS = 200000;
+            uint8_t buffer[SHA1::DIGEST_SIZE] = { 0 };
+            clock_t start = clock();
+
+            for (uint32_t x = 0; x < ITERATIONS; ++x) {
+                for (uint8_t step = 0; step < AuthenticationScheme::STEPS; ++step) {
+                    AuthenticationScheme::step(step, buffer);
+                }
+            }
+
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            // Flash data each scheme adds; the key itself only with AUTH_KEY_READBACK, which reads it back
+            using Hmac = Authentication::HmacSha1<BatteryConfig::AUTH_KEY>;
+            printf("Authentication schemes (flash data, bytes): UnlockCode %u, HmacSha1 %u, Passthrough 0\n",
+                   (unsigned)sizeof(UNLOCK_CODE), (unsigned)(sizeof(Hmac::INNER_MIDSTATE) + sizeof(Hmac::OUTER_MIDSTATE)));
+            printf("Authentication: answered on poll %u, a tick apart; %u interrupts per poll, none of them hashing "
+                   "(before: first poll, with 4 SHA-1 compressions in its address interrupt); %u steps, "
+                   "%.1f ns per response\n", polls, (unsigned)((usi.interrupts - interrupts) / polls),
+                   AuthenticationScheme::STEPS, seconds * 1e9 / ITERATIONS);
+        }
+    }
+}
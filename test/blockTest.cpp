@@ -0,0 +1,280 @@
+#include "OpenSmartBattery.hpp"
+#include "platform.hpp"
+#include "authentication.hpp"
+#include "config.hpp"
+#include "block.hpp"
+#include "commands.hpp"
+#include "mockUSI.hpp"
+#include "pec.hpp"
+#include "smbus.hpp"
+#include "utils.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+        using AuthenticationScheme = BatteryConfig::AuthenticationScheme;
+
+        // Write of `count` bytes (command byte included), ended with a STOP; returns how many were ACKed
+        static uint8_t write(MockUSI &usi, const uint8_t *bytes, uint8_t count) {
+            uint8_t acked = 0;
+
+            usi.start();
+            assert(usi.send(PEC::ADDRESS_WRITE));
+
+            for (uint8_t x = 0; x < count; ++x) {
+                acked += usi.send(bytes[x]);
+            }
+
+            usi.stop();
+            SMBus::poll();
+
+            return acked;
+        }
+
+        // Read of `length` bytes after a repeated start, without writing the command first when `command` is
+        // negative (the host picks up where the last write left it)
+        static void read(MockUSI &usi, int command, uint8_t *bytes, uint8_t length) {
+            usi.start();
+
+            if (command >= 0) {
+                assert(usi.send(PEC::ADDRESS_WRITE));
+                assert(usi.send(command));
+                usi.start();
+            }
+
+            assert(usi.send(PEC::ADDRESS_READ));
+
+            for (uint8_t x = 0; x < length; ++x) {
+                bytes[x] = usi.receive(x < length - 1);
+            }
+
+            usi.stop();
+        }
+
+        // Block write of `length` bytes of `data`, with its PEC, as the host would send it
+        static uint8_t blockWrite(uint8_t *frame, uint8_t command, const uint8_t *data, uint8_t length) {
+            frame[0] = command;
+            frame[1] = length;
+            memcpy(frame + 2, data, length);
+
+            uint8_t crc = PEC::update(0, PEC::ADDRESS_WRITE);
+            for (uint8_t x = 0; x < length + 2; ++x) {
+                crc = PEC::update(crc, frame[x]);
+            }
+            frame[length + 2] = crc;
+
+            return length + 3;
+        }
+
+        // The main loop works the response to a challenge out
+        static void authenticate() {
+            for (uint8_t x = 0; x < AuthenticationScheme::STEPS; ++x) {
+                stepAuthentication();
+            }
+        }
+
+        static bool validReply(uint8_t command, const uint8_t *bytes, uint8_t length) {
+            uint8_t crc = PEC::update(PEC::update(PEC::update(0, PEC::ADDRESS_WRITE), command), PEC::ADDRESS_READ);
+
+            for (uint8_t x = 0; x < length; ++x) {
+                crc = PEC::update(crc, bytes[x]);
+            }
+
+            return crc == bytes[length];
+        }
+
+        void testBlockTransfer() {
+            using Utils::AlarmErrorCode;
+
+            // Sizes against the command: words with and without the PEC, blocks against their length byte.
+            // A PEC, when there is one, has to match.
+            {
+                uint8_t data[Block::MAX_LENGTH] = { 0 };
+                uint8_t bytes[Block::ARENA_SIZE + 1];
+
+                const uint8_t word[] = { 0x01, 0x34, 0x12, PEC::update(PEC::update(PEC::update(
+                                         PEC::update(0, PEC::ADDRESS_WRITE), 0x01), 0x34), 0x12) };
+                assert(Block::checkWrite(word, 3, false) == AlarmErrorCode::Ok);
+                assert(Block::checkWrite(word, 4, false) == AlarmErrorCode::Ok);
+                assert(Block::checkWrite(word, 2, false) == AlarmErrorCode::BadSize);
+
+                memcpy(bytes, word, sizeof(word));
+                bytes[3] ^= 0x01;
+                assert(Block::checkWrite(bytes, 4, false) == AlarmErrorCode::UnknownError);
+                assert(Block::checkWrite(bytes, 5, false) == AlarmErrorCode::BadSize);
+
+                uint8_t count = blockWrite(bytes, 0x2f, data, 20);
+                assert(Block::checkWrite(bytes, count - 1, true) == AlarmErrorCode::Ok);
+                assert(Block::checkWrite(bytes, count, true) == AlarmErrorCode::Ok);
+                assert(Block::checkWrite(bytes, count - 2, true) == AlarmErrorCode::BadSize);
+                assert(Block::checkWrite(bytes, count + 1, true) == AlarmErrorCode::BadSize);
+                assert(Block::checkWrite(bytes, 1, true) == AlarmErrorCode::BadSize);
+
+                bytes[5] ^= 0x80;
+                assert(Block::checkWrite(bytes, count, true) == AlarmErrorCode::UnknownError);
+
+                count = blockWrite(bytes, 0x2f, data, Block::MAX_LENGTH);
+                assert(count == Block::ARENA_SIZE);
+                assert(Block::checkWrite(bytes, count, true) == AlarmErrorCode::Ok);
+                assert(Block::checkWrite(bytes, count + 1, true) == AlarmErrorCode::OverflowUnderflow);
+
+                bytes[1] = Block::MAX_LENGTH + 1;
+                assert(Block::checkWrite(bytes, count, true) == AlarmErrorCode::OverflowUnderflow);
+            }
+
+            MockUSI usi;
+            SMBus::begin();
+
+            const uint8_t challenge[20] = {
+                0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xf0, 0x0f, 0x1e,
+                0x2d, 0x3c, 0x4b, 0x5a, 0x69, 0x78, 0x87, 0x96, 0xa5, 0xb4
+            };
+            uint8_t frame[Block::ARENA_SIZE];
+            uint8_t reply[Block::ARENA_SIZE];
+
+            // The challenge outlives its transaction: written with a STOP, and answered in a later one after
+            // another read has been through the arena
+            {
+                uint8_t count = blockWrite(frame, 0x2f, challenge, sizeof(challenge));
+                assert(write(usi, frame, count) == count);
+                assert(BATTERY_STATUS.errorCode == AlarmErrorCode::Ok);
+
+                read(usi, 0x09, reply, 3);
+                authenticate();
+
+                read(usi, 0x2f, reply, Block::MAX_LENGTH + 2);
+                assert(reply[0] == AuthenticationScheme::RESPONSE_SIZE && validReply(0x2f, reply, reply[0] + 1));
+            }
+
+            // Block write-block read process call: the write is handed over on the repeated start, before the
+            // read that answers it. The response isn't ready by then; the host reads nothing it would take.
+            {
+                uint8_t count = blockWrite(frame, 0x2f, challenge, sizeof(challenge));
+
+                usi.start();
+                assert(usi.send(PEC::ADDRESS_WRITE));
+                for (uint8_t x = 0; x < count - 1; ++x) {
+                    assert(usi.send(frame[x]));
+                }
+                read(usi, -1, reply, Block::MAX_LENGTH + 2);
+
+                assert(BATTERY_STATUS.errorCode == AlarmErrorCode::Busy);
+                assert(reply[0] == 0xff && reply[1] == 0xff);
+
+                authenticate();
+                read(usi, 0x2f, reply, Block::MAX_LENGTH + 2);
+                assert(BATTERY_STATUS.errorCode == AlarmErrorCode::Ok);
+                assert(reply[0] == AuthenticationScheme::RESPONSE_SIZE && validReply(0x2f, reply, reply[0] + 1));
+            }
+
+            // A challenge of any other size is refused
+            {
+                uint8_t count = blockWrite(frame, 0x2f, challenge, 16);
+                write(usi, frame, count);
+                assert(BATTERY_STATUS.errorCode == AlarmErrorCode::BadSize);
+            }
+        }
+
+        // Random writes and reads of random lengths, through the driver and straight into the firmware. The
+        // sanitizers catch anything read or written outside the arena; replies always carry a valid PEC.
+        void testBlockTransferFuzz() {
+            const uint32_t ROUNDS = 20000;
+            const uint8_t LONGEST = Block::ARENA_SIZE + 5;
+
+            MockUSI usi;
+            SMBus::begin();
+            srand(18);
+
+            uint8_t bytes[LONGEST];
+            uint8_t reply[LONGEST];
+
+            for (uint32_t round = 0; round < ROUNDS; ++round) {
+                uint8_t count = rand() % (LONGEST + 1);
+                for (uint8_t x = 0; x < count; ++x) {
+                    bytes[x] = rand();
+                }
+
+                // Biased towards commands that exist
+                uint8_t command = rand() % 2 ? rand() % (Commands::LAST_COMMAND + 1) : rand();
+                if (count > 0) {
+                    bytes[0] = command;
+                }
+
+                uint8_t acked = write(usi, bytes, count);
+                applyWrites();
+                stepAuthentication();
+                assert(acked == (count < SMBus::BUFFER_SIZE ? count : SMBus::BUFFER_SIZE));
+
+                // The command decides first, then the size
+                uint8_t flags = Commands::flags(command);
+                if (count > 1 && !Commands::isSupported(flags)) {
+                    assert(BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::UnsupportedCommand ||
+                           BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::ReservedCommand);
+
+                } else if (count > 1 && !(flags & Commands::WRITE)) {
+                    assert(BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::AccessDenied);
+
+                } else if (count > SMBus::BUFFER_SIZE) {
+                    assert(BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::OverflowUnderflow);
+                }
+                assert(BATTERY_STATUS.errorCode <= Utils::AlarmErrorCode::UnknownError);
+
+                // Any number of bytes; the PEC is checked whenever all of the reply was read
+                uint8_t length = 1 + rand() % LONGEST;
+                read(usi, command, reply, length);
+
+                // Refused: nothing was sent
+                if (BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::Busy) {
+                    assert(command == 0x2f && reply[0] == 0xff);
+
+                } else if (flags & Commands::READ) {
+                    uint8_t size = (flags & Commands::BLOCK) ? reply[0] + 1 : 2;
+
+                    assert(size <= Block::MAX_LENGTH + 1);
+                    if (length > size) {
+                        assert(validReply(command, reply, size));
+                    }
+                }
+
+                // Straight in, with nothing past the count to read
+                uint8_t direct = rand() % (Block::ARENA_SIZE + 2);
+                uint8_t held = direct < Block::ARENA_SIZE ? direct : Block::ARENA_SIZE;
+                uint8_t *copy = new uint8_t[held];
+                for (uint8_t x = 0; x < held; ++x) {
+                    copy[x] = rand();
+                }
+
+                receiveEvent(copy, direct);
+                delete[] copy;
+
+                requestEvent();
+            }
+        }
+
+        void benchmarkBlockTransfer() {
+            const uint32_t TRANSACTIONS = 200000;
+            MockUSI usi;
+            SMBus::begin();
+
+            uint8_t challenge[20] = { 0 };
+            uint8_t frame[Block::ARENA_SIZE];
+            uint8_t count = blockWrite(frame, 0x2f, challenge, sizeof(challenge));
+
+            clock_t start = clock();
+
+            for (uint32_t x = 0; x < TRANSACTIONS; ++x) {
+                write(usi, frame, count);
+                authenticate();
+            }
+
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            printf("Block Write of a 20 byte challenge: %.1f ns per transaction with the mock; arena %u bytes\n",
+                   seconds * 1e9 / TRANSACTIONS, (unsigned)sizeof(Block::ARENA));
+        }
+    }
+}
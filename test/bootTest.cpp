@@ -0,0 +1,68 @@
+#include "OpenSmartBattery.hpp"
+#include "adc.hpp"
+#include "config.hpp"
+#include "mockADC.hpp"
+#include "ocv.hpp"
+#include "platform.hpp"
+#include "protection.hpp"
+#include "registers.hpp"
+#include "scheduler.hpp"
+#include <assert.h>
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        /**
+         * Power on with the firmware's own task table: the same begin() calls as setup(), then the main loop with
+         * the free-running ADC converting in the background, ~1.5 scans per tick. Nothing may act on the empty
+         * rings of the first few hundred ms.
+        **/
+        void testBoot() {
+            const double LSB = HardwareConfig::ADC_REFERENCE_MILLIVOLTS / 1024.0;
+            const uint16_t CELL = 3900;
+
+            MockADC adc;
+            adc.input(Analog::Current) = HardwareConfig::CURRENT_ZERO_CODE;
+            adc.input(Analog::Cell0) = CELL / LSB / HardwareConfig::Dividers::CELL_0_VOLTAGE;
+            adc.input(Analog::Cell1) = 2 * CELL / LSB / HardwareConfig::Dividers::CELL_1_VOLTAGE;
+            adc.input(Analog::Cell2) = 3 * CELL / LSB / HardwareConfig::Dividers::CELL_2_VOLTAGE;
+            adc.input(Analog::Pack) = 3 * CELL / LSB / HardwareConfig::Dividers::PACK_VOLTAGE;
+            adc.input(Analog::Temperature) = 512;  // 25C
+
+            publishTelemetry();
+            Protection::begin();
+            Analog::begin();
+            adc.start();
+            Scheduler::schedule(TASKS, TASK_STATES);
+
+            // Run on the first tick anyway, as every task used to be, the correction waits for real cell voltages
+            // instead of using up the power-on rest on the empty rings
+            measure();
+            correctStateOfCharge();
+            publishTelemetry();
+            assert(TELEMETRY.maxError == 100);
+
+            for (uint16_t tick = 0; tick < 2500; ++tick) {
+                adc.scan(1 + (tick & 1));
+                Scheduler::tick();
+                Scheduler::runPending(TASKS, TASK_STATES);
+
+                assert(!BATTERY_STATUS.overTempAlarm);
+                assert(Protection::faults() == 0);
+            }
+
+            // The first correction, a second in, used the rested OCV of real cells
+            const Telemetry &telemetry = TELEMETRY;
+            uint16_t soc = OCV::stateOfCharge(CELL, telemetry.temperature, OCV::Unknown) / 100;
+            assert(telemetry.cellVoltage[0] > CELL - 10 && telemetry.cellVoltage[2] < CELL + 10);
+            uint16_t relative = REGISTERS.get(Registers::RelativeStateOfCharge);
+            assert(relative + 2 >= soc && relative <= soc + 2);
+            assert(telemetry.maxError == OCV::MAX_ERROR);
+
+            for (uint8_t task = 0; task < TASK_COUNT; ++task) {
+                assert(TASK_STATES[task].overruns == 0);
+            }
+        }
+    }
+}
@@ -0,0 +1,353 @@
+#include "broadcast.hpp"
+#include "pec.hpp"
+#include "scheduler.hpp"
+#include "utils.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        /**
+         * SMBus with the battery and one other master on it, one byte time per tick. The other master plays the
+         * host reading from the battery and the charger reporting to the host; it wants the bus at random
+         * times and starts as soon as the bus is free, so it often starts on the very same tick as the battery.
+         * Simultaneous starts are settled by arbitration: both send until their bits differ, and the one sending
+         * a 1 where the other sends a 0 loses, so the lower frame wins.
+        **/
+        class BusSimulator {
+            public:
+                // The battery as master
+                const uint8_t *frame = nullptr;
+                uint8_t length = 0;
+                uint8_t position = 0;
+                bool transmitting = false;
+                bool starting = false;
+                Broadcast::Outcome outcome = Broadcast::Pending;
+
+                // The other master
+                uint8_t other[6];
+                uint8_t otherLength = 0;
+                uint8_t otherPosition = 0;
+                bool otherWaiting = false;
+                bool otherTransmitting = false;
+
+                bool chargerPresent = true;
+                uint16_t contention = 0;  // Chance per tick, in 1/65536, that the other master wants the bus
+
+                // What happened
+                uint32_t delivered[2][0x20] = {};  // Frames received by the host and the charger, by command
+                uint16_t lastValue[2][0x20] = {};
+                uint32_t slaveRequests = 0;        // Host reads from the battery started
+                uint32_t slaveServed = 0;          // ... and completed
+                uint32_t collisions = 0;
+                uint32_t lost = 0;
+
+                bool busy() const {
+                    return transmitting || otherTransmitting;
+                }
+
+                // Start of a tick: the other master may want the bus, and takes it if it's free
+                void beginTick() {
+                    if (!otherWaiting && !otherTransmitting && (uint16_t)rand() < contention) {
+                        otherWaiting = true;
+
+                        if (rand() & 1) {
+                            // Host reads a word from the battery: write address, command, read address, 2 bytes, PEC
+                            const uint8_t read[] = { PEC::ADDRESS_WRITE, 0x0d, PEC::ADDRESS_READ, 0x50, 0x00, 0x00 };
+                            memcpy(other, read, sizeof(read));
+                            otherLength = sizeof(read);
+                        } else {
+                            // Charger tells the host its status
+                            const uint8_t status[] = { Broadcast::HOST << 1, 0x13, 0x00, 0x00, 0x00 };
+                            memcpy(other, status, sizeof(status));
+                            otherLength = sizeof(status);
+                        }
+                    }
+
+                    otherStarting = otherWaiting && !busy();
+                }
+
+                // End of a tick: settle arbitration, then one byte goes by on the bus
+                void endTick() {
+                    if (otherStarting && starting) {
+                        ++collisions;
+                        arbitrate();
+
+                    } else if (otherStarting) {
+                        startOther();
+
+                    } else if (starting) {
+                        transmitting = true;
+                    }
+
+                    starting = false;
+                    otherStarting = false;
+
+                    if (transmitting && ++position == length) {
+                        transmitting = false;
+                        deliver();
+                    }
+
+                    if (otherTransmitting && ++otherPosition == otherLength) {
+                        otherTransmitting = false;
+                        slaveServed += other[0] == PEC::ADDRESS_WRITE;
+                    }
+                }
+
+                void start(const uint8_t *bytes, uint8_t size) {
+                    // A START in the middle of someone else's transaction would corrupt it
+                    assert(!busy());
+                    assert(!starting && outcome == Broadcast::Pending);
+
+                    frame = bytes;
+                    length = size;
+                    position = 0;
+                    starting = true;
+                }
+
+                Broadcast::Outcome poll() {
+                    Broadcast::Outcome result = outcome;
+                    if (result != Broadcast::Pending) {
+                        outcome = Broadcast::Pending;
+                    }
+                    return result;
+                }
+
+            private:
+                bool otherStarting = false;
+
+                void startOther() {
+                    otherWaiting = false;
+                    otherTransmitting = true;
+                    otherPosition = 0;
+                    slaveRequests += other[0] == PEC::ADDRESS_WRITE;
+                }
+
+                void arbitrate() {
+                    for (uint8_t x = 0; x < length && x < otherLength; ++x) {
+                        if (frame[x] != other[x]) {
+                            if (frame[x] < other[x]) {
+                                transmitting = true;  // The other master backs off and waits for the bus
+                            } else {
+                                ++lost;
+                                outcome = Broadcast::Lost;
+                                startOther();
+                            }
+                            return;
+                        }
+                    }
+
+                    assert(false);  // Two identical frames can't both be sent
+                }
+
+                void deliver() {
+                    uint8_t address = frame[0] >> 1;
+                    uint8_t crc = 0;
+
+                    for (uint8_t x = 0; x < length - 1; ++x) {
+                        crc = PEC::update(crc, frame[x]);
+                    }
+                    assert(crc == frame[length - 1]);
+                    assert(frame[1] < 0x20);
+
+                    if (address == Broadcast::CHARGER && !chargerPresent) {
+                        outcome = Broadcast::Nack;
+                        return;
+                    }
+
+                    uint8_t device = address == Broadcast::HOST ? 0 : 1;
+                    ++delivered[device][frame[1]];
+                    lastValue[device][frame[1]] = frame[2] | frame[3] << 8;
+                    outcome = Broadcast::Sent;
+                }
+        };
+
+        BusSimulator *BUS = nullptr;  // Only while a test runs the bus; otherwise nothing is ever sent
+
+        // Run the bus and the transmitter for a number of ticks
+        static void runBus(BusSimulator &bus, uint32_t ticks) {
+            BUS = &bus;
+
+            for (uint32_t tick = 0; tick < ticks; ++tick) {
+                bus.beginTick();
+                Broadcast::poll();
+                bus.endTick();
+                Scheduler::tick();
+            }
+
+            BUS = nullptr;
+        }
+
+        void testBroadcast() {
+            srand(16);
+            Utils::BatteryMode mode;
+            Utils::BatteryStatus status;
+
+            // A quiet bus: both parameters reach the charger in one go
+            {
+                BusSimulator bus;
+                Broadcast::clear();
+                Broadcast::chargingParameters(mode, 4167, 12600);
+                assert(Broadcast::pending() == 2);
+
+                runBus(bus, 20);
+                assert(Broadcast::pending() == 0);
+                assert(bus.delivered[1][0x14] == 1 && bus.lastValue[1][0x14] == 4167);
+                assert(bus.delivered[1][0x15] == 1 && bus.lastValue[1][0x15] == 12600);
+            }
+
+            // The host polls them itself: nothing is broadcast
+            {
+                Broadcast::clear();
+                mode.chargerMode = true;
+                Broadcast::chargingParameters(mode, 4167, 12600);
+                assert(Broadcast::pending() == 0);
+                mode.chargerMode = false;
+            }
+
+            // A newer value for a queued message replaces it instead of queueing behind it
+            {
+                BusSimulator bus;
+                Broadcast::clear();
+                Broadcast::chargingParameters(mode, 4167, 12600);
+                Broadcast::chargingParameters(mode, 2000, 12300);
+                assert(Broadcast::pending() == 2);
+
+                runBus(bus, 20);
+                assert(bus.delivered[1][0x14] == 1 && bus.lastValue[1][0x14] == 2000);
+            }
+
+            // No charger: given up on, not retried forever
+            {
+                BusSimulator bus;
+                bus.chargerPresent = false;
+                Broadcast::clear();
+                uint16_t dropped = Broadcast::dropped();
+
+                Broadcast::chargingParameters(mode, 4167, 12600);
+                runBus(bus, 20);
+                assert(Broadcast::pending() == 0);
+                assert(Broadcast::dropped() == dropped + 2);
+            }
+
+            // Heavy contention, with a broadcast every 100ms: every host request is served, no START lands in
+            // another transaction (BusSimulator::start asserts), and every broadcast gets through in the end
+            {
+                BusSimulator bus;
+                bus.contention = 65536 / 4;
+                Broadcast::clear();
+                uint16_t dropped = Broadcast::dropped();
+                const uint16_t ROUNDS = 500;
+
+                for (uint16_t round = 0; round < ROUNDS; ++round) {
+                    Broadcast::chargingParameters(mode, round, 12600);
+                    runBus(bus, 100);
+                }
+                runBus(bus, 1000);
+
+                // The other master always finishes what it starts
+                bus.contention = 0;
+                runBus(bus, 10);
+
+                printf("Broadcast under contention: %u/%u rounds delivered, %u collisions (%u lost), "
+                       "%u/%u host reads served\n",
+                       bus.delivered[1][0x14], ROUNDS, bus.collisions, bus.lost, bus.slaveServed, bus.slaveRequests);
+
+                assert(bus.lost > 0);
+                assert(Broadcast::dropped() == dropped);
+                assert(bus.delivered[1][0x14] == ROUNDS && bus.delivered[1][0x15] == ROUNDS);
+                assert(bus.lastValue[1][0x14] == ROUNDS - 1);
+                assert(bus.slaveServed == bus.slaveRequests && bus.slaveRequests > 1000);
+            }
+
+            // AlarmWarning: at once to both, then every 10s while the alarm lasts, with a new alarm jumping
+            // the queue only once a second has passed since the last one
+            {
+                BusSimulator bus;
+                Broadcast::clear();
+
+                status.overTempAlarm = true;
+                for (uint16_t tick = 0; tick < 25000; ++tick) {
+                    if (tick == 12500) {
+                        status.terminateChargeAlarm = true;
+                    }
+
+                    Broadcast::alarmWarning(mode, status.asWord());
+                    runBus(bus, 1);
+                }
+
+                // 0s, 10s, 12.5s (new alarm), 22.5s
+                assert(bus.delivered[0][0x16] == 4 && bus.delivered[1][0x16] == 4);
+                assert(bus.lastValue[0][0x16] == status.asWord());
+
+                // Silenced by the host, for long enough that the tick counter goes round
+                mode.alarmMode = true;
+                for (uint32_t tick = 0; tick < 70000; ++tick) {
+                    Broadcast::alarmWarning(mode, status.asWord());
+                    runBus(bus, 1);
+                }
+                assert(bus.delivered[0][0x16] == 4);
+                mode.alarmMode = false;
+
+                // A new alarm right after the last warning waits out the holdoff
+                Broadcast::alarmWarning(mode, status.asWord());
+                runBus(bus, 10);
+                                assert(bus.delivered[0][0x16] == 5);
+
+                status.remainingCapacityAlarm = true;
+                for (uint16_t tick = 0; tick < Broadcast::ALARM_HOLDOFF; ++tick) {
+                    Broadcast::alarmWarning(mode, status.asWord());
+                    runBus(bus, 1);
+                    assert(bus.delivered[0][0x16] == 5 || tick >= Broadcast::ALARM_HOLDOFF - 20);
+                }
+                runBus(bus, 10);
+                assert(bus.delivered[0][0x16] == 6);
+            }
+        }
+
+        void benchmarkBroadcast() {
+            const uint32_t TICKS = 5000000;
+            BusSimulator bus;
+            Utils::BatteryMode mode;
+            Broadcast::clear();
+            BUS = &bus;
+
+            clock_t start = clock();
+
+            for (uint32_t tick = 0; tick < TICKS; ++tick) {
+                if ((tick & 63) == 0) {
+                    Broadcast::chargingParameters(mode, tick, 12600);
+                }
+                bus.beginTick();
+                Broadcast::poll();
+                bus.endTick();
+            }
+
+            BUS = nullptr;
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            printf("Broadcast poll: %.1f ns per tick, with the bus simulator\n", seconds * 1e9 / TICKS);
+        }
+    }
+
+    // The transmitter's view of the simulated bus
+    namespace Broadcast {
+        namespace Link {
+            bool idle() {
+                return Tests::BUS && !Tests::BUS->busy();
+            }
+
+            void start(const uint8_t *frame, uint8_t length) {
+                Tests::BUS->start(frame, length);
+            }
+
+            Outcome poll() {
+                return Tests::BUS->poll();
+            }
+        }
+    }
+}
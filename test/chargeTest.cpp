@@ -0,0 +1,250 @@
+#include "charge.hpp"
+#include "config.hpp"
+#include "ocv.hpp"
+#include "utils.hpp"
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        /**
+         * Three cell groups in series on a smart charger, in floating point, one second at a time. Each group is
+         * the OCV curve in series with R0 and an RC pair, with its own capacity, so the pack can be out of balance.
+         * The charger supplies the requested current, or less if that would take the pack above the requested
+         * voltage.
+        **/
+        class ChargingPack {
+            public:
+                double soc[3];
+                double capacity[3];                 // mAh
+                double polarization[3] = {};        // mV
+                double terminal[3];                 // mV
+                double current = 0;                 // mA
+                uint16_t temperature;               // 0.1K
+
+                const double r0 = BatteryConfig::CELL_R0_MILLIOHMS / 1000.0;
+                const double r1 = BatteryConfig::CELL_R1_MILLIOHMS / 1000.0;
+                const double decay = exp(-1.0 / BatteryConfig::CELL_RC_SECONDS);
+
+                ChargingPack(double startSoc, double smallest, uint16_t temperature) : temperature(temperature) {
+                    for (uint8_t cell = 0; cell < 3; ++cell) {
+                        soc[cell] = startSoc;
+                        capacity[cell] = Utils::BATTERY_CAPACITY;
+                    }
+                    capacity[1] *= smallest;
+                    settle();
+                }
+
+                double open(uint8_t cell) {
+                    int32_t slope;
+                    double clamped = soc[cell] < 0 ? 0 : soc[cell] > 1 ? 1 : soc[cell];
+                    double voltage = OCV::voltage(clamped * 10000, temperature, OCV::Charge, slope);
+
+                    // Over-discharged, below where the curve ends: the voltage drops off steeply, 200mV per 1%
+                    if (soc[cell] < 0) {
+                        voltage += soc[cell] * 20000;
+                    }
+
+                    return voltage + polarization[cell];
+                }
+
+                // One second on a charger asked for the given current and voltage
+                void step(uint16_t milliAmps, uint16_t millivolts) {
+                    double behind = open(0) + open(1) + open(2);
+                    double most = (millivolts - behind) / (3 * r0);
+
+                    current = millivolts == 0 ? 0 : fmax(0, fmin(milliAmps, most));
+
+                    for (uint8_t cell = 0; cell < 3; ++cell) {
+                        soc[cell] += current / 3600 / capacity[cell];
+                        polarization[cell] = polarization[cell] * decay + (1 - decay) * r1 * current;
+                    }
+
+                    settle();
+                }
+
+                Charge::Measurement measure() {
+                    Charge::Measurement measurement;
+                    measurement.packVoltage = lround(terminal[0] + terminal[1] + terminal[2]);
+                    measurement.lowestCell = lround(fmin(terminal[0], fmin(terminal[1], terminal[2])));
+                    measurement.highestCell = lround(fmax(terminal[0], fmax(terminal[1], terminal[2])));
+                    measurement.current = lround(current);
+                    measurement.temperature = temperature;
+                    return measurement;
+                }
+
+            private:
+                void settle() {
+                    for (uint8_t cell = 0; cell < 3; ++cell) {
+                        terminal[cell] = open(cell) + r0 * current;
+                    }
+                }
+        };
+
+        struct ChargeRun {
+            uint32_t seconds;       // To termination
+            uint16_t peakCell;      // mV
+            double lowestSoc;       // % of the emptiest group at the end
+            double highestSoc;      // % of the fullest group at the end
+            bool precharged;        // Went through the precharge phase
+        };
+
+        // The firmware before the controller: a fixed CELL_CAPACITY at CHARGE_VOLTAGE, terminated the same way
+        static ChargeRun chargeFixed(ChargingPack pack) {
+            ChargeRun run = { 0, 0, 0, 0, false };
+            uint8_t qualified = 0;
+            uint16_t termination = Utils::BATTERY_CAPACITY * BatteryConfig::TERMINATION_RATE / 100;
+
+            while (qualified < BatteryConfig::TERMINATION_TIME && run.seconds < 24 * 3600) {
+                pack.step(BatteryConfig::CELL_CAPACITY, BatteryConfig::CHARGE_VOLTAGE);
+                Charge::Measurement measurement = pack.measure();
+
+                bool tapered = measurement.current <= termination &&
+                               measurement.packVoltage + BatteryConfig::TERMINATION_VOLTAGE >= BatteryConfig::CHARGE_VOLTAGE;
+                qualified = tapered ? qualified + 1 : 0;
+
+                run.peakCell = measurement.highestCell > run.peakCell ? measurement.highestCell : run.peakCell;
+                ++run.seconds;
+            }
+
+            run.lowestSoc = 100 * fmin(pack.soc[0], fmin(pack.soc[1], pack.soc[2]));
+            run.highestSoc = 100 * fmax(pack.soc[0], fmax(pack.soc[1], pack.soc[2]));
+            return run;
+        }
+
+        static ChargeRun chargeControlled(ChargingPack pack) {
+            ChargeRun run = { 0, 0, 0, 0, false };
+            Charge::Controller controller(Utils::BATTERY_CAPACITY);
+
+            controller.update(pack.measure(), true);
+
+            while (controller.state() != Charge::Full && run.seconds < 24 * 3600) {
+                run.precharged |= controller.state() == Charge::Precharge;
+
+                pack.step(controller.current(), controller.voltage());
+                Charge::Measurement measurement = pack.measure();
+                controller.update(measurement, true);
+
+                run.peakCell = measurement.highestCell > run.peakCell ? measurement.highestCell : run.peakCell;
+                ++run.seconds;
+            }
+
+            run.lowestSoc = 100 * fmin(pack.soc[0], fmin(pack.soc[1], pack.soc[2]));
+            run.highestSoc = 100 * fmax(pack.soc[0], fmax(pack.soc[1], pack.soc[2]));
+            return run;
+        }
+
+        static void report(const char *profile, const ChargeRun &run) {
+            printf("  %-32s %4u min, peak cell %4u mV, groups at %5.1f%% to %5.1f%%\n",
+                   profile, run.seconds / 60, run.peakCell, run.lowestSoc, run.highestSoc);
+        }
+
+        void testChargeController() {
+            const uint16_t ROOM = 2982, COOL = 2782, WARM = 3232;
+            const uint16_t LIMIT = BatteryConfig::MAX_CELL_VOLTAGE;
+            const uint16_t WARM_LIMIT = LIMIT - BatteryConfig::WARM_VOLTAGE_DROP;
+
+            printf("Charge simulation, 10%% to full unless noted:\n");
+
+            ChargeRun fixed = chargeFixed(ChargingPack(0.10, 1, ROOM));
+            ChargeRun controlled = chargeControlled(ChargingPack(0.10, 1, ROOM));
+            report("fixed request, 25C", fixed);
+            report("CC/CV, 25C", controlled);
+
+            // Faster, just as full, and no cell beyond its limit (the measurement rounds to the mV)
+            assert(controlled.seconds < fixed.seconds * 9 / 10);
+            assert(controlled.lowestSoc > 95);
+            assert(controlled.peakCell <= LIMIT + 1);
+
+            // One group 10% smaller fills first. Regulating the pack voltage alone overcharges it; the per-cell
+            // clamp stops the pack short instead, with the bigger groups as full as the small one allows.
+            ChargeRun fixedUnbalanced = chargeFixed(ChargingPack(0.10, 0.9, ROOM));
+            ChargeRun unbalanced = chargeControlled(ChargingPack(0.10, 0.9, ROOM));
+            report("fixed request, 25C, unbalanced", fixedUnbalanced);
+            report("CC/CV, 25C, unbalanced", unbalanced);
+
+            assert(fixedUnbalanced.peakCell > LIMIT + 10);
+            assert(unbalanced.peakCell <= LIMIT + 1);
+            assert(unbalanced.highestSoc <= 100);
+            assert(unbalanced.lowestSoc > 85);
+
+            // Temperature bands: slower when cool, to a lower voltage when warm
+            ChargeRun cool = chargeControlled(ChargingPack(0.10, 1, COOL));
+            ChargeRun warm = chargeControlled(ChargingPack(0.10, 1, WARM));
+            report("CC/CV, 5C", cool);
+            report("CC/CV, 50C", warm);
+
+            assert(cool.seconds > controlled.seconds);
+            assert(cool.peakCell <= LIMIT + 1);
+            assert(warm.peakCell <= WARM_LIMIT + 1);
+
+            // Over-discharged to 2.7V: precharge first
+            ChargeRun flat = chargeControlled(ChargingPack(-0.04, 1, ROOM));
+            report("CC/CV, 25C, from 2.7V", flat);
+            assert(flat.precharged);
+            assert(flat.peakCell <= LIMIT + 1);
+
+            // Not allowed to charge: nothing requested, and it starts over from the right phase afterwards
+            Charge::Controller controller(Utils::BATTERY_CAPACITY);
+            ChargingPack pack(0.5, 1, ROOM);
+
+            controller.update(pack.measure(), false);
+            assert(controller.current() == 0 && controller.voltage() == 0);
+
+            controller.update(pack.measure(), true);
+            assert(controller.state() == Charge::ConstantCurrent);
+            assert(controller.current() == Utils::BATTERY_CAPACITY * BatteryConfig::CHARGE_RATE / 100);
+            assert(controller.voltage() + 2 >= LIMIT * BatteryConfig::CELLS_IN_SERIES);  // Rounding of the cells
+
+            // Full stays full until the pack sags, then tops off
+            ChargingPack full(0.10, 1, ROOM);
+            controller.update(full.measure(), true);
+            while (controller.state() != Charge::Full) {
+                full.step(controller.current(), controller.voltage());
+                controller.update(full.measure(), true);
+            }
+
+            assert(controller.current() == 0 && controller.voltage() == 0);
+
+            for (uint8_t cell = 0; cell < 3; ++cell) {
+                full.soc[cell] -= 0.02;
+            }
+            full.step(0, 0);
+            controller.update(full.measure(), true);
+            assert(controller.state() == Charge::Full);
+
+            for (uint8_t cell = 0; cell < 3; ++cell) {
+                full.soc[cell] -= 0.10;
+            }
+            full.step(0, 0);
+            controller.update(full.measure(), true);
+            assert(controller.state() == Charge::TopOff);
+            assert(controller.current() > 0);
+        }
+
+        void benchmarkChargeController() {
+            const uint32_t UPDATES = 10000000;
+            Charge::Controller controller(Utils::BATTERY_CAPACITY);
+            Charge::Measurement measurement = { 11900, 3950, 3990, 4000, 2982 };
+
+            volatile uint16_t sink = 0;
+            clock_t start = clock();
+
+            for (uint32_t i = 0; i < UPDATES; ++i) {
+                measurement.highestCell = 3990 + (i & 15);
+                controller.update(measurement, true);
+                sink = sink + controller.current();
+            }
+
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            (void)sink;
+
+            printf("Charge controller update (ns/update): %.1f, %u bytes of state\n",
+                   seconds * 1e9 / UPDATES, (unsigned)sizeof(Charge::Controller));
+        }
+    }
+}
@@ -0,0 +1,139 @@
+#include "coulomb.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        // The firmware's current sense scaling, sampled at 1kHz
+        const Coulomb::Calibration CALIBRATION = { 512, 24414, 25000, 3600000 };
+        const uint32_t FULL = 9000000;  // uAh
+
+        void testCoulombCounter() {
+            // 40 LSB of charge current (976.56mA) for an hour, then the same discharge: exact to the uAh
+            Coulomb::Counter counter(CALIBRATION, FULL);
+            counter.setRemaining(FULL / 2);
+
+            for (uint32_t sample = 0; sample < 3600000; ++sample) {
+                counter.integrate(512 + 40);
+            }
+            assert(counter.remaining() == FULL / 2 + 976560);
+
+            counter.endWindow();
+            assert(counter.current() == 977);
+
+            for (uint32_t sample = 0; sample < 3600000; ++sample) {
+                counter.integrate(512 - 40);
+            }
+            assert(counter.remaining() == FULL / 2);
+
+            counter.endWindow();
+            assert(counter.current() == -977);
+
+            // A current much smaller than a uAh per sample still adds up: 1 LSB for 10 minutes is 4069uAh
+            Coulomb::Calibration sensitive = CALIBRATION;
+            sensitive.deadbandMicroAmps = 0;
+            Coulomb::Counter small(sensitive, FULL);
+            small.setRemaining(0);
+
+            for (uint32_t sample = 0; sample < 600000; ++sample) {
+                small.integrate(513);
+            }
+            assert(small.remaining() == 4069);
+
+            // Deadband: amplifier noise of a LSB either way around zero is not charge
+            Coulomb::Counter idle(CALIBRATION, FULL);
+            idle.setRemaining(FULL / 2);
+
+            for (uint32_t sample = 0; sample < 100000; ++sample) {
+                idle.integrate(512 + (rand() % 3) - 1);
+            }
+            assert(idle.remaining() == FULL / 2);
+
+            idle.endWindow();
+            assert(idle.current() == 0);
+
+            // The offset is taken out before the deadband: a 2 LSB zero error disappears once calibrated
+            idle.setOffset(2 * 24414);
+            for (uint32_t sample = 0; sample < 100000; ++sample) {
+                idle.integrate(514);
+            }
+            assert(idle.remaining() == FULL / 2);
+
+            // Lost samples count at the last current
+            Coulomb::Counter missed(sensitive, FULL);
+            Coulomb::Counter reference(sensitive, FULL);
+            missed.setRemaining(FULL / 2);
+            reference.setRemaining(FULL / 2);
+
+            for (uint16_t sample = 0; sample < 20000; ++sample) {
+                reference.integrate(400);
+            }
+            for (uint16_t sample = 0; sample < 10000; ++sample) {
+                missed.integrate(400);
+            }
+            missed.integrateMissed(10000);
+            assert(missed.remaining() == reference.remaining());
+
+            // Never below empty, never above full
+            counter.setRemaining(1000);
+            for (uint16_t sample = 0; sample < 10000; ++sample) {
+                counter.integrate(0);
+            }
+            assert(counter.remaining() == 0);
+
+            counter.setRemaining(FULL - 1000);
+            for (uint16_t sample = 0; sample < 10000; ++sample) {
+                counter.integrate(1023);
+            }
+            assert(counter.remaining() == FULL);
+            assert(counter.remainingCapacity() == FULL / 1000);
+
+            counter.setFullCapacity(FULL / 2);
+            assert(counter.remaining() == FULL / 2);
+
+            counter.adjust(-1000);
+            assert(counter.remaining() == FULL / 2 - 1000);
+
+            // AverageCurrent settles on a step within a few minutes of 5ms windows
+            Coulomb::Counter average(CALIBRATION, FULL);
+            for (uint32_t window = 0; window < 5 * 60 * 200; ++window) {
+                for (uint8_t sample = 0; sample < 5; ++sample) {
+                    average.integrate(512 - 82);  // -2.0A
+                }
+                average.endWindow();
+            }
+            assert(average.current() == -2002);
+            assert(average.averageCurrent() >= -2002 && average.averageCurrent() <= -1990);
+        }
+
+        void benchmarkCoulombCounter() {
+            const uint32_t SAMPLES = 20000000;
+            Coulomb::Counter counter(CALIBRATION, FULL);
+            counter.setRemaining(FULL / 2);
+
+            uint16_t codes[256];
+            for (uint16_t i = 0; i < 256; ++i) {
+                codes[i] = 512 - 80 + (i * 7) % 5;
+            }
+
+            clock_t start = clock();
+
+            for (uint32_t sample = 0; sample < SAMPLES; ++sample) {
+                counter.integrate(codes[sample & 0xff]);
+
+                if ((sample & 0x7) == 0x7) {
+                    counter.endWindow();
+                }
+            }
+
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            printf("Coulomb counter: %.1f M samples/s (needs 0.001 M/s); %u bytes of RAM per counter\n",
+                   SAMPLES / seconds / 1e6, (unsigned)sizeof(Coulomb::Counter));
+        }
+    }
+}
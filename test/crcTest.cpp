@@ -1,33 +1,147 @@
-#include <stdint.h>
+#include "commands.hpp"
+#include "pec.hpp"
 #include "utils.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        // The original bool-array implementation, kept as the reference the PEC engine must agree with
+        static bool legacyNeedsLength(uint8_t type) {
+            return type == 0x20 ||
+                   type == 0x21 ||
+                   type == 0x22 ||
+                   type == 0x23 ||
+                   type == 0x30 ||
+                   type == 0x3C ||
+                   type == 0x37 ||
+                   type == 0x2F;
+        }
+
+        static void legacyAddByteToCRC(bool CRC[8], uint8_t byteToAdd) {
+            for (uint8_t y = 1; y <= 8; ++y) {
+                bool currentBit = (byteToAdd >> (8-y)) & 0x01;
+                bool invert = currentBit ^ CRC[7];
+
+                CRC[7] = CRC[6];
+                CRC[6] = CRC[5];
+                CRC[5] = CRC[4];
+                CRC[4] = CRC[3];
+                CRC[3] = CRC[2];
+                CRC[2] = CRC[1] ^ invert;
+                CRC[1] = CRC[0] ^ invert;
+                CRC[0] = invert;
+            }
+        }
+
+        static uint8_t legacyCalculateCRC(uint8_t* dataArray, uint8_t dataArrayLength, uint8_t command) {
+            bool CRC[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+            legacyAddByteToCRC(CRC, 22);
+            legacyAddByteToCRC(CRC, command);
+            legacyAddByteToCRC(CRC, 23);
+
+            if (legacyNeedsLength(command)) {
+                legacyAddByteToCRC(CRC, dataArrayLength);
+            }
+
+            for (uint8_t x = 0; x < dataArrayLength; ++x) {
+                legacyAddByteToCRC(CRC, dataArray[x]);
+            }
+
+            uint8_t remainder = 0;
+            for (uint8_t x = 0; x < 8; ++x) {
+                remainder += (1 << x) * CRC[x];
+            }
+
+            return remainder;
+        }
+
+        void testCRC() {
+            // Every (crc, byte) pair through both tables
+            for (uint16_t crc = 0; crc < 256; ++crc) {
+                for (uint16_t byte = 0; byte < 256; ++byte) {
+                    uint8_t expected = PEC::updateBitwise(crc, byte);
+                    assert(PEC::updateTable(crc, byte) == expected);
+                    assert(PEC::updateNibble(crc, byte) == expected);
+                }
+            }
+
+            // Standard CRC-8/SMBUS check value
+            const uint8_t check[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+            uint8_t crc = 0;
+            for (uint8_t i = 0; i < sizeof(check); ++i) {
+                crc = PEC::update(crc, check[i]);
+            }
+            assert(crc == 0xF4);
+
+            // Full replies, including the 0x16/0x17 address seed and the length byte of block commands
+            uint8_t data[32];
+            uint32_t state = 0x12345678;
+            for (uint16_t command = 0; command < 0x70; ++command) {
+                for (uint8_t length = 0; length <= 32; ++length) {
+                    for (uint8_t i = 0; i < length; ++i) {
+                        state = state * 1103515245 + 12345;
+                        data[i] = state >> 16;
+                    }
+
+                    assert(Utils::calculateCRC(data, length, command, legacyNeedsLength(command)) == legacyCalculateCRC(data, length, command));
+                }
+            }
+
+            // 0x09 Voltage reply for 12600mV, as seen on the bus: 16 09 17 38 31 [PEC]
+            uint8_t voltage[] = { 0x38, 0x31 };
+            assert(Utils::calculateCRC(voltage, 2, 0x09, false) == legacyCalculateCRC(voltage, 2, 0x09));
+
+            // The command table sends a length byte for exactly the commands the original firmware did, so no
+            // reply changes on the wire. 0x63-0x66 only exist in DEBUG builds, and are checked where they are defined.
+            for (uint16_t command = 0; command <= Commands::LAST_COMMAND; ++command) {
+                assert(Commands::isBlock(command) == legacyNeedsLength(command));
+            }
+        }
+
+        // Host timings only give relative costs; see the commit notes for the AVR cycle counts
+        void benchmarkCRC() {
+            const uint32_t ITERATIONS = 200000;
+            uint8_t data[32];
+            for (uint8_t i = 0; i < 32; ++i) {
+                data[i] = i * 37;
+            }
+
+            volatile uint8_t sink = 0;
+            clock_t start;
+
+            start = clock();
+            for (uint32_t i = 0; i < ITERATIONS; ++i) {
+                data[0] = i;
+                sink = legacyCalculateCRC(data, 32, 0x20);
+            }
+            double legacy = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            start = clock();
+            for (uint32_t i = 0; i < ITERATIONS; ++i) {
+                data[0] = i;
+                uint8_t crc = PEC::seed(0x20);
+                for (uint8_t x = 0; x < 32; ++x) crc = PEC::updateTable(crc, data[x]);
+                sink = crc;
+            }
+            double table = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            start = clock();
+            for (uint32_t i = 0; i < ITERATIONS; ++i) {
+                data[0] = i;
+                uint8_t crc = PEC::seed(0x20);
+                for (uint8_t x = 0; x < 32; ++x) crc = PEC::updateNibble(crc, data[x]);
+                sink = crc;
+            }
+            double nibble = (double)(clock() - start) / CLOCKS_PER_SEC;
 
-void main() {
-    bool CRC[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    bool expectedCRC[5][8] = { // TODO
-        {0, 0, 0, 0, 0, 0, 0, 0},
-        {0, 0, 0, 0, 0, 0, 0, 0},
-        {0, 0, 0, 0, 0, 0, 0, 0},
-        {0, 0, 0, 0, 0, 0, 0, 0},
-        {0, 0, 0, 0, 0, 0, 0, 0}
-    };
-
-    uint8_t inData[5] = { 0xB6, 0x27, 0xB7, 0x5B, 0x3C };
-    uint8_t answer, data;
-
-    for (uint8_t bindex=0; bindex < 5; ++bindex) {
-       data = inData[bindex];
-       OpenSmartBattery::Utils::addByteToCRC(CRC, data);
-
-       printf("\n[%i] answer/got:\n", bindex);
-       for (uint8_t i = 0; i < 8; ++i) {
-           printf("%x", expectedCRC[bindex][i]);
-           if (i == 3) { printf("_"); }
-       }
-
-       printf("\n");
-       for (uint8_t i = 0; i < 8; ++i) {
-           printf("%x", CRC[i]);
-           if (i == 3) { printf("_"); }
-       }
+            (void)sink;
+            printf("PEC over a 32 byte block (ns/reply): bool array %.1f, table %.1f, nibble %.1f\n",
+                   legacy * 1e9 / ITERATIONS, table * 1e9 / ITERATIONS, nibble * 1e9 / ITERATIONS);
+        }
     }
 }
@@ -0,0 +1,156 @@
+#include "config.hpp"
+#include "kalman.hpp"
+#include "ocv.hpp"
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        /**
+         * Discharge curves to replay through the filter, recorded from a reference cell model in floating point
+         * one second at a time. The cell differs from what the filter assumes: 10% more R0 and R1, a 35s rather
+         * than 30s time constant, 9000mAh rather than 9261mAh. The measurements carry sensor error: voltage
+         * noise, and a gain error on the current.
+        **/
+        class RecordedCell {
+            public:
+                double soc;
+                double polarization = 0;  // V
+
+                const double capacity = 9000;  // mAh
+                const double r0 = BatteryConfig::CELL_R0_MILLIOHMS * 1.1e-3;
+                const double r1 = BatteryConfig::CELL_R1_MILLIOHMS * 1.1e-3;
+                const double decay = exp(-1.0 / 35);
+
+                RecordedCell(double soc) : soc(soc) { }
+
+                // Apply a current (mA, positive charging) for one second; returns the terminal voltage in mV
+                double step(double milliAmps) {
+                    soc += milliAmps / 3600 / capacity;
+                    polarization = polarization * decay + (1 - decay) * r1 * milliAmps / 1000;
+
+                    int32_t slope;
+                    double open = OCV::voltage(soc * 10000, 2982, OCV::Discharge, slope);
+                    return open + 1000 * (r0 * milliAmps / 1000 + polarization);
+                }
+        };
+
+        static double noise(double deviation) {
+            return deviation * ((rand() % 2001) - 1000) / 1000.0 * sqrt(3.0);
+        }
+
+        struct Replay {
+            double worst;        // Largest SOC error after the first 10 minutes, in %
+            double last;         // SOC error at the end, in %
+            double counted;      // SOC error at the end of coulomb counting alone, in %
+            uint32_t uncovered;  // Seconds after the first 10 minutes the error exceeded MaxError
+            uint32_t seconds;
+        };
+
+        // Replay a discharge with the given load profile (mA at each second), stopping at 10% true SOC
+        template<typename Load>
+        static Replay replay(RecordedCell &cell, Kalman::Filter &filter, double gainError, Load load) {
+            Replay result = { 0, 0, 0, 0, 0 };
+            double counted = filter.stateOfCharge() / 100.0;
+
+            while (cell.soc > 0.10) {
+                double milliAmps = load(result.seconds);
+                double millivolts = cell.step(milliAmps) + noise(3);
+
+                // The pack's capacity as the firmware believes it: 9261mAh, not the 9000mAh it really has
+                double measured = milliAmps * (1 + gainError);
+                filter.update(lround(measured / 3.6), 9261000, lround(measured), lround(millivolts), 2982, OCV::Discharge);
+                counted += measured / 3600 / 9261 * 100;
+                result.counted = fabs(counted - cell.soc * 100);
+
+                double error = fabs(filter.stateOfCharge() / 100.0 - cell.soc * 100);
+                result.last = error;
+
+                if (result.seconds > 600) {
+                    result.worst = error > result.worst ? error : result.worst;
+                    result.uncovered += error > filter.maxError();
+                }
+
+                ++result.seconds;
+            }
+
+            return result;
+        }
+
+        void testKalmanFilter() {
+            srand(12);
+            assert(Kalman::RC_DECAY == 31694);  // exp(-1/30) in Q15
+
+            // Rested but started 30% off: the OCV pulls it in within a minute
+            {
+                RecordedCell cell(0.80);
+                Kalman::Filter filter;
+                filter.reset(5000);
+                assert(filter.maxError() == 20 + OCV::MAX_ERROR);
+
+                for (uint8_t second = 0; second < 60; ++second) {
+                    double millivolts = cell.step(0);
+                    filter.update(0, 9261000, 0, lround(millivolts), 2982, OCV::Discharge);
+                }
+
+                assert(fabs(filter.stateOfCharge() / 100.0 - 80) < 2);
+                assert(filter.maxError() <= OCV::MAX_ERROR + 2);
+            }
+
+            // Half C discharge from 90%, started at 60%
+            {
+                RecordedCell cell(0.90);
+                Kalman::Filter filter;
+                filter.reset(6000);
+
+                Replay result = replay(cell, filter, 0, [](uint32_t) { return -4600.0; });
+                printf("Kalman replay, 0.5C from 90%% started at 60%%: worst %.2f%%, final %.2f%%, %u/%u s outside MaxError\n",
+                       result.worst, result.last, result.uncovered, result.seconds);
+
+                assert(result.worst < 4);
+                assert(result.last < 3);
+                assert(result.uncovered < result.seconds / 20);
+            }
+
+            // A laptop's pulsed load, and a current sense reading 5% low that counting alone can't see
+            {
+                RecordedCell cell(0.95);
+                Kalman::Filter filter;
+                filter.reset(9500);
+
+                Replay result = replay(cell, filter, -0.05, [](uint32_t second) {
+                    return second % 30 < 10 ? -6000.0 : -1500.0;
+                });
+                printf("Kalman replay, pulsed load with 5%% gain error: worst %.2f%%, final %.2f%% (counting %.2f%%), %u/%u s outside MaxError\n",
+                       result.worst, result.last, result.counted, result.uncovered, result.seconds);
+
+                assert(result.worst < 4);
+                assert(result.last < 3);
+                assert(result.counted > 5);
+                assert(result.uncovered < result.seconds / 20);
+            }
+        }
+
+        void benchmarkKalmanFilter() {
+            const uint32_t UPDATES = 2000000;
+            Kalman::Filter filter;
+            filter.reset(8000);
+
+            clock_t start = clock();
+
+            for (uint32_t update = 0; update < UPDATES; ++update) {
+                filter.update(-1000, 9261000, -3600, 3700 + (update * 7) % 200, 2982, OCV::Discharge);
+            }
+
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            printf("Kalman filter update (ns/update): %.1f, %u bytes of state\n",
+                   seconds * 1e9 / UPDATES, (unsigned)sizeof(Kalman::Filter));
+        }
+    }
+}
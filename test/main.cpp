@@ -1,10 +1,50 @@
 #include "OpenSmartBattery.hpp"
 #include "config.hpp"
+#include "replies.hpp"
+#include "telemetry.hpp"
 #include "utils.hpp"
 #include <assert.h>
 
 namespace OpenSmartBattery {
     namespace Tests {
+        void testCRC();
+        void benchmarkCRC();
+        void testRegisterFile();
+        void benchmarkRegisterFile();
+        void testScheduler();
+        void testADC();
+        void testOversampling();
+        void benchmarkADC();
+        void testCoulombCounter();
+        void benchmarkCoulombCounter();
+        void testOCV();
+        void benchmarkOCV();
+        void testKalmanFilter();
+        void benchmarkKalmanFilter();
+        void testThermistor();
+        void benchmarkThermistor();
+        void testProtection();
+        void testProtectionLatency();
+        void benchmarkProtection();
+        void testChargeController();
+        void benchmarkChargeController();
+        void testBroadcast();
+        void benchmarkBroadcast();
+        void testSMBus();
+        void testUSIMaster();
+        void benchmarkSMBus();
+        void testBlockTransfer();
+        void testBlockTransferFuzz();
+        void benchmarkBlockTransfer();
+        void testWrites();
+        void benchmarkWrites();
+        void testSHA1();
+        void benchmarkSHA1();
+        void testAuthentication();
+        void testAuthenticationSchemes();
+        void benchmarkAuthentication();
+        void testBoot();
+
         void testBatteryMode() {
             Utils::BatteryMode batteryMode = Utils::BatteryMode();
             uint8_t higher, lower;
@@ -19,6 +59,81 @@ namespace OpenSmartBattery {
             batteryMode.asSplitBytes(&higher, &lower);
             assert(higher == 128);
             assert(lower == 1);
+
+            // The flags are the register word itself; copying one flag leaves the other bits alone
+            static_assert(sizeof(Utils::BatteryMode) == 2, "BatteryMode is its register word");
+            Utils::BatteryMode other = Utils::BatteryMode();
+            other.alarmMode = true;
+            other.capacityMode = batteryMode.internalChargeController;
+            batteryMode.alarmMode = other.alarmMode;
+            assert(batteryMode.asWord() == 0xa001 && other.asWord() == 0xa001);
+
+            batteryMode.capacityMode = false;
+            assert(batteryMode.asWord() == 0x2001 && batteryMode.alarmMode && !batteryMode.capacityMode);
+        }
+
+        void testBatteryStatus() {
+            Utils::BatteryStatus status = Utils::BatteryStatus();
+            static_assert(sizeof(Utils::BatteryStatus) <= 4, "BatteryStatus is its register word and the error code");
+
+            // Fully charged and initialized
+            assert(status.asWord() == 0x00a0);
+            assert(!status.canCharge() && status.canDischarge());
+
+            status.fullyCharged = false;
+            status.errorCode = Utils::AlarmErrorCode::Busy;
+            assert(status.asWord() == 0x0081 && status.canCharge());
+
+            status.overTempAlarm = true;
+            assert(status.asWord() == 0x1081 && !status.canCharge() && !status.canDischarge());
+
+            status.overTempAlarm = false;
+            status.terminateDischargeAlarm = true;
+            assert(status.canCharge() && status.canDischarge());
+        }
+
+        void testTelemetry() {
+            Utils::BatteryStatus status = BATTERY_STATUS;
+
+            BATTERY_STATUS.overTempAlarm = false;
+            publishTelemetry();
+            assert(TELEMETRY.batteryStatus == BATTERY_STATUS.asWord());
+
+            // Never request a charge against an alarm
+            BATTERY_STATUS.overTempAlarm = true;
+            publishTelemetry();
+            assert(TELEMETRY.chargingCurrent == 0 && TELEMETRY.chargingVoltage == 0);
+            assert(TELEMETRY.batteryStatus & 0x1000);
+
+            BATTERY_STATUS = status;
+            publishTelemetry();
+        }
+
+        void testStaticReplies() {
+            // 0x19 DesignVoltage: 10800mV, LSB first, then the PEC
+            constexpr auto voltage = StaticReplies::wordReply(0x19, 10800);
+            uint8_t voltageData[] = { 0x30, 0x2a };
+            assert(voltage.bytes[0] == 3);
+            assert(voltage.bytes[1] == 0x30 && voltage.bytes[2] == 0x2a);
+            assert(voltage.bytes[3] == Utils::calculateCRC(voltageData, 2, 0x19, false));
+
+            // 0x21 DeviceName: length byte, string without its NUL, then the PEC
+            constexpr auto name = StaticReplies::blockReply(0x21, "AS10D51");
+            assert(name.bytes[0] == 9);
+            assert(name.bytes[1] == 7);
+            assert(name.bytes[2] == 'A' && name.bytes[8] == '1');
+            assert(name.bytes[9] == Utils::calculateCRC((uint8_t*)"AS10D51", 7, 0x21, true));
+
+            constexpr uint8_t data[] = { 0x00, 0x6e, 0x00, 0xaa };
+            constexpr auto raw = StaticReplies::blockReply(0x23, data);
+            assert(raw.bytes[0] == 6);
+            assert(raw.bytes[1] == 4);
+            assert(raw.bytes[5] == 0xaa);
+            assert(raw.bytes[6] == Utils::calculateCRC((uint8_t*)data, 4, 0x23, true));
+
+            // Must be usable as a constant initializer, otherwise it would not end up in flash
+            static_assert(StaticReplies::wordReply(0x1b, Utils::MANUFACTURE_DATE).bytes[1] == 0x6b, "");
+            static_assert(StaticReplies::wordReply(0x1b, Utils::MANUFACTURE_DATE).bytes[2] == 0x4b, "");
         }
     }
 }
@@ -26,5 +141,46 @@ namespace OpenSmartBattery {
 
 int main() {
     OpenSmartBattery::Tests::testBatteryMode();
+    OpenSmartBattery::Tests::testBatteryStatus();
+    OpenSmartBattery::Tests::testCRC();
+    OpenSmartBattery::Tests::testStaticReplies();
+    OpenSmartBattery::Tests::testTelemetry();
+    OpenSmartBattery::Tests::testRegisterFile();
+    OpenSmartBattery::Tests::testScheduler();
+    OpenSmartBattery::Tests::testADC();
+    OpenSmartBattery::Tests::testOversampling();
+    OpenSmartBattery::Tests::testCoulombCounter();
+    OpenSmartBattery::Tests::testOCV();
+    OpenSmartBattery::Tests::testKalmanFilter();
+    OpenSmartBattery::Tests::testThermistor();
+    OpenSmartBattery::Tests::testProtection();
+    OpenSmartBattery::Tests::testProtectionLatency();
+    OpenSmartBattery::Tests::testChargeController();
+    OpenSmartBattery::Tests::testBroadcast();
+    OpenSmartBattery::Tests::testWrites();
+    OpenSmartBattery::Tests::testSMBus();
+    OpenSmartBattery::Tests::testUSIMaster();
+    OpenSmartBattery::Tests::testBlockTransfer();
+    OpenSmartBattery::Tests::testBlockTransferFuzz();
+    OpenSmartBattery::Tests::testSHA1();
+    OpenSmartBattery::Tests::testAuthentication();
+    OpenSmartBattery::Tests::testAuthenticationSchemes();
+    OpenSmartBattery::Tests::testBoot();
+
+    OpenSmartBattery::Tests::benchmarkCRC();
+    OpenSmartBattery::Tests::benchmarkRegisterFile();
+    OpenSmartBattery::Tests::benchmarkADC();
+    OpenSmartBattery::Tests::benchmarkCoulombCounter();
+    OpenSmartBattery::Tests::benchmarkOCV();
+    OpenSmartBattery::Tests::benchmarkKalmanFilter();
+    OpenSmartBattery::Tests::benchmarkThermistor();
+    OpenSmartBattery::Tests::benchmarkProtection();
+    OpenSmartBattery::Tests::benchmarkChargeController();
+    OpenSmartBattery::Tests::benchmarkBroadcast();
+    OpenSmartBattery::Tests::benchmarkSMBus();
+    OpenSmartBattery::Tests::benchmarkBlockTransfer();
+    OpenSmartBattery::Tests::benchmarkWrites();
+    OpenSmartBattery::Tests::benchmarkSHA1();
+    OpenSmartBattery::Tests::benchmarkAuthentication();
 }
 
@@ -0,0 +1,72 @@
+#ifndef SMART_BATTERY_FIRMWARE_TEST_MOCK_ADC_H
+#define SMART_BATTERY_FIRMWARE_TEST_MOCK_ADC_H
+
+#include "adc.hpp"
+#include "platform.hpp"
+#include <math.h>
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        /**
+         * Stand-in for the ADC in free-running mode: when a conversion completes, the next one starts right away
+         * with whatever ADMUX holds at that moment, and only then does the interrupt run.
+         *
+         * Each ADC input converts an analog value in LSBs (fractions allowed) plus Gaussian noise of the given
+         * standard deviation, rounded and clamped to 10 bits like the real converter.
+        **/
+        class MockADC {
+            public:
+                double values[8] = {};
+                double noise = 0;
+
+                // The input a firmware channel is wired to
+                double &input(Analog::Channel channel) {
+                    return values[Analog::inputPin(channel)];
+                }
+
+                void start() {
+                    latched = ADMUX;
+                }
+
+                void complete() {
+                    uint8_t finished = latched & 0x3f;
+                    latched = ADMUX;
+
+                    ADC = convert(finished);
+                    Analog::onConversionComplete();
+                }
+
+                // Complete conversions until every channel has been converted `scans` times
+                void scan(uint16_t scans) {
+                    for (uint32_t i = 0; i < (uint32_t)scans * Analog::COUNT; ++i) {
+                        complete();
+                    }
+                }
+
+            private:
+                uint8_t latched = 0;
+                uint32_t state = 1;
+
+                uint16_t convert(uint8_t channel) {
+                    double value = round(values[channel] + noise * gaussian());
+                    return value < 0 ? 0 : value > 1023 ? 1023 : (uint16_t)value;
+                }
+
+                // Sum of four uniforms, scaled to unit variance. Deterministic, so the tests are too.
+                double gaussian() {
+                    double sum = 0;
+
+                    for (uint8_t i = 0; i < 4; ++i) {
+                        state = state * 1103515245 + 12345;
+                        sum += ((state >> 8) & 0xffff) / 65536.0 - 0.5;
+                    }
+
+                    return sum * sqrt(3.0);
+                }
+        };
+    }
+}
+
+#endif
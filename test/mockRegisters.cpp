@@ -0,0 +1,8 @@
+#include <stdint.h>
+
+// Peripheral registers the firmware touches, as plain variables for the host build (see platform.hpp)
+volatile uint8_t ADMUX, ADCSRA, ADCSRB, DIDR0;
+volatile uint16_t ADC;
+volatile uint8_t PORTA, DDRA, PINA;
+volatile uint8_t PORTB;
+volatile uint8_t USICR, USISR, USIDR;
@@ -0,0 +1,235 @@
+#ifndef SMART_BATTERY_FIRMWARE_TEST_MOCK_USI_H
+#define SMART_BATTERY_FIRMWARE_TEST_MOCK_USI_H
+
+#include "platform.hpp"
+#include "smbus.hpp"
+#include <assert.h>
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        /**
+         * Stand-in for the USI in two-wire slave mode, with the test as the bus master. It raises the start
+         * condition and counter overflow flags, runs the matching interrupt like the hardware would, and reads the
+         * slave's side of the bus back from USIDR and DDRA.
+         *
+         * Writing a one to a USISR flag clears it, as on the hardware. Every interrupt has to write USISR before
+         * it returns, since that is what lets go of SCL; the counter is preset to an impossible 15 to check it.
+        **/
+        class MockUSI {
+            public:
+                uint32_t interrupts = 0;
+
+                // SDA falls, and then SCL, which completes the START. A bus that leaves SCL high instead never
+                // completes it.
+                void start(bool clockFalls = true) {
+                    PINA = clockFalls ? 0 : _BV(PA4);
+                    raise(_BV(USISIF));
+
+                    if (USICR & _BV(USISIE)) {
+                        interrupt(SMBus::onStart);
+                    }
+                }
+
+                void stop() {
+                    raise(_BV(USIPF));
+                }
+
+                // Send a byte as master; returns whether the slave ACKed it
+                bool send(uint8_t byte) {
+                    if (!(USICR & _BV(USIOIE))) {
+                        return false;  // Not taking part in this transaction
+                    }
+
+                    USIDR = byte;
+                    overflow();
+
+                    // The ninth bit: ACK if the slave holds SDA low
+                    if (!(USICR & _BV(USIOIE))) {
+                        assert(!(DDRA & _BV(PA6)));
+                        return false;
+                    }
+
+                    assert((USISR & 0x0f) == 14);
+                    bool acked = (DDRA & _BV(PA6)) && !(USIDR & 0x80);
+                    overflow();
+
+                    return acked;
+                }
+
+                // Clock a byte in from the slave, and ACK it (wants more) or NACK it (done)
+                uint8_t receive(bool ack) {
+                    assert(USICR & _BV(USIOIE));
+                    assert((USISR & 0x0f) == 0);
+
+                    uint8_t byte = (DDRA & _BV(PA6)) ? USIDR : 0xff;
+                    overflow();
+
+                    assert((USISR & 0x0f) == 14);
+                    assert(!(DDRA & _BV(PA6)));
+                    USIDR = ack ? 0 : 1;
+                    overflow();
+
+                    return byte;
+                }
+
+                // Whether the slave has let go of SCL and is only watching for the next START
+                bool listening() const {
+                    return (USICR & _BV(USISIE)) && !(USICR & _BV(USIOIE));
+                }
+
+            private:
+                uint8_t flags = 0;
+
+                void raise(uint8_t flag) {
+                    flags |= flag;
+                    USISR = flags | (USISR & 0x0f);
+                }
+
+                void overflow() {
+                    raise(_BV(USIOIF));
+                    interrupt(SMBus::onOverflow);
+                }
+
+                void interrupt(void (*handler)()) {
+                    USISR = flags | 0x0f;
+                    handler();
+                    ++interrupts;
+
+                    uint8_t written = USISR;
+                    assert((written & 0x0f) != 0x0f);
+
+                    flags &= ~(written & 0xf0);
+                    USISR = flags | (written & 0x0f);
+                }
+        };
+
+        /**
+         * The bus as the USI master (SMBus::Master) sees it, with a slave device on it. Whenever the firmware
+         * busy-waits, the lines settle from what PORTA, DDRA and USIDR drive, and PINA reads them back. Each line is
+         * the wired AND of everyone on it; the USI pulls SDA low when its pin is an output and either PORTA or the
+         * MSB of USIDR is 0, and with an external clock selected USIDR shifts SDA in on every rising edge of SCL.
+         *
+         * The device ACKs its address and every byte after it. It can also stretch the clock after a byte, or be
+         * another master sending an address byte of its own at the same time.
+        **/
+        class MockUSIBus {
+            public:
+                uint8_t address = 0x09;   // 7-bit address the device answers to
+                uint8_t rival = 0;        // Address byte another master sends from the next START, if any
+                double stretch = 0;       // us the device holds SCL low after the next byte
+
+                uint8_t received[8] = {}; // Bytes since the last START, address included
+                uint8_t count = 0;
+                uint8_t starts = 0;
+                uint8_t stops = 0;
+
+                // The one _delay_us() moves along
+                static inline MockUSIBus *ACTIVE = nullptr;
+
+                MockUSIBus() {
+                    ACTIVE = this;
+                    settle(0);
+                }
+
+                ~MockUSIBus() {
+                    ACTIVE = nullptr;
+                }
+
+                // The other master, having won, ends its frame
+                void rivalStop() {
+                    rival = 0;
+                    rivalData = true;
+                    settle(0);
+                }
+
+                void settle(double us) {
+                    bool clock = !((DDRA & _BV(PA4)) && !(PORTA & _BV(PA4))) && held <= 0;
+                    held -= us;
+
+                    // SCL falling first: whatever else changed, changed while it was low
+                    if (lastClock && !clock) {
+                        falling();
+                    }
+
+                    bool data = line();
+
+                    if (clock && lastClock && data != lastData) {
+                        if (data) {
+                            ++stops;
+                            active = false;
+                            ackHeld = false;
+                        } else {
+                            ++starts;
+                            active = true;
+                            bits = 0;
+                            count = 0;
+                            rivalData = !rival || (rival & 0x80);
+                        }
+                    }
+
+                    if (clock && !lastClock) {
+                        rising(data);
+                        data = line();
+                    }
+
+                    lastClock = clock;
+                    lastData = data;
+                    PINA = (PINA & ~(_BV(PA4) | _BV(PA6))) | (clock ? _BV(PA4) : 0) | (data ? _BV(PA6) : 0);
+                }
+
+            private:
+                bool lastClock = true;
+                bool lastData = true;
+                bool active = false;      // Between a START and a STOP
+                bool ackHeld = false;     // The device pulls SDA low for the ninth bit
+                bool rivalData = true;    // What the other master drives SDA to
+                uint8_t bits = 0;         // Rising edges of SCL in the current byte, the ninth included
+                uint8_t shifted = 0;
+                double held = 0;          // us the device still holds SCL low
+
+                bool line() const {
+                    bool usi = !(DDRA & _BV(PA6)) || ((PORTA & _BV(PA6)) && (USIDR & 0x80));
+                    return usi && !ackHeld && rivalData;
+                }
+
+                void rising(bool data) {
+                    if (USICR & _BV(USICS1)) {
+                        USIDR = USIDR << 1 | data;
+                    }
+
+                    if (active && bits < 8) {
+                        shifted = shifted << 1 | data;
+                    }
+                    ++bits;
+                }
+
+                void falling() {
+                    if (!active) {
+                        return;
+                    }
+
+                    if (bits == 8) {
+                        if (count < sizeof(received)) {
+                            received[count] = shifted;
+                        }
+                        ++count;
+                        ackHeld = (received[0] >> 1) == address;
+                        rivalData = true;
+
+                    } else if (bits == 9) {
+                        ackHeld = false;
+                        bits = 0;
+                        held = stretch;
+                        stretch = 0;
+
+                    } else if (rival && count == 0) {
+                        rivalData = (rival << bits) & 0x80;
+                    }
+                }
+        };
+    }
+}
+
+#endif
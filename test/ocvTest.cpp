@@ -0,0 +1,137 @@
+#include "config.hpp"
+#include "ocv.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        // Straightforward reference for the binary search: scan the curve for the segment
+        static uint16_t linearLookup(const uint16_t *curve, uint16_t millivolts) {
+            if (millivolts <= curve[0]) {
+                return 0;
+            }
+
+            for (uint8_t point = 1; point < OCV::POINTS; ++point) {
+                if (millivolts < curve[point]) {
+                    uint16_t span = OCV::SOC[point] - OCV::SOC[point - 1];
+                    return OCV::SOC[point - 1] +
+                           (uint32_t)span * (millivolts - curve[point - 1]) / (curve[point] - curve[point - 1]);
+                }
+            }
+
+            return 10000;
+        }
+
+        void testOCV() {
+            constexpr OCV::Table table = OCV::makeTable(OCV::chemistry());
+            const uint16_t ROOM = 2982;
+
+            // Stretched between the configured empty and full voltages
+            assert(table.millivolts[1][OCV::Discharge][0] == BatteryConfig::MIN_CELL_VOLTAGE);
+            assert(table.millivolts[1][OCV::Discharge][OCV::POINTS - 1] == BatteryConfig::MAX_CELL_VOLTAGE);
+
+            // On a point, and halfway between two
+            uint16_t middle = table.millivolts[1][OCV::Discharge][6];
+            assert(OCV::stateOfCharge(middle, ROOM, OCV::Discharge) == 5000);
+
+            uint16_t between = (table.millivolts[1][OCV::Discharge][3] + table.millivolts[1][OCV::Discharge][4]) / 2;
+            uint16_t soc = OCV::stateOfCharge(between, ROOM, OCV::Discharge);
+            assert(soc > 2400 && soc < 2600);
+
+            // Clamped at either end
+            assert(OCV::stateOfCharge(3000, ROOM, OCV::Discharge) == 0);
+            assert(OCV::stateOfCharge(4300, ROOM, OCV::Charge) == 10000);
+
+            // Hysteresis: the same voltage is less charge after charging than after discharging
+            uint16_t discharged = OCV::stateOfCharge(middle, ROOM, OCV::Discharge);
+            uint16_t charged = OCV::stateOfCharge(middle, ROOM, OCV::Charge);
+            uint16_t unknown = OCV::stateOfCharge(middle, ROOM, OCV::Unknown);
+            assert(charged < discharged);
+            assert(unknown == (charged + discharged) / 2);
+
+            // Between two temperature columns the SOC is interpolated, outside them the nearest column holds
+            uint16_t cold = OCV::stateOfCharge(middle, 2732, OCV::Discharge);
+            uint16_t halfway = OCV::stateOfCharge(middle, 2857, OCV::Discharge);
+            assert(cold != discharged);
+            int32_t mean = (cold + discharged) / 2;
+            assert(halfway >= mean - 1 && halfway <= mean + 1);
+            assert(OCV::stateOfCharge(middle, 2500, OCV::Discharge) == cold);
+            assert(OCV::stateOfCharge(middle, 3300, OCV::Discharge) == OCV::stateOfCharge(middle, 3182, OCV::Discharge));
+
+            // The binary search agrees with a linear scan over every voltage, on every curve, and never falls
+            for (uint8_t column = 0; column < OCV::TEMPERATURES; ++column) {
+                uint16_t temperature = OCV::TEMPERATURE[column];
+
+                for (uint8_t direction = 0; direction < 2; ++direction) {
+                    uint16_t previous = 0;
+
+                    for (uint16_t millivolts = 3400; millivolts <= 4300; ++millivolts) {
+                        uint16_t soc = OCV::stateOfCharge(millivolts, temperature, (OCV::Direction)direction);
+
+                        assert(soc == linearLookup(table.millivolts[column][direction], millivolts));
+                        assert(soc >= previous);
+                        previous = soc;
+                    }
+                }
+            }
+
+            // voltage() inverts stateOfCharge(), and its slope is the curve's
+            for (uint16_t soc = 0; soc <= 10000; soc += 50) {
+                int32_t slope;
+                uint16_t millivolts = OCV::voltage(soc, ROOM, OCV::Discharge, slope);
+                uint16_t back = OCV::stateOfCharge(millivolts, ROOM, OCV::Discharge);
+
+                assert(back + 30 >= soc && back <= soc + 30);
+                assert(slope > 0);
+            }
+
+            int32_t slope;
+            assert(OCV::voltage(5000, ROOM, OCV::Discharge, slope) == middle);
+            assert(slope == (int32_t)(table.millivolts[1][OCV::Discharge][7] - middle) * 10000 / 1000);
+
+            // Rest detection: rested at power on, applied once per rest, reset by any real current
+            OCV::RestDetector rest;
+            assert(rest.rested());
+            assert(rest.direction() == OCV::Unknown);
+            assert(rest.update(0));
+            assert(!rest.update(0));
+
+            assert(!rest.update(-1500));
+            assert(!rest.rested());
+            assert(rest.direction() == OCV::Discharge);
+
+            for (uint16_t second = 1; second < BatteryConfig::OCV_REST_TIME; ++second) {
+                assert(!rest.update(BatteryConfig::OCV_REST_CURRENT));
+            }
+            assert(rest.update(-(int16_t)BatteryConfig::OCV_REST_CURRENT));
+            assert(rest.rested());
+            assert(!rest.update(0));
+
+            assert(!rest.update(BatteryConfig::OCV_REST_CURRENT + 1));
+            assert(rest.direction() == OCV::Charge);
+        }
+
+        void benchmarkOCV() {
+            const uint32_t LOOKUPS = 5000000;
+            volatile uint32_t sink = 0;
+
+            clock_t start = clock();
+
+            for (uint32_t lookup = 0; lookup < LOOKUPS; ++lookup) {
+                uint16_t millivolts = 3400 + (lookup * 37) % 900;
+                uint16_t temperature = 2700 + (lookup * 13) % 500;
+
+                sink = sink + OCV::stateOfCharge(millivolts, temperature, (OCV::Direction)(lookup % 3));
+            }
+
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            (void)sink;
+
+            printf("OCV lookup (ns/call): %.1f, table %u bytes of flash\n",
+                   seconds * 1e9 / LOOKUPS, (unsigned)sizeof(OCV::Table));
+        }
+    }
+}
@@ -0,0 +1,210 @@
+#include "OpenSmartBattery.hpp"
+#include "adc.hpp"
+#include "mockADC.hpp"
+#include "platform.hpp"
+#include "protection.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        const uint8_t CHARGE = 1;
+        const uint8_t OUTPUT = 2;
+
+        static bool pinHigh(uint8_t pin) {
+            return *portOutputRegister(digitalPinToPort(pin)) & digitalPinToBitMask(pin);
+        }
+
+        // The transistors that are closed, wherever the pin map puts them
+        static uint8_t transistors() {
+            return (pinHigh(HardwareConfig::Pins::CHARGE_TRANSISTOR) ? CHARGE : 0) |
+                   (pinHigh(HardwareConfig::Pins::OUTPUT_TRANSISTOR) ? OUTPUT : 0);
+        }
+
+        // ADC inputs, in LSBs, for three cells at the given voltages and the given current
+        static void setPack(MockADC &adc, uint16_t cell0, uint16_t cell1, uint16_t cell2, int16_t milliamps) {
+            const double LSB = HardwareConfig::ADC_REFERENCE_MILLIVOLTS / 1024.0;
+
+            adc.input(Analog::Current) = HardwareConfig::CURRENT_ZERO_CODE +
+                milliamps * 1000.0 / HardwareConfig::CURRENT_MICROAMPS_PER_LSB;
+            adc.input(Analog::Cell0) = cell0 / LSB / HardwareConfig::Dividers::CELL_0_VOLTAGE;
+            adc.input(Analog::Cell1) = (cell0 + cell1) / LSB / HardwareConfig::Dividers::CELL_1_VOLTAGE;
+            adc.input(Analog::Cell2) = (cell0 + cell1 + cell2) / LSB / HardwareConfig::Dividers::CELL_2_VOLTAGE;
+            adc.input(Analog::Pack) = (cell0 + cell1 + cell2) / LSB / HardwareConfig::Dividers::PACK_VOLTAGE;
+        }
+
+        // A healthy pack with both transistors closed
+        static void startHealthy(MockADC &adc) {
+            setPack(adc, 3700, 3700, 3700, -1000);
+
+            Protection::begin();
+            Analog::begin();
+            adc.start();
+            adc.scan(2);
+
+            Protection::drive(true, true);
+            assert(Protection::faults() == 0);
+            assert(transistors() == (CHARGE | OUTPUT));
+        }
+
+        void testProtection() {
+            MockADC adc;
+
+            // Inside every limit nothing trips, the noise included
+            adc.noise = 1;
+            startHealthy(adc);
+            adc.scan(1000);
+            assert(Protection::faults() == 0);
+            adc.noise = 0;
+
+            // Over-voltage on a middle cell only opens the charge transistor, and discharging can bring it back
+            setPack(adc, 3700, 4350, 3700, 0);
+            adc.scan(HardwareConfig::PROTECTION_CONVERSIONS);
+            assert(Protection::faults() == Protection::OverVoltage);
+            assert(transistors() == OUTPUT);
+
+            // The main loop can't close it again while the fault is latched, only once it has been released
+            Protection::drive(true, true);
+            assert(transistors() == OUTPUT);
+
+            setPack(adc, 3700, 4150, 3700, 0);
+            adc.scan(2);
+            assert(Protection::faults() == Protection::OverVoltage);
+
+            Protection::release(Protection::OverVoltage);
+            Protection::drive(true, true);
+            assert(transistors() == (CHARGE | OUTPUT));
+
+            // Under-voltage of the bottom cell opens the output transistor
+            setPack(adc, 2700, 3700, 3700, -1000);
+            adc.scan(HardwareConfig::PROTECTION_CONVERSIONS);
+            assert(Protection::faults() == Protection::UnderVoltage);
+            assert(transistors() == CHARGE);
+
+            // Over-current either way opens both
+            startHealthy(adc);
+            setPack(adc, 3700, 3700, 3700, -11000);
+            adc.scan(HardwareConfig::PROTECTION_CONVERSIONS);
+            assert(Protection::faults() == Protection::OverCurrentDischarge);
+            assert(transistors() == 0);
+
+            startHealthy(adc);
+            setPack(adc, 3700, 3700, 3700, 5000);
+            adc.scan(HardwareConfig::PROTECTION_CONVERSIONS);
+            assert(Protection::faults() == Protection::OverCurrentCharge);
+            assert(transistors() == 0);
+
+            // A single conversion out of the window is noise, not a fault
+            static_assert(HardwareConfig::PROTECTION_CONVERSIONS == 2, "The glitch below assumes two conversions to trip");
+            startHealthy(adc);
+            setPack(adc, 3700, 3700, 3700, -11000);
+            adc.scan(1);
+            setPack(adc, 3700, 3700, 3700, -1000);
+            adc.scan(10);
+            assert(Protection::faults() == 0);
+            assert(transistors() == (CHARGE | OUTPUT));
+
+            // Until every ring is full the main loop leaves the alarms and the transistors alone: the temperature
+            // ring still averages in its empty slots, and a code of 0 reads as 125C
+            setPack(adc, 3700, 3700, 3700, 0);
+            adc.input(Analog::Temperature) = 512;  // 25C, the thermistor matches its series resistor
+            Protection::begin();
+            Analog::begin();
+            adc.start();
+            adc.scan(2);
+            assert(!Analog::primed());
+
+            checkValuesAndSetStates();
+            assert(!BATTERY_STATUS.overTempAlarm);
+            assert(transistors() == 0);
+
+            adc.scan(64 * Analog::RING_SIZE + 2);
+            assert(Analog::primed());
+
+            checkValuesAndSetStates();
+            assert(!BATTERY_STATUS.overTempAlarm);
+            assert(transistors() & OUTPUT);
+        }
+
+        /**
+         * Cycle-level model of the free-running ADC: conversion k of the scan starts at k * CONVERSION_CYCLES,
+         * samples its input SAMPLE_CYCLES later and interrupts when it completes, ISR_CYCLES before the port write.
+         * The fault is injected at every ADC clock of a scan on each checked channel in turn, and the worst time to
+         * the transistors opening must stay within the documented bound.
+        **/
+        void testProtectionLatency() {
+            static_assert(!HardwareConfig::ADC_NOISE_REDUCTION, "The host models the free-running ADC, the default everywhere");
+
+            const uint8_t channels[] = { Analog::Current, Analog::Cell0, Analog::Cell1, Analog::Cell2 };
+            const uint16_t STEP = 1 << HardwareConfig::ADC_PRESCALER_BITS;  // One ADC clock
+            const uint32_t SCAN = (uint32_t)Protection::CONVERSION_CYCLES * Analog::COUNT;
+            uint32_t worst = 0;
+
+            MockADC adc;
+
+            for (uint8_t channel : channels) {
+                for (uint32_t offset = 0; offset < SCAN; offset += STEP) {
+                    startHealthy(adc);
+
+                    // Both ways out of the window, whatever the channel
+                    uint32_t fault = SCAN + offset;
+                    bool tripped = false;
+
+                    for (uint32_t conversion = 0; !tripped; ++conversion) {
+                        uint32_t start = conversion * Protection::CONVERSION_CYCLES;
+
+                        // Whatever the sample and hold caught is what this conversion reports
+                        if (start + Protection::SAMPLE_CYCLES >= fault) {
+                            if (channel == Analog::Current) {
+                                setPack(adc, 3700, 3700, 3700, -11000);
+                            } else {
+                                setPack(adc, channel == Analog::Cell0 ? 4400 : 3700, channel == Analog::Cell1 ? 4400 : 3700,
+                                        channel == Analog::Cell2 ? 4400 : 3700, 0);
+                            }
+                        }
+
+                        adc.complete();
+
+                        if (!(transistors() & CHARGE)) {
+                            uint32_t latency = start + Protection::CONVERSION_CYCLES + Protection::ISR_CYCLES - fault;
+                            worst = latency > worst ? latency : worst;
+                            tripped = true;
+                        }
+
+                        assert(conversion < 10 * Analog::COUNT);
+                    }
+                }
+            }
+
+            printf("Protection: worst reaction %u cycles (%.0fus at %luMHz), bound %lu cycles; ISR time estimated\n",
+                   (unsigned)worst, worst * 1e6 / F_CPU, F_CPU / 1000000, (unsigned long)Protection::LATENCY_CYCLES);
+
+            assert(worst <= Protection::LATENCY_CYCLES);
+            assert(worst > Protection::LATENCY_CYCLES - STEP);
+        }
+
+        void benchmarkProtection() {
+            const uint32_t CONVERSIONS = 50000000;
+            uint16_t codes[Analog::COUNT] = { 512, 758, 758, 758, 758, 500 };
+
+            Protection::begin();
+
+            volatile uint8_t sink = 0;
+            clock_t start = clock();
+
+            for (uint32_t i = 0; i < CONVERSIONS; ++i) {
+                uint8_t channel = i % Analog::COUNT;
+                Protection::check(channel, codes[channel] + (i & 1));
+            }
+
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            sink = Protection::faults();
+            (void)sink;
+
+            printf("Protection window check: %.1f ns per conversion\n", seconds * 1e9 / CONVERSIONS);
+        }
+    }
+}
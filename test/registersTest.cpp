@@ -0,0 +1,81 @@
+#include "pec.hpp"
+#include "registers.hpp"
+#include "utils.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        static void assertEntry(const Registers::RegisterFile &registers, Registers::Register index, uint16_t value) {
+            const uint8_t *entry = registers.entry(index);
+            uint8_t data[] = { (uint8_t)(value & 0xff), (uint8_t)(value >> 8) };
+            uint8_t command = Registers::COMMANDS[index];
+
+            assert(entry[0] == data[0]);
+            assert(entry[1] == data[1]);
+            assert(entry[2] == Utils::calculateCRC(data, 2, command, false));
+            assert(registers.get(index) == value);
+        }
+
+        void testRegisterFile() {
+            Registers::RegisterFile registers;
+
+            for (uint8_t index = 0; index < Registers::COUNT; ++index) {
+                assertEntry(registers, (Registers::Register)index, 0);
+            }
+
+            assert(registers.set(Registers::Voltage, 12600));
+            assertEntry(registers, Registers::Voltage, 12600);
+
+            // Unchanged values don't touch the entry
+            assert(!registers.set(Registers::Voltage, 12600));
+            assertEntry(registers, Registers::Voltage, 12600);
+
+            assert(registers.set(Registers::Current, (uint16_t)-1500));
+            assertEntry(registers, Registers::Current, (uint16_t)-1500);
+
+            // Only the low byte changing still refreshes the PEC
+            assert(registers.set(Registers::RemainingCapacity, 0x00e0));
+            assert(registers.set(Registers::RemainingCapacity, 0x00e1));
+            assertEntry(registers, Registers::RemainingCapacity, 0x00e1);
+        }
+
+        // What the ISR does per word read, before (PEC over the whole reply) and after (three loads)
+        void benchmarkRegisterFile() {
+            const uint32_t ITERATIONS = 2000000;
+            Registers::RegisterFile registers;
+            registers.set(Registers::Voltage, 12600);
+
+            volatile uint8_t sink = 0;
+            volatile uint16_t value = 12600;
+            clock_t start;
+
+            start = clock();
+            for (uint32_t i = 0; i < ITERATIONS; ++i) {
+                uint8_t crc = PEC::seed(0x09);
+                crc = PEC::update(crc, value & 0xff);
+                crc = PEC::update(crc, value >> 8);
+                sink = value & 0xff;
+                sink = value >> 8;
+                sink = crc;
+            }
+            double computed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            start = clock();
+            for (uint32_t i = 0; i < ITERATIONS; ++i) {
+                const uint8_t *entry = registers.entry(Registers::Voltage);
+                sink = entry[0];
+                sink = entry[1];
+                sink = entry[2];
+            }
+            double cached = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            (void)sink;
+            printf("Word read (ns/reply): computed PEC %.1f, register file %.1f\n",
+                   computed * 1e9 / ITERATIONS, cached * 1e9 / ITERATIONS);
+        }
+    }
+}
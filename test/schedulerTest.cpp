@@ -0,0 +1,93 @@
+#include "scheduler.hpp"
+#include <assert.h>
+#include <stdint.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        static uint16_t FAST_RUNS = 0;
+        static uint16_t SLOW_RUNS = 0;
+        static uint8_t SLOW_TASK_TICKS = 0;  // How long the slow task pretends to run
+
+        static void fastTask() {
+            ++FAST_RUNS;
+        }
+
+        static void slowTask() {
+            ++SLOW_RUNS;
+
+            for (uint8_t i = 0; i < SLOW_TASK_TICKS; ++i) {
+                Scheduler::tick();
+            }
+        }
+
+        static const Scheduler::Task TEST_TASKS[] PROGMEM = {
+            { fastTask, 5,   5 },
+            { slowTask, 100, 10 },
+        };
+
+        static void advance(uint16_t ticks, Scheduler::TaskState (&states)[2]) {
+            for (uint16_t i = 0; i < ticks; ++i) {
+                Scheduler::tick();
+                Scheduler::runPending(TEST_TASKS, states);
+            }
+        }
+
+        void testScheduler() {
+            Scheduler::TaskState states[2] = {};
+            uint16_t start = Scheduler::now();
+            states[0].release = start;
+            states[1].release = start;
+
+            // Both tasks are due immediately, then at their own rates
+            Scheduler::runPending(TEST_TASKS, states);
+            assert(FAST_RUNS == 1 && SLOW_RUNS == 1);
+
+            advance(1000, states);
+            assert(FAST_RUNS == 201);
+            assert(SLOW_RUNS == 11);
+            assert(states[0].overruns == 0 && states[1].overruns == 0);
+
+            // A run that blows its deadline is counted...
+            SLOW_TASK_TICKS = 20;
+            advance(100, states);
+            assert(SLOW_RUNS == 12);
+            assert(states[1].overruns == 1);
+
+            // ...and so is one that takes longer than its period, which also skips the missed releases
+            SLOW_TASK_TICKS = 250;
+            advance(100, states);
+            assert(SLOW_RUNS == 13);
+            assert(states[1].overruns == 3);
+
+            // The fast task was starved meanwhile and caught up without running back-to-back
+            uint16_t fastRuns = FAST_RUNS;
+            SLOW_TASK_TICKS = 0;
+            advance(5, states);
+            assert(FAST_RUNS - fastRuns <= 2);
+            assert(states[0].overruns > 0);
+
+            // Survives the tick counter wrapping around
+            uint16_t slowRuns = SLOW_RUNS;
+            advance(65535, states);
+            advance(1000, states);
+            assert(SLOW_RUNS - slowRuns >= 665 && SLOW_RUNS - slowRuns <= 666);
+
+            // From schedule(), nothing runs on the first tick: each task first comes due one period in
+            fastRuns = FAST_RUNS;
+            slowRuns = SLOW_RUNS;
+            Scheduler::schedule(TEST_TASKS, states);
+            assert(states[0].overruns == 0 && states[1].overruns == 0);
+            Scheduler::runPending(TEST_TASKS, states);
+            advance(4, states);
+            assert(FAST_RUNS == fastRuns && SLOW_RUNS == slowRuns);
+            advance(1, states);
+            assert(FAST_RUNS == fastRuns + 1 && SLOW_RUNS == slowRuns);
+            advance(94, states);
+            assert(SLOW_RUNS == slowRuns);
+            advance(1, states);
+            assert(SLOW_RUNS == slowRuns + 1);
+            assert(states[0].overruns == 0 && states[1].overruns == 0);
+        }
+    }
+}
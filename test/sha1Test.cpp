@@ -0,0 +1,176 @@
+#include "sha1.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        constexpr uint32_t hashOfABC() {
+            const uint8_t message[] = { 'a', 'b', 'c' };
+            SHA1::State state = SHA1::INITIAL;
+            SHA1::finish(state, message, sizeof(message), 0);
+
+            return state.h[0];
+        }
+
+        // The midstates are worked out by the compiler, so the compiler has to get it right too
+        static_assert(hashOfABC() == 0xa9993e36, "SHA-1 of \"abc\" at build time");
+
+        static void hexToBytes(const char *hex, uint8_t *bytes) {
+            for (uint8_t x = 0; hex[2 * x]; ++x) {
+                unsigned byte;
+                sscanf(hex + 2 * x, "%2x", &byte);
+                bytes[x] = byte;
+            }
+        }
+
+        // HMAC-SHA1 the way the firmware does it, from the key midstates, with any key and message
+        static void hmac(const uint8_t *key, uint16_t keyLength, const uint8_t *message, uint16_t length,
+                         uint8_t *output) {
+            SHA1::State state = SHA1::keyMidstate(key, keyLength, SHA1::IPAD);
+            SHA1::finish(state, message, length, SHA1::BLOCK_SIZE);
+            SHA1::digest(state, output);
+
+            state = SHA1::keyMidstate(key, keyLength, SHA1::OPAD);
+            SHA1::finish(state, output, SHA1::DIGEST_SIZE, SHA1::BLOCK_SIZE);
+            SHA1::digest(state, output);
+        }
+
+        void testSHA1() {
+            uint8_t expected[SHA1::DIGEST_SIZE];
+            uint8_t output[SHA1::DIGEST_SIZE];
+
+            // FIPS 180 examples, and the lengths either side of the padding needing its own block
+            {
+                struct Vector {
+                    const char *message;
+                    const char *digest;
+                };
+
+                const Vector VECTORS[] = {
+                    { "", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+                    { "abc", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+                    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+                      "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+                    { "0123456701234567012345670123456701234567012345670123456",
+                      "adfc128b4a89c560e754c1659a6a90968b55490e" },
+                    { "0123456701234567012345670123456701234567012345670123456701234567",
+                      "e0c094e867ef46c350ef54a7f59dd60bed92ae83" }
+                };
+
+                for (const Vector &vector : VECTORS) {
+                    SHA1::State state = SHA1::INITIAL;
+                    SHA1::finish(state, (const uint8_t *)vector.message, strlen(vector.message), 0);
+                    SHA1::digest(state, output);
+
+                    hexToBytes(vector.digest, expected);
+                    assert(memcmp(output, expected, SHA1::DIGEST_SIZE) == 0);
+                }
+            }
+
+            // RFC 2202 HMAC-SHA1 test cases 1-7, including keys longer than a block and a two block message
+            {
+                struct Vector {
+                    uint8_t key[80];
+                    uint8_t keyLength;
+                    uint8_t data[80];
+                    uint8_t dataLength;
+                    const char *digest;
+                };
+
+                static Vector VECTORS[7] = {};
+
+                memset(VECTORS[0].key, 0x0b, VECTORS[0].keyLength = 20);
+                memcpy(VECTORS[0].data, "Hi There", VECTORS[0].dataLength = 8);
+                VECTORS[0].digest = "b617318655057264e28bc0b6fb378c8ef146be00";
+
+                memcpy(VECTORS[1].key, "Jefe", VECTORS[1].keyLength = 4);
+                memcpy(VECTORS[1].data, "what do ya want for nothing?", VECTORS[1].dataLength = 28);
+                VECTORS[1].digest = "effcdf6ae5eb2fa2d27416d5f184df9c259a7c79";
+
+                memset(VECTORS[2].key, 0xaa, VECTORS[2].keyLength = 20);
+                memset(VECTORS[2].data, 0xdd, VECTORS[2].dataLength = 50);
+                VECTORS[2].digest = "125d7342b9ac11cd91a39af48aa17b4f63f175d3";
+
+                for (uint8_t x = 0; x < 25; ++x) {
+                    VECTORS[3].key[x] = x + 1;
+                }
+                VECTORS[3].keyLength = 25;
+                memset(VECTORS[3].data, 0xcd, VECTORS[3].dataLength = 50);
+                VECTORS[3].digest = "4c9007f4026250c6bc8414f9bf50c86c2d7235da";
+
+                memset(VECTORS[4].key, 0x0c, VECTORS[4].keyLength = 20);
+                memcpy(VECTORS[4].data, "Test With Truncation", VECTORS[4].dataLength = 20);
+                VECTORS[4].digest = "4c1a03424b55e07fe7f27be1d58bb9324a9a5a04";
+
+                memset(VECTORS[5].key, 0xaa, VECTORS[5].keyLength = 80);
+                memcpy(VECTORS[5].data, "Test Using Larger Than Block-Size Key - Hash Key First",
+                       VECTORS[5].dataLength = 54);
+                VECTORS[5].digest = "aa4ae5e15272d00e95705637ce8a3b55ed402112";
+
+                memset(VECTORS[6].key, 0xaa, VECTORS[6].keyLength = 80);
+                memcpy(VECTORS[6].data, "Test Using Larger Than Block-Size Key and Larger Than One Block-Size Data",
+                       VECTORS[6].dataLength = 73);
+                VECTORS[6].digest = "e8e99d0f45237d786d6bbaa7965c7808bbff1a91";
+
+                for (const Vector &vector : VECTORS) {
+                    hmac(vector.key, vector.keyLength, vector.data, vector.dataLength, output);
+
+                    hexToBytes(vector.digest, expected);
+                    assert(memcmp(output, expected, SHA1::DIGEST_SIZE) == 0);
+                }
+
+                // The firmware's steps, hashing 20 byte messages in place from the midstates: case 5's message
+                // is 20 bytes with a 20 byte key
+                const SHA1::State inner = SHA1::keyMidstate(VECTORS[4].key, 20, SHA1::IPAD);
+                const SHA1::State outer = SHA1::keyMidstate(VECTORS[4].key, 20, SHA1::OPAD);
+
+                memcpy(output, VECTORS[4].data, SHA1::DIGEST_SIZE);
+                SHA1::finishInPlace(&inner, output);
+                SHA1::finishInPlace(&outer, output);
+
+                hexToBytes(VECTORS[4].digest, expected);
+                assert(memcmp(output, expected, SHA1::DIGEST_SIZE) == 0);
+            }
+
+            // In place and by block agree whatever the message, down to each bit of it
+            {
+                const SHA1::State midstate = SHA1::keyMidstate((const uint8_t *)"key", 3, SHA1::IPAD);
+                uint8_t message[SHA1::DIGEST_SIZE] = {};
+
+                for (uint8_t bit = 0; bit < 8 * SHA1::DIGEST_SIZE; ++bit) {
+                    message[bit >> 3] ^= 1 << (bit & 7);
+
+                    SHA1::State state = midstate;
+                    SHA1::finish(state, message, SHA1::DIGEST_SIZE, SHA1::BLOCK_SIZE);
+                    SHA1::digest(state, expected);
+
+                    memcpy(output, message, SHA1::DIGEST_SIZE);
+                    SHA1::finishInPlace(&midstate, output);
+                    assert(memcmp(output, expected, SHA1::DIGEST_SIZE) == 0);
+                }
+            }
+        }
+
+        // One compression, which is what a main loop step of 0x2f costs
+        void benchmarkSHA1() {
+            const uint32_t ITERATIONS = 1000000;
+            const SHA1::State midstate = SHA1::INITIAL;
+            uint8_t challenge[SHA1::DIGEST_SIZE] = { 0 };
+
+            clock_t start = clock();
+            for (uint32_t x = 0; x < ITERATIONS; ++x) {
+                SHA1::finishInPlace(&midstate, challenge);
+            }
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            printf("SHA-1: %.1f ns per compression; scratch %u bytes on the stack per step (block %u, working "
+                   "variables %u), no static RAM\n", seconds * 1e9 / ITERATIONS,
+                   (unsigned)(sizeof(SHA1::InPlace::rest) + sizeof(SHA1::State)),
+                   (unsigned)sizeof(SHA1::InPlace::rest), (unsigned)sizeof(SHA1::State));
+        }
+    }
+}
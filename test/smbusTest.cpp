@@ -0,0 +1,265 @@
+#include "OpenSmartBattery.hpp"
+#include "config.hpp"
+#include "mockUSI.hpp"
+#include "pec.hpp"
+#include "platform.hpp"
+#include "registers.hpp"
+#include "replies.hpp"
+#include "smbus.hpp"
+#include "utils.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        // Write Word with PEC: address, command, LSB, MSB, PEC, STOP
+        static void writeWord(MockUSI &usi, uint8_t command, uint16_t value) {
+            uint8_t crc = PEC::update(PEC::update(0, PEC::ADDRESS_WRITE), command);
+            crc = PEC::update(PEC::update(crc, value & 0xff), value >> 8);
+
+            usi.start();
+            assert(usi.send(PEC::ADDRESS_WRITE));
+            assert(usi.send(command));
+            assert(usi.send(value & 0xff));
+            assert(usi.send(value >> 8));
+            assert(usi.send(crc));
+            usi.stop();
+        }
+
+        // Read of `length` bytes: address, command, repeated start, read address, bytes, NACK on the last, STOP
+        static void read(MockUSI &usi, uint8_t command, uint8_t *bytes, uint8_t length) {
+            usi.start();
+            assert(usi.send(PEC::ADDRESS_WRITE));
+            assert(usi.send(command));
+            usi.start();
+            assert(usi.send(PEC::ADDRESS_READ));
+
+            for (uint8_t x = 0; x < length; ++x) {
+                bytes[x] = usi.receive(x < length - 1);
+            }
+
+            assert(usi.listening());
+            usi.stop();
+        }
+
+        void testSMBus() {
+            MockUSI usi;
+            SMBus::begin();
+            assert(usi.listening());
+
+            // Write Word: only handed over once the STOP has been seen
+            {
+                BATTERY_STATUS.errorCode = Utils::AlarmErrorCode::UnknownError;
+                writeWord(usi, 0x01, 0x1234);
+                assert(BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::UnknownError);
+
+                SMBus::poll();
+                assert(BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::Ok);
+            }
+
+            // Read Word: the command byte is handed over on the repeated start, and the reply is written with the
+            // clock stretched, before the host gets to its first byte
+            {
+                REGISTERS.set(Registers::Voltage, 12600);
+
+                uint8_t bytes[3];
+                read(usi, 0x09, bytes, 3);
+                assert(memcmp(bytes, REGISTERS.entry(Registers::Voltage), 3) == 0);
+            }
+
+            // BatteryStatus tells how the write before it went as soon as the host can ask, not once the main
+            // loop has published it
+            {
+                writeWord(usi, 0x09, 0x1234);
+                SMBus::poll();
+
+                uint8_t bytes[3];
+                read(usi, 0x16, bytes, 3);
+                assert((bytes[0] & 0x0f) == Utils::AlarmErrorCode::AccessDenied);
+                assert(bytes[2] == Utils::calculateCRC(bytes, 2, 0x16, false));
+            }
+
+            // Block Read: length, string, PEC. Reading on gets the idle bus level.
+            {
+                constexpr auto vendor = StaticReplies::blockReply(0x20, BatteryConfig::BATTERY_VENDOR);
+                const uint8_t length = vendor.bytes[0];
+
+                uint8_t bytes[SMBus::BUFFER_SIZE];
+                read(usi, 0x20, bytes, length + 2);
+                assert(memcmp(bytes, vendor.bytes + 1, length) == 0);
+                assert(bytes[length] == 0xff && bytes[length + 1] == 0xff);
+            }
+
+            // Block Write of the full 32 bytes: command, length, 32 bytes, PEC. It fits, but 0x2f only takes a
+            // challenge of its own size.
+            {
+                uint8_t frame[SMBus::BUFFER_SIZE] = { 0x2f, 32 };
+                uint8_t crc = PEC::update(PEC::update(PEC::update(0, PEC::ADDRESS_WRITE), 0x2f), 32);
+                for (uint8_t x = 2; x < SMBus::BUFFER_SIZE - 1; ++x) {
+                    frame[x] = x;
+                    crc = PEC::update(crc, x);
+                }
+                frame[SMBus::BUFFER_SIZE - 1] = crc;
+
+                usi.start();
+                assert(usi.send(PEC::ADDRESS_WRITE));
+                for (uint8_t x = 0; x < SMBus::BUFFER_SIZE; ++x) {
+                    assert(usi.send(frame[x]));
+                }
+
+                // One byte more than any write is NACKed, and the write is refused as too long
+                assert(!usi.send(0xaa));
+                assert(usi.listening());
+                usi.stop();
+
+                SMBus::poll();
+                assert(BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::OverflowUnderflow);
+
+                usi.start();
+                assert(usi.send(PEC::ADDRESS_WRITE));
+                for (uint8_t x = 0; x < SMBus::BUFFER_SIZE; ++x) {
+                    assert(usi.send(frame[x]));
+                }
+                usi.stop();
+
+                SMBus::poll();
+                assert(BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::BadSize);
+            }
+
+            // Transactions for other devices are not ACKed, and the rest of them goes by without interrupts
+            {
+                BATTERY_STATUS.errorCode = Utils::AlarmErrorCode::UnknownError;
+
+                usi.start();
+                assert(!usi.send(0x09 << 1));
+                assert(usi.listening());
+                uint32_t interrupts = usi.interrupts;
+                assert(!usi.send(0x14));
+                assert(usi.interrupts == interrupts);
+                usi.stop();
+
+                SMBus::poll();
+                assert(BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::UnknownError);
+            }
+
+            // A write that the next START cuts short, without a STOP, is still handed over: here a word command
+            // with one byte of its word
+            {
+                usi.start();
+                assert(usi.send(PEC::ADDRESS_WRITE));
+                assert(usi.send(0x03));
+                assert(usi.send(0x80));
+                usi.start();
+                assert(BATTERY_STATUS.errorCode == Utils::AlarmErrorCode::BadSize);
+
+                assert(!usi.send(0x10));
+                usi.stop();
+            }
+
+            // A START whose SCL never falls is given up on rather than waited out in the interrupt, and the
+            // next transaction goes through as usual
+            {
+                usi.start(false);
+                assert(usi.listening());
+                assert(!(USISR & _BV(USISIF)));
+                usi.stop();
+
+                uint8_t bytes[3];
+                read(usi, 0x09, bytes, 3);
+                assert(memcmp(bytes, REGISTERS.entry(Registers::Voltage), 3) == 0);
+            }
+        }
+
+        // Send a frame as master, a poll a tick; returns how it ended
+        static Broadcast::Outcome sendFrame(MockUSIBus &bus, const uint8_t *frame, uint8_t length, uint8_t &polls) {
+            Broadcast::Outcome outcome = Broadcast::Pending;
+            polls = 0;
+
+            SMBus::Master::start(frame, length);
+
+            while (outcome == Broadcast::Pending) {
+                outcome = SMBus::Master::poll();
+                bus.settle(1000);
+                ++polls;
+            }
+
+            return outcome;
+        }
+
+        void testUSIMaster() {
+            SMBus::begin();
+            MockUSIBus bus;
+            uint8_t polls;
+            assert(SMBus::Master::idle());
+
+            // ChargingVoltage to the charger: a byte and its ACK per poll, then the STOP
+            const uint8_t frame[] = { 0x12, 0x15, 0x38, 0x31, 0x00 };
+            assert(sendFrame(bus, frame, 5, polls) == Broadcast::Sent);
+            assert(polls == 5);
+            assert(bus.starts == 1 && bus.stops == 1);
+            assert(bus.count == 5 && memcmp(bus.received, frame, 5) == 0);
+
+            // Back to the slave side, with both lines let go of
+            assert(SMBus::Master::idle());
+            assert(USICR & _BV(USISIE));
+            assert(!(DDRA & _BV(SMBus::DATA_PIN)));
+
+            // Nobody at the host's address: NACKed, and still a STOP
+            const uint8_t host[] = { 0x10, 0x16, 0x00, 0x40, 0x00 };
+            assert(sendFrame(bus, host, 5, polls) == Broadcast::Nack);
+            assert(polls == 1);
+            assert(bus.stops == 2);
+
+            // The host sending at the same time wins at the seventh bit, and we let go without a STOP
+            bus.rival = 0x10;
+            assert(sendFrame(bus, frame, 5, polls) == Broadcast::Lost);
+            assert(polls == 1 && bus.starts == 3 && bus.stops == 2);
+            assert((PORTA & _BV(SMBus::CLOCK_PIN)) && !(DDRA & _BV(SMBus::DATA_PIN)));
+            bus.rivalStop();
+            assert(bus.stops == 3);
+
+            // A device stretching the clock after the address costs a poll, and nothing else
+            bus.stretch = 200;
+            assert(sendFrame(bus, frame, 5, polls) == Broadcast::Sent);
+            assert(polls == 6);
+            assert(bus.count == 5 && memcmp(bus.received, frame, 5) == 0);
+
+            // One that holds on for longer than tTIMEOUT has lost the frame
+            bus.stretch = 30000;
+            assert(sendFrame(bus, frame, 5, polls) == Broadcast::Lost);
+            assert(polls == 26);
+
+            SMBus::begin();
+        }
+
+        void benchmarkSMBus() {
+            const uint32_t TRANSACTIONS = 1000000;
+            MockUSI usi;
+            SMBus::begin();
+            REGISTERS.set(Registers::Voltage, 12600);
+
+            uint8_t bytes[3];
+            uint32_t interrupts = usi.interrupts;
+            clock_t start = clock();
+
+            for (uint32_t x = 0; x < TRANSACTIONS; ++x) {
+                read(usi, 0x09, bytes, 3);
+            }
+
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            printf("SMBus Read Word through the USI driver: %u interrupts, %.1f ns per transaction with the mock\n",
+                   (unsigned)((usi.interrupts - interrupts) / TRANSACTIONS), seconds * 1e9 / TRANSACTIONS);
+        }
+    }
+}
+
+// The USI master's busy waits are where the mock bus moves
+void _delay_us(double us) {
+    if (OpenSmartBattery::Tests::MockUSIBus::ACTIVE) {
+        OpenSmartBattery::Tests::MockUSIBus::ACTIVE->settle(us);
+    }
+}
@@ -0,0 +1,82 @@
+#include "config.hpp"
+#include "thermistor.hpp"
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        // What the firmware would do without the table: the beta equation in floating point
+        static float floatTemperature(uint16_t code) {
+            const float full = 1 << Thermistor::CODE_BITS;
+            float resistance = HardwareConfig::THERMISTOR_SERIES * code / (full - code);
+
+            return 10 / (1 / 298.15f + logf(resistance / HardwareConfig::THERMISTOR_R25) / HardwareConfig::THERMISTOR_BETA);
+        }
+
+        void testThermistor() {
+            const uint16_t FULL = 1 << Thermistor::CODE_BITS;
+
+            // The build-time logarithm is as good as the library's
+            for (double x = 0.01; x < 100; x *= 1.37) {
+                assert(fabs(Thermistor::logarithm(x) - log(x)) < 1e-12);
+            }
+
+            // Half scale is R25
+            assert(Thermistor::temperature(FULL / 2) == 2982);
+
+            // Within 0.35K of the exact curve from -20C to 80C, and falling with the code throughout
+            uint16_t previous = Thermistor::temperature(0);
+            double worst = 0;
+
+            for (uint16_t code = 1; code < FULL; ++code) {
+                uint16_t tenths = Thermistor::temperature(code);
+                double exact = floatTemperature(code);
+
+                assert(tenths <= previous);
+                previous = tenths;
+
+                if (exact > 2532 && exact < 3532) {
+                    double error = fabs(tenths - exact);
+                    worst = error > worst ? error : worst;
+                }
+            }
+
+            printf("Thermistor table: worst error %.2fK from -20C to 80C\n", worst / 10);
+            assert(worst < 3.5);
+
+            // An open or shorted thermistor reads as the coldest or hottest temperature, not garbage
+            assert(Thermistor::temperature(0) == Thermistor::HOTTEST);
+            assert(Thermistor::temperature(FULL - 1) == Thermistor::COLDEST);
+        }
+
+        void benchmarkThermistor() {
+            const uint32_t CALLS = 10000000;
+            const uint16_t MASK = (1 << Thermistor::CODE_BITS) - 1;
+            volatile uint32_t sink = 0;
+
+            clock_t start = clock();
+            for (uint32_t call = 0; call < CALLS; ++call) {
+                sink = sink + Thermistor::temperature((call * 7) & MASK);
+            }
+            double table = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            volatile float floatSink = 0;
+
+            start = clock();
+            for (uint32_t call = 0; call < CALLS; ++call) {
+                floatSink = floatSink + floatTemperature(((call * 7) & MASK) | 1);
+            }
+            double floating = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            (void)sink;
+            (void)floatSink;
+
+            printf("Thermistor (ns/call): table %.1f, float beta equation %.1f; table %u bytes of flash\n",
+                   table * 1e9 / CALLS, floating * 1e9 / CALLS, (unsigned)sizeof(Thermistor::Table));
+        }
+    }
+}
@@ -0,0 +1,195 @@
+#include "OpenSmartBattery.hpp"
+#include "pec.hpp"
+#include "registers.hpp"
+#include "scheduler.hpp"
+#include "utils.hpp"
+#include "writes.hpp"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace OpenSmartBattery {
+    namespace Tests {
+
+        // Write Word with PEC, as handed over by the driver: command, LSB, MSB, PEC
+        static void wordWrite(uint8_t *frame, uint8_t command, uint16_t value) {
+            frame[0] = command;
+            frame[1] = value & 0xff;
+            frame[2] = value >> 8;
+            frame[3] = PEC::update(PEC::update(PEC::update(PEC::update(0, PEC::ADDRESS_WRITE), command),
+                                               frame[1]), frame[2]);
+        }
+
+        static Utils::AlarmErrorCode send(uint8_t command, uint16_t value) {
+            uint8_t frame[4];
+            wordWrite(frame, command, value);
+            receiveEvent(frame, sizeof(frame));
+
+            return BATTERY_STATUS.errorCode;
+        }
+
+        static Utils::AlarmErrorCode request(uint8_t command) {
+            receiveEvent(&command, 1);
+            requestEvent();
+
+            return BATTERY_STATUS.errorCode;
+        }
+
+        static void assertRegister(Registers::Register index, uint16_t value) {
+            const uint8_t *entry = REGISTERS.entry(index);
+            uint8_t data[] = { (uint8_t)(value & 0xff), (uint8_t)(value >> 8) };
+
+            assert(REGISTERS.get(index) == value);
+            assert(entry[2] == Utils::calculateCRC(data, 2, Registers::COMMANDS[index], false));
+        }
+
+        void testWrites() {
+            using Utils::AlarmErrorCode;
+            Writes::Write write;
+
+            // The queue keeps order, and refuses what doesn't fit; it carries on across the index wrapping
+            {
+                applyWrites();
+
+                for (uint16_t round = 0; round < 300; ++round) {
+                    for (uint8_t x = 0; x < Writes::QUEUE_SIZE; ++x) {
+                        assert(Writes::push(x, round + x));
+                    }
+                    assert(!Writes::push(0xff, 0));
+
+                    for (uint8_t x = 0; x < Writes::QUEUE_SIZE; ++x) {
+                        assert(Writes::take(write) && write.command == x && write.value == round + x);
+                    }
+                    assert(!Writes::take(write));
+                }
+            }
+
+            // Registers change in the main loop, not in the interrupt, and read back with a valid PEC
+            {
+                uint16_t initial = REGISTERS.get(Registers::RemainingCapacityAlarm);
+                assert(initial == Utils::BATTERY_CAPACITY_DESIGN / 10);
+
+                assert(send(0x01, 500) == AlarmErrorCode::Ok);
+                assert(send(0x02, 5) == AlarmErrorCode::Ok);
+                assert(send(0x04, (uint16_t)-1000) == AlarmErrorCode::Ok);
+                assert(REGISTERS.get(Registers::RemainingCapacityAlarm) == initial);
+
+                applyWrites();
+                assertRegister(Registers::RemainingCapacityAlarm, 500);
+                assertRegister(Registers::RemainingTimeAlarm, 5);
+                assertRegister(Registers::AtRate, (uint16_t)-1000);
+            }
+
+            // BatteryMode: only the R/W bits are taken, and those that need hardware only if the pack has it
+            {
+                assert(send(0x03, 0xffff) == AlarmErrorCode::Ok);
+                applyWrites();
+
+                Utils::BatteryMode defaults = Utils::BatteryMode();
+                assert(BATTERY_MODE.internalChargeController == defaults.internalChargeController);
+                assert(BATTERY_MODE.conditionFlag == defaults.conditionFlag);
+                assert(BATTERY_MODE.chargeControllerEnabled == defaults.internalChargeController);
+                assert(BATTERY_MODE.primaryBattery == defaults.primaryBatterySupport);
+                assert(BATTERY_MODE.alarmMode && BATTERY_MODE.chargerMode && BATTERY_MODE.capacityMode);
+                assertRegister(Registers::BatteryMode, BATTERY_MODE.asWord());
+
+                assert(send(0x03, 0x0000) == AlarmErrorCode::Ok);
+                applyWrites();
+                assert(!BATTERY_MODE.alarmMode && !BATTERY_MODE.chargerMode && !BATTERY_MODE.capacityMode);
+                assertRegister(Registers::BatteryMode, BATTERY_MODE.asWord());
+            }
+
+            // AlarmMode times out 30s after the host last set it, not after the first time
+            {
+                assert(send(0x03, 1 << 13) == AlarmErrorCode::Ok);
+                applyWrites();
+
+                for (uint16_t x = 0; x < 20 * Scheduler::TICK_HZ; ++x) {
+                    Scheduler::tick();
+                }
+                checkAlarmModeTimeout();
+                assert(BATTERY_MODE.alarmMode);
+
+                assert(send(0x03, 1 << 13) == AlarmErrorCode::Ok);
+                applyWrites();
+
+                for (uint16_t x = 0; x < 20 * Scheduler::TICK_HZ; ++x) {
+                    Scheduler::tick();
+                }
+                checkAlarmModeTimeout();
+                assert(BATTERY_MODE.alarmMode);
+
+                for (uint16_t x = 0; x < 11 * Scheduler::TICK_HZ; ++x) {
+                    Scheduler::tick();
+                }
+                checkAlarmModeTimeout();
+                assert(!BATTERY_MODE.alarmMode);
+            }
+
+            // Refused writes never reach the queue
+            {
+                assert(send(0x09, 12000) == AlarmErrorCode::AccessDenied);
+                assert(send(0x1d, 1) == AlarmErrorCode::ReservedCommand);
+                assert(send(0x40, 1) == AlarmErrorCode::UnsupportedCommand);
+                assert(send(0xa0, 1) == AlarmErrorCode::UnsupportedCommand);
+
+                uint8_t frame[4];
+                wordWrite(frame, 0x01, 700);
+                frame[3] ^= 0x10;
+                receiveEvent(frame, sizeof(frame));
+                assert(BATTERY_STATUS.errorCode == AlarmErrorCode::UnknownError);
+
+                assert(!Writes::take(write));
+                assertRegister(Registers::RemainingCapacityAlarm, 500);
+            }
+
+            // A full queue is Busy until the main loop has caught up
+            {
+                for (uint8_t x = 0; x < Writes::QUEUE_SIZE; ++x) {
+                    assert(send(0x01, 600 + x) == AlarmErrorCode::Ok);
+                }
+                assert(send(0x01, 700) == AlarmErrorCode::Busy);
+
+                applyWrites();
+                assertRegister(Registers::RemainingCapacityAlarm, 600 + Writes::QUEUE_SIZE - 1);
+                assert(send(0x01, 700) == AlarmErrorCode::Ok);
+                applyWrites();
+            }
+
+            // Reads: commands without a reply say why, others clear the code, except BatteryStatus itself
+            {
+                assert(request(0x1e) == AlarmErrorCode::ReservedCommand);
+                assert(request(0x16) == AlarmErrorCode::ReservedCommand);
+                assert(request(0x62) == AlarmErrorCode::UnsupportedCommand);
+                assert(request(0x09) == AlarmErrorCode::Ok);
+            }
+        }
+
+        // What the interrupt spends on each writable register: the same path for all of them
+        void benchmarkWrites() {
+            const uint32_t ITERATIONS = 1000000;
+            const uint8_t COMMANDS[] = { 0x01, 0x02, 0x03, 0x04 };
+            Writes::Write write;
+
+            applyWrites();
+            printf("Word write in the interrupt (ns/write):");
+
+            for (uint8_t command : COMMANDS) {
+                uint8_t frame[4];
+                wordWrite(frame, command, 0x2000);
+
+                clock_t start = clock();
+                for (uint32_t x = 0; x < ITERATIONS; ++x) {
+                    receiveEvent(frame, sizeof(frame));
+                    Writes::take(write);
+                }
+                double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+                printf(" 0x%02x %.1f", command, seconds * 1e9 / ITERATIONS);
+            }
+
+            printf(" (with the main loop's take)\n");
+        }
+    }
+}